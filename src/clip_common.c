@@ -1,7 +1,13 @@
+#define _GNU_SOURCE
 #include "clip_common.h"
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#define CLIP_REQUIRED_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
 
 char **clip_create_typelist(size_t count, ...)
 {
@@ -17,6 +23,17 @@ char **clip_create_typelist(size_t count, ...)
   return result;
 }
 
+char **clip_copy_typelist(char **types)
+{
+  size_t count = clip_typelist_count(types);
+  char **result = (char **)malloc(sizeof(char *) * (count + 1));
+  for (size_t i = 0; i < count; i++) {
+    result[i] = strdup(types[i]);
+  }
+  result[count] = NULL;
+  return result;
+}
+
 void clip_free_typelist(char** types)
 {
   for(int i = 0; types[i] != NULL; i++) {
@@ -77,3 +94,150 @@ char *clip_string_from_data(const unsigned char *data, size_t datalen)
   result[datalen] = '\0';
   return result;
 }
+
+// The xxHash64 algorithm: four independent lanes of 64-bit
+// multiply-and-rotate, so the CPU works on 32 bytes at a time
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+  acc += input * PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+static uint64_t hash_merge(uint64_t acc, uint64_t lane)
+{
+  acc ^= hash_round(0, lane);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t clip_hash64(const void *data, size_t datalen)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  const unsigned char *end = p + datalen;
+  uint64_t h;
+
+  if (datalen >= 32) {
+    uint64_t v1 = PRIME64_1 + PRIME64_2;
+    uint64_t v2 = PRIME64_2;
+    uint64_t v3 = 0;
+    uint64_t v4 = -PRIME64_1;
+    const unsigned char *limit = end - 32;
+    do {
+      v1 = hash_round(v1, read64(p));
+      v2 = hash_round(v2, read64(p + 8));
+      v3 = hash_round(v3, read64(p + 16));
+      v4 = hash_round(v4, read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = hash_merge(h, v1);
+    h = hash_merge(h, v2);
+    h = hash_merge(h, v3);
+    h = hash_merge(h, v4);
+  } else {
+    h = PRIME64_5;
+  }
+  h += (uint64_t)datalen;
+
+  while (p + 8 <= end) {
+    h ^= hash_round(0, read64(p));
+    h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    p += 8;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t)read32(p) * PRIME64_1;
+    h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= (*p) * PRIME64_5;
+    h = rotl64(h, 11) * PRIME64_1;
+    p++;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+int clip_growable_memfd(const char *name)
+{
+  return memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+}
+
+int clip_write_all(int fd, size_t datalen, const void *data)
+{
+  // Write it in pieces: write() may stop short on big payloads
+  const unsigned char *current = (const unsigned char *)data;
+  size_t remaining = datalen;
+  while (remaining > 0) {
+    ssize_t written = write(fd, current, remaining);
+    if (written < 0) {
+      return -1;
+    }
+    current += written;
+    remaining -= written;
+  }
+  return 1;
+}
+
+int clip_seal_memfd(int fd)
+{
+  if (fcntl(fd, F_ADD_SEALS, CLIP_REQUIRED_SEALS | F_SEAL_SEAL) < 0) {
+    return -1;
+  }
+  return 1;
+}
+
+int clip_sealed_memfd(const char *name, size_t datalen, const void *data)
+{
+  int fd = clip_growable_memfd(name);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (ftruncate(fd, datalen) < 0
+      || clip_write_all(fd, datalen, data) < 0
+      || clip_seal_memfd(fd) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int clip_fd_is_sealed(int fd)
+{
+  int seals = fcntl(fd, F_GET_SEALS);
+  if (seals < 0) {
+    return 0;
+  }
+  return (seals & CLIP_REQUIRED_SEALS) == CLIP_REQUIRED_SEALS;
+}
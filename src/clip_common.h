@@ -2,12 +2,19 @@
 #define CLIP_COMMON_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #define CLIP_DESTIN "us.hilleg.clipd"
 #define CLIP_PATH        "/us/hilleg/clipd"
 #define CLIP_INTERFACE   "us.hilleg.clipd.Manager"
+// Lazy data providers serve this interface at CLIP_PATH on their own connection
+#define CLIP_PROVIDER_INTERFACE "us.hilleg.clipd.Provider"
+// clipd also serves CLIP_INTERFACE to direct connections on this socket
+// in $XDG_RUNTIME_DIR/clipd, skipping the broker
+#define CLIP_PEER_SOCKET "bus"
 
-// The server has several clipboads
+// The server has several clipboads. These are built in; more are made by
+// name on demand, with ids of CLIPBOARD_COUNT and up.
 #define CLIPBOARD_GENERAL (0)
 #define CLIPBOARD_FIND (1)
 #define CLIPBOARD_STYLE (2)
@@ -17,9 +24,25 @@
 // Recommended length for labels
 #define CLIP_LABEL_LEN (20)
 
+// Payloads too big for one message are streamed in chunks.
+// CLIP_CHUNK_SIZE is what the client library sends and asks for;
+// clipd refuses chunks bigger than CLIP_MAX_CHUNK.
+#define CLIP_CHUNK_SIZE (1024 * 1024)
+#define CLIP_MAX_CHUNK (8 * 1024 * 1024)
+
+// Types can travel as atoms: numbers clipd hands out that stand for a
+// type until it restarts. Each atom comes with clipd's epoch, and clipd
+// answers atoms from another epoch with this error.
+#define CLIP_ERROR_STALE_ATOMS "us.hilleg.clipd.Error.StaleAtoms"
+
+// The answer to a fetch when the item has no data of the type, as opposed
+// to data that happens to be empty
+#define CLIP_ERROR_NO_DATA "us.hilleg.clipd.Error.NoData"
+
 #pragma mark Dealing with type lists
 
 char **clip_create_typelist(size_t count, ...);
+char **clip_copy_typelist(char **types);
 void clip_free_typelist(char** types);
 int clip_typelist_contains(char **types, const char *target);
 int clip_typelists_equal(char **a, char **b);
@@ -31,4 +54,27 @@ char *clip_trim_to_label(const char *text);
 // Convenience method for converting data to c string
 // Must free result after use
 char *clip_string_from_data(const unsigned char *data, size_t datalen);
+
+// A fast 64-bit hash of data, for recognizing identical payloads
+// (not for security)
+uint64_t clip_hash64(const void *data, size_t datalen);
+
+#pragma mark Sealed memory files
+
+// Large payloads can travel as a sealed memfd instead of a byte array:
+// only the file descriptor crosses the bus.
+
+// Create a memfd holding a copy of data, sealed against any further change
+// Returns the file descriptor (caller must close it) or -1 on error
+int clip_sealed_memfd(const char *name, size_t datalen, const void *data);
+
+// Building a memfd a piece at a time: create it empty, append to it,
+// then seal it once it is complete
+// Each returns -1 on error
+int clip_growable_memfd(const char *name);
+int clip_write_all(int fd, size_t datalen, const void *data);
+int clip_seal_memfd(int fd);
+
+// Returns 1 if fd can no longer be written, grown or shrunk, 0 otherwise
+int clip_fd_is_sealed(int fd);
 #endif
@@ -0,0 +1,347 @@
+#include "clip_lz4.h"
+#include <stdlib.h>
+#include <string.h>
+
+// The format's rules: matches are at least MINMATCH long, the last
+// LASTLITERALS bytes are always literals, and no match starts within
+// MFLIMIT bytes of the end.
+#define MINMATCH (4)
+#define LASTLITERALS (5)
+#define MFLIMIT (12)
+#define MAX_OFFSET (65535)
+
+#define HASH_LOG (12)
+
+static uint32_t read32(const unsigned char *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t hash4(uint32_t sequence)
+{
+  return (sequence * 2654435761u) >> (32 - HASH_LOG);
+}
+
+// Lengths of 15 or more continue in extra bytes of up to 255 each
+static unsigned char *write_length(unsigned char *op, size_t length)
+{
+  while (length >= 255) {
+    *op++ = 255;
+    length -= 255;
+  }
+  *op++ = (unsigned char)length;
+  return op;
+}
+
+// Room a sequence with these lengths could need
+static size_t sequence_bound(size_t literals, size_t match)
+{
+  return 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1;
+}
+
+size_t clip_lz4_compress_block(const unsigned char *src, size_t srclen,
+			       unsigned char *dst, size_t dstcap)
+{
+  // Positions in src, by the hash of the four bytes found there
+  uint32_t table[1 << HASH_LOG];
+  memset(table, 0, sizeof(table));
+
+  const unsigned char *ip = src;
+  const unsigned char *anchor = src;
+  const unsigned char *iend = src + srclen;
+  unsigned char *op = dst;
+  unsigned char *oend = dst + dstcap;
+
+  if (srclen > MFLIMIT) {
+    const unsigned char *mflimit = iend - MFLIMIT;
+    const unsigned char *matchlimit = iend - LASTLITERALS;
+    // Skip ahead faster the longer nothing matches
+    unsigned misses = 0;
+
+    while (ip < mflimit) {
+      uint32_t sequence = read32(ip);
+      uint32_t h = hash4(sequence);
+      const unsigned char *ref = src + table[h];
+      table[h] = (uint32_t)(ip - src);
+
+      if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != sequence) {
+	ip += 1 + (misses++ >> 6);
+	continue;
+      }
+      misses = 0;
+
+      // Grow the match backwards over literals, then forwards
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+	ip--;
+	ref--;
+      }
+      const unsigned char *match_end = ip + MINMATCH;
+      const unsigned char *ref_end = ref + MINMATCH;
+      while (match_end < matchlimit && *match_end == *ref_end) {
+	match_end++;
+	ref_end++;
+      }
+
+      size_t literals = ip - anchor;
+      size_t match = match_end - ip - MINMATCH;
+      if ((size_t)(oend - op) < sequence_bound(literals, match)) {
+	return 0;
+      }
+
+      unsigned char *token = op++;
+      *token = (unsigned char)((literals >= 15 ? 15 : literals) << 4);
+      if (literals >= 15) {
+	op = write_length(op, literals - 15);
+      }
+      memcpy(op, anchor, literals);
+      op += literals;
+
+      size_t offset = ip - ref;
+      *op++ = (unsigned char)(offset & 0xff);
+      *op++ = (unsigned char)(offset >> 8);
+
+      *token |= (unsigned char)(match >= 15 ? 15 : match);
+      if (match >= 15) {
+	op = write_length(op, match - 15);
+      }
+
+      ip = match_end;
+      anchor = ip;
+      if (ip < mflimit) {
+	table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+      }
+    }
+  }
+
+  // Whatever is left goes out as literals
+  size_t literals = iend - anchor;
+  if ((size_t)(oend - op) < sequence_bound(literals, 0)) {
+    return 0;
+  }
+  *op++ = (unsigned char)((literals >= 15 ? 15 : literals) << 4);
+  if (literals >= 15) {
+    op = write_length(op, literals - 15);
+  }
+  memcpy(op, anchor, literals);
+  op += literals;
+  return op - dst;
+}
+
+// Reads a length continued in extra bytes. Returns -1 if src runs out.
+static int read_length(const unsigned char **ipp, const unsigned char *iend, size_t *length)
+{
+  const unsigned char *ip = *ipp;
+  unsigned char b;
+  do {
+    if (ip >= iend) {
+      return -1;
+    }
+    b = *ip++;
+    *length += b;
+  } while (b == 255);
+  *ipp = ip;
+  return 1;
+}
+
+long clip_lz4_decompress_block(const unsigned char *src, size_t srclen,
+			       unsigned char *dst, size_t dstcap)
+{
+  const unsigned char *ip = src;
+  const unsigned char *iend = src + srclen;
+  unsigned char *op = dst;
+  unsigned char *oend = dst + dstcap;
+
+  while (ip < iend) {
+    unsigned char token = *ip++;
+
+    size_t literals = token >> 4;
+    if (literals == 15 && read_length(&ip, iend, &literals) < 0) {
+      return -1;
+    }
+    if (literals > (size_t)(iend - ip) || literals > (size_t)(oend - op)) {
+      return -1;
+    }
+    memcpy(op, ip, literals);
+    op += literals;
+    ip += literals;
+
+    // The last sequence has literals only
+    if (ip == iend) {
+      break;
+    }
+
+    if (iend - ip < 2) {
+      return -1;
+    }
+    size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - dst)) {
+      return -1;
+    }
+
+    size_t match = token & 15;
+    if (match == 15 && read_length(&ip, iend, &match) < 0) {
+      return -1;
+    }
+    match += MINMATCH;
+    if (match > (size_t)(oend - op)) {
+      return -1;
+    }
+
+    // Matches may overlap what they produce, so copy forwards
+    const unsigned char *ref = op - offset;
+    if (offset >= match) {
+      memcpy(op, ref, match);
+      op += match;
+    } else {
+      while (match-- > 0) {
+	*op++ = *ref++;
+      }
+    }
+  }
+  return op - dst;
+}
+
+size_t clip_lz4_frame_bound(size_t srclen)
+{
+  size_t blocks = (srclen + CLIP_LZ4_BLOCK_SIZE - 1) / CLIP_LZ4_BLOCK_SIZE;
+  return srclen + blocks * 4;
+}
+
+static void write_header(unsigned char *p, uint32_t header)
+{
+  p[0] = header & 0xff;
+  p[1] = (header >> 8) & 0xff;
+  p[2] = (header >> 16) & 0xff;
+  p[3] = header >> 24;
+}
+
+static uint32_t read_header(const unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+size_t clip_lz4_frame_encode(const unsigned char *src, size_t srclen, unsigned char *dst)
+{
+  unsigned char *op = dst;
+  size_t offset = 0;
+  while (offset < srclen) {
+    size_t blocklen = srclen - offset;
+    if (blocklen > CLIP_LZ4_BLOCK_SIZE) {
+      blocklen = CLIP_LZ4_BLOCK_SIZE;
+    }
+    // Only worth keeping if it is smaller than the original
+    size_t compressed = clip_lz4_compress_block(src + offset, blocklen, op + 4, blocklen - 1);
+    if (compressed > 0) {
+      write_header(op, (uint32_t)compressed);
+      op += 4 + compressed;
+    } else {
+      write_header(op, (uint32_t)blocklen | CLIP_LZ4_STORED_FLAG);
+      memcpy(op + 4, src + offset, blocklen);
+      op += 4 + blocklen;
+    }
+    offset += blocklen;
+  }
+  return op - dst;
+}
+
+int clip_lz4_frame_decode(const unsigned char *frame, size_t framelen,
+			  unsigned char *dst, size_t rawlen)
+{
+  const unsigned char *ip = frame;
+  const unsigned char *iend = frame + framelen;
+  size_t offset = 0;
+  while (offset < rawlen) {
+    if (iend - ip < 4) {
+      return -1;
+    }
+    uint32_t header = read_header(ip);
+    ip += 4;
+    size_t stored = header & ~CLIP_LZ4_STORED_FLAG;
+    if (stored > (size_t)(iend - ip)) {
+      return -1;
+    }
+
+    size_t blocklen = rawlen - offset;
+    if (blocklen > CLIP_LZ4_BLOCK_SIZE) {
+      blocklen = CLIP_LZ4_BLOCK_SIZE;
+    }
+    if (header & CLIP_LZ4_STORED_FLAG) {
+      if (stored != blocklen) {
+	return -1;
+      }
+      memcpy(dst + offset, ip, blocklen);
+    } else if (clip_lz4_decompress_block(ip, stored, dst + offset, blocklen) != (long)blocklen) {
+      return -1;
+    }
+    ip += stored;
+    offset += blocklen;
+  }
+  return ip == iend ? 1 : -1;
+}
+
+int clip_lz4_frame_decode_range(const unsigned char *frame, size_t framelen, size_t rawlen,
+				size_t offset, unsigned char *dst, size_t length)
+{
+  if (offset > rawlen || length > rawlen - offset) {
+    return -1;
+  }
+  const unsigned char *ip = frame;
+  const unsigned char *iend = frame + framelen;
+  // Blocks the range only partly covers are decoded here first
+  unsigned char *partial = NULL;
+  int r = 1;
+  size_t start = 0;
+  while (start < offset + length) {
+    if (iend - ip < 4) {
+      r = -1;
+      break;
+    }
+    uint32_t header = read_header(ip);
+    ip += 4;
+    size_t stored = header & ~CLIP_LZ4_STORED_FLAG;
+    if (stored > (size_t)(iend - ip)) {
+      r = -1;
+      break;
+    }
+
+    size_t blocklen = rawlen - start;
+    if (blocklen > CLIP_LZ4_BLOCK_SIZE) {
+      blocklen = CLIP_LZ4_BLOCK_SIZE;
+    }
+    // Headers alone get us to the first block of the range
+    if (start + blocklen > offset) {
+      size_t from = offset > start ? offset - start : 0;
+      size_t to = offset + length - start < blocklen ? offset + length - start : blocklen;
+      unsigned char *op = dst + (start + from - offset);
+      if (header & CLIP_LZ4_STORED_FLAG) {
+	if (stored != blocklen) {
+	  r = -1;
+	  break;
+	}
+	memcpy(op, ip + from, to - from);
+      } else if (from == 0 && to == blocklen) {
+	if (clip_lz4_decompress_block(ip, stored, op, blocklen) != (long)blocklen) {
+	  r = -1;
+	  break;
+	}
+      } else {
+	if (partial == NULL && (partial = (unsigned char *)malloc(CLIP_LZ4_BLOCK_SIZE)) == NULL) {
+	  r = -1;
+	  break;
+	}
+	if (clip_lz4_decompress_block(ip, stored, partial, blocklen) != (long)blocklen) {
+	  r = -1;
+	  break;
+	}
+	memcpy(op, partial + from, to - from);
+      }
+    }
+    ip += stored;
+    start += blocklen;
+  }
+  free(partial);
+  return r;
+}
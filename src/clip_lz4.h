@@ -0,0 +1,50 @@
+#ifndef CLIP_LZ4_H
+#define CLIP_LZ4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A small, dependency-free implementation of the LZ4 block format: fast
+// enough to compress on the way into clipd and decompress on the way out.
+//
+// clipd compresses data in independent blocks of CLIP_LZ4_BLOCK_SIZE
+// bytes, so one part can be decoded without decoding the rest. A frame is
+// a sequence of blocks, each introduced by a 32-bit little-endian header:
+// the length of the stored block, with the top bit set if the block is
+// stored as is because it didn't compress.
+#define CLIP_LZ4_BLOCK_SIZE (64 * 1024)
+#define CLIP_LZ4_STORED_FLAG (0x80000000u)
+
+// Name used for framed data on the wire
+#define CLIP_ENCODING_LZ4 "lz4-blocks"
+#define CLIP_ENCODING_IDENTITY "identity"
+
+// Compress one block of LZ4. Returns the compressed length, or 0 if it
+// doesn't fit in dstcap.
+size_t clip_lz4_compress_block(const unsigned char *src, size_t srclen,
+			       unsigned char *dst, size_t dstcap);
+
+// Decompress one block of LZ4. Returns the decompressed length, or -1
+// if src is damaged or the result doesn't fit in dstcap.
+long clip_lz4_decompress_block(const unsigned char *src, size_t srclen,
+			       unsigned char *dst, size_t dstcap);
+
+// The most a frame of srclen bytes can take
+size_t clip_lz4_frame_bound(size_t srclen);
+
+// Compress src into a frame at dst, which must have room for
+// clip_lz4_frame_bound(srclen) bytes. Returns the frame's length.
+size_t clip_lz4_frame_encode(const unsigned char *src, size_t srclen, unsigned char *dst);
+
+// Decompress a frame into dst, which must be exactly rawlen bytes.
+// Returns -1 if the frame is damaged.
+int clip_lz4_frame_decode(const unsigned char *frame, size_t framelen,
+			  unsigned char *dst, size_t rawlen);
+
+// Decompress length bytes from offset of a frame of rawlen bytes into dst,
+// decoding only the blocks that cover them.
+// Returns -1 if the frame is damaged or the range is out of bounds.
+int clip_lz4_frame_decode_range(const unsigned char *frame, size_t framelen, size_t rawlen,
+				size_t offset, unsigned char *dst, size_t length);
+
+#endif
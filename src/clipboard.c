@@ -1,16 +1,580 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <systemd/sd-bus.h>
 #include "clipboard.h"
+#include "clip_lz4.h"
 
 static sd_bus *bus = NULL;
+// The signals that keep the cache current, on a connection of their own
+// (see catch_up)
+static sd_bus *cache_bus = NULL;
+// A direct connection to clipd, when it offers one (see Peer connection)
+static sd_bus *peer = NULL;
+// Set when clipd restarts, so the next call tries its new socket
+static int peer_wanted = 0;
+// How many times the peer connection dropped in the middle of a call
+static unsigned peer_losses = 0;
 
-// Just one data_provider, one change_handler, one provider_release
-// function per pasteboard
-static clip_data_provider data_providers[CLIPBOARD_COUNT];
-static clip_change_handler change_handlers[CLIPBOARD_COUNT];
-static clip_provider_release provider_release[CLIPBOARD_COUNT];
+#pragma mark Peer connection
 
+// Every byte sent on the session bus is copied through the broker, so
+// the calls that move data, and that readers make often, go straight to
+// clipd on its socket in $XDG_RUNTIME_DIR/clipd instead. Creating items
+// stays on the session bus, where clipd learns who to ask for promised
+// data, as do signals and the _async calls.
+
+static void open_peer()
+{
+  const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (runtime_dir == NULL || *runtime_dir == '\0') {
+    return;
+  }
+  char address[PATH_MAX];
+  snprintf(address, sizeof(address), "unix:path=%s/clipd/%s", runtime_dir, CLIP_PEER_SOCKET);
+
+  sd_bus *b = NULL;
+  int r = sd_bus_new(&b);
+  if (r >= 0) {
+    r = sd_bus_set_address(b, address);
+  }
+  if (r >= 0) {
+    r = sd_bus_negotiate_fds(b, 1);
+  }
+  if (r >= 0) {
+    r = sd_bus_start(b);
+  }
+  if (r < 0) {
+    // An older clipd, or none yet: the session bus will do
+    sd_bus_unref(b);
+    return;
+  }
+  peer = b;
+}
+
+static void close_peer()
+{
+  peer = sd_bus_flush_close_unref(peer);
+}
+
+// A call to clipd on the peer connection if there is one, or else the
+// session bus
+static int new_clipd_call(sd_bus_message **m, const char *member)
+{
+  if (peer == NULL && peer_wanted) {
+    peer_wanted = 0;
+    open_peer();
+  }
+  if (peer) {
+    return sd_bus_message_new_method_call(peer, m, NULL, CLIP_PATH, CLIP_INTERFACE, member);
+  }
+  return sd_bus_message_new_method_call(bus, m, CLIP_DESTIN, CLIP_PATH, CLIP_INTERFACE, member);
+}
+
+// The calls that only read, and so can safely be sent twice. clipd may
+// have acted on anything else before the peer connection dropped, and
+// uploads belong to the connection that began them anyway.
+static const char *resendable_calls[] = {
+  "ItemCount", "FetchTypelist", "FetchData", "FetchDataCompressed", "FetchDataFd",
+  "GetDataSize", "FetchRange", "FetchItems", "SearchItems", "InternTypes",
+  "TypesForAtoms", "FetchTypelistAtoms", "FetchDataByAtom", NULL
+};
+
+static int resendable(const char *member)
+{
+  for (int i = 0; member && resendable_calls[i]; i++) {
+    if (strcmp(member, resendable_calls[i]) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Send m, made by new_clipd_call, and wait for the reply. If the peer
+// connection turns out to be gone, a read goes again on the session bus;
+// anything else fails.
+static int call_clipd_message(sd_bus_message *m, sd_bus_error *error, sd_bus_message **reply)
+{
+  int r = sd_bus_call(NULL, m, -1, error, reply);
+  if (r >= 0 || peer == NULL || sd_bus_message_get_bus(m) != peer || sd_bus_is_open(peer) > 0) {
+    return r;
+  }
+  close_peer();
+  peer_losses++;
+  if (!resendable(sd_bus_message_get_member(m))) {
+    return r;
+  }
+  sd_bus_error_free(error);
+
+  sd_bus_message *again = NULL;
+  r = sd_bus_message_new_method_call(bus, &again, CLIP_DESTIN, CLIP_PATH, CLIP_INTERFACE,
+				     sd_bus_message_get_member(m));
+  if (r >= 0) {
+    r = sd_bus_message_rewind(m, 1);
+  }
+  if (r >= 0) {
+    r = sd_bus_message_copy(again, m, 1);
+  }
+  if (r >= 0) {
+    r = sd_bus_call(bus, again, -1, error, reply);
+  } else {
+    sd_bus_error_set_errno(error, r);
+  }
+  sd_bus_message_unref(again);
+  return r;
+}
+
+// sd_bus_call_method for clipd's calls that may go on the peer connection
+static int call_clipd(const char *member, sd_bus_error *error, sd_bus_message **reply,
+		      const char *types, ...)
+{
+  sd_bus_message *m = NULL;
+  int r = new_clipd_call(&m, member);
+  if (r >= 0) {
+    va_list ap;
+    va_start(ap, types);
+    r = sd_bus_message_appendv(m, types, ap);
+    va_end(ap);
+  }
+  if (r >= 0) {
+    r = call_clipd_message(m, error, reply);
+  } else {
+    sd_bus_error_set_errno(error, r);
+  }
+  sd_bus_message_unref(m);
+  return r;
+}
+
+#pragma mark Cache
+
+// Items don't change once their data is pushed, so what we have fetched
+// is kept and handed out again without asking clipd. ClipboardChanged
+// and ItemsPushedOut tell us the new count and which items have fallen
+// off the ring. ClipboardChanged may be held back for a window, so a
+// count isn't trusted until the window after the last one is over.
+#define CACHE_ITEMS (16)
+#define CACHE_TYPES (8)
+// Bigger payloads are always fetched
+#define CACHE_MAX_PAYLOAD (1024 * 1024)
+#define CACHE_BYTES (16 * 1024 * 1024)
+
+struct cached_data {
+  char *type;
+  unsigned char *bytes;
+  size_t datalen;
+  uint64_t last_used;
+};
+
+// item_id 0 marks an empty slot
+struct cached_item {
+  uint16_t item_id;
+  char **typelist;
+  struct cached_data data[CACHE_TYPES];
+};
+
+// A held signal takes a moment to reach us after its window
+#define SIGNAL_SLACK_USEC (10 * 1000)
+
+struct board_cache {
+  int count_known;
+  // On CLOCK_MONOTONIC: until then, clipd may have items it hasn't announced
+  uint64_t count_unsure_until;
+  uint16_t last_item_id;
+  uint16_t item_count;
+  // An item we made whose signal hasn't come yet, or 0. Signals from
+  // before it are stale and don't make the count known again.
+  uint16_t awaited_item_id;
+  struct cached_item items[CACHE_ITEMS];
+};
+
+// Everything we keep for one board: just one data_provider, one
+// change_handler, one provider_release function per board, and its cache
+struct board_state {
+  uint16_t board;
+  clip_data_provider data_provider;
+  clip_change_handler change_handler;
+  clip_coalesced_change_handler coalesced_change_handler;
+  clip_provider_release provider_release;
+  struct board_cache cache;
+  struct board_state *next;
+};
+
+// The built-in boards are always here. Named boards get their state when
+// first used, and are found by hashing their id.
+#define BOARD_BUCKETS (64)
+static struct board_state builtin_boards[CLIPBOARD_COUNT] = {
+  { .board = CLIPBOARD_GENERAL }, { .board = CLIPBOARD_FIND },
+  { .board = CLIPBOARD_STYLE }, { .board = CLIPBOARD_DRAG }
+};
+static struct board_state *named_boards[BOARD_BUCKETS];
+
+// Returns NULL if we have nothing for the board, unless create is set
+static struct board_state *find_board(uint16_t board, int create)
+{
+  if (board < CLIPBOARD_COUNT) {
+    return &builtin_boards[board];
+  }
+  struct board_state **bucket = &named_boards[board % BOARD_BUCKETS];
+  for (struct board_state *state = *bucket; state; state = state->next) {
+    if (state->board == board) {
+      return state;
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+  struct board_state *state = calloc(1, sizeof(*state));
+  if (state == NULL) {
+    return NULL;
+  }
+  state->board = board;
+  state->next = *bucket;
+  *bucket = state;
+  return state;
+}
+
+// Walks every board we have state for, starting from NULL
+static struct board_state *next_board(struct board_state *state)
+{
+  if (state == NULL) {
+    return &builtin_boards[0];
+  }
+  if (state->board < CLIPBOARD_COUNT - 1) {
+    return &builtin_boards[state->board + 1];
+  }
+  if (state->board >= CLIPBOARD_COUNT && state->next) {
+    return state->next;
+  }
+  int bucket = state->board < CLIPBOARD_COUNT ? 0 : state->board % BOARD_BUCKETS + 1;
+  for (; bucket < BOARD_BUCKETS; bucket++) {
+    if (named_boards[bucket]) {
+      return named_boards[bucket];
+    }
+  }
+  return NULL;
+}
+
+static size_t cached_bytes = 0;
+static uint64_t cache_clock = 0;
+
+static void forget_data(struct cached_data *data)
+{
+  cached_bytes -= data->datalen;
+  free(data->type);
+  free(data->bytes);
+  memset(data, 0, sizeof(*data));
+}
+
+static void forget_item(struct cached_item *item)
+{
+  if (item->typelist) {
+    clip_free_typelist(item->typelist);
+  }
+  for (int i = 0; i < CACHE_TYPES; i++) {
+    if (item->data[i].type) {
+      forget_data(&item->data[i]);
+    }
+  }
+  memset(item, 0, sizeof(*item));
+}
+
+static void forget_board(struct board_state *state)
+{
+  for (int i = 0; i < CACHE_ITEMS; i++) {
+    forget_item(&state->cache.items[i]);
+  }
+  state->cache.count_known = 0;
+  state->cache.awaited_item_id = 0;
+}
+
+static void forget_atoms();
+
+static void forget_everything()
+{
+  for (struct board_state *state = next_board(NULL); state; state = next_board(state)) {
+    forget_board(state);
+  }
+  forget_atoms();
+}
+
+// clipd dropped a named board, so its id means nothing any more
+static void drop_board(uint16_t board)
+{
+  if (board < CLIPBOARD_COUNT) {
+    return;
+  }
+  struct board_state **link = &named_boards[board % BOARD_BUCKETS];
+  for (; *link; link = &(*link)->next) {
+    struct board_state *state = *link;
+    if (state->board == board) {
+      forget_board(state);
+      *link = state->next;
+      free(state);
+      return;
+    }
+  }
+}
+
+// Signals that arrived while we were blocked in a call are still queued;
+// handle them so the cache is current. Only cache_bus is drained: it has
+// nothing but the cache's own matches, so no change handler, provider or
+// async callback of the app's runs in the middle of a reading call.
+static void catch_up()
+{
+  while (cache_bus && sd_bus_process(cache_bus, NULL) > 0);
+}
+
+static uint64_t monotonic_usec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int count_trusted(const struct board_cache *cache)
+{
+  return cache->count_known && monotonic_usec() >= cache->count_unsure_until;
+}
+
+// Item 0 means the last item, if we know which that is
+static struct cached_item *cached_item(uint16_t board, uint16_t item_id)
+{
+  catch_up();
+  struct board_state *state = find_board(board, 0);
+  if (state == NULL) {
+    return NULL;
+  }
+  if (item_id == 0) {
+    if (!count_trusted(&state->cache)) {
+      return NULL;
+    }
+    item_id = state->cache.last_item_id;
+  }
+  for (int i = 0; i < CACHE_ITEMS; i++) {
+    if (item_id != 0 && state->cache.items[i].item_id == item_id) {
+      return &state->cache.items[i];
+    }
+  }
+  return NULL;
+}
+
+// The slot for item_id, taking the one with the oldest item if need be
+static struct cached_item *cache_slot(uint16_t board, uint16_t item_id)
+{
+  struct board_state *state = item_id ? find_board(board, 1) : NULL;
+  if (state == NULL) {
+    return NULL;
+  }
+  struct cached_item *oldest = NULL;
+  for (int i = 0; i < CACHE_ITEMS; i++) {
+    struct cached_item *item = &state->cache.items[i];
+    if (item->item_id == item_id) {
+      return item;
+    }
+    if (oldest == NULL || item->item_id < oldest->item_id) {
+      oldest = item;
+    }
+  }
+  forget_item(oldest);
+  oldest->item_id = item_id;
+  return oldest;
+}
+
+static struct cached_data *cached_data(uint16_t board, uint16_t item_id, const char *type)
+{
+  struct cached_item *item = cached_item(board, item_id);
+  if (item == NULL) {
+    return NULL;
+  }
+  for (int i = 0; i < CACHE_TYPES; i++) {
+    if (item->data[i].type && strcmp(item->data[i].type, type) == 0) {
+      item->data[i].last_used = ++cache_clock;
+      return &item->data[i];
+    }
+  }
+  return NULL;
+}
+
+// Make room for datalen more bytes by dropping the least recently used data
+static void trim_cache(size_t datalen)
+{
+  while (cached_bytes > 0 && cached_bytes + datalen > CACHE_BYTES) {
+    struct cached_data *victim = NULL;
+    for (struct board_state *state = next_board(NULL); state; state = next_board(state)) {
+      for (int i = 0; i < CACHE_ITEMS; i++) {
+	for (int j = 0; j < CACHE_TYPES; j++) {
+	  struct cached_data *data = &state->cache.items[i].data[j];
+	  if (data->type && (victim == NULL || data->last_used < victim->last_used)) {
+	    victim = data;
+	  }
+	}
+      }
+    }
+    forget_data(victim);
+  }
+}
+
+static void cache_data(uint16_t board, uint16_t item_id, const char *type,
+		       const unsigned char *bytes, size_t datalen)
+{
+  if (datalen > CACHE_MAX_PAYLOAD) {
+    return;
+  }
+  trim_cache(datalen);
+  struct cached_item *item = cache_slot(board, item_id);
+  if (item == NULL) {
+    return;
+  }
+  struct cached_data *slot = NULL;
+  for (int i = 0; i < CACHE_TYPES; i++) {
+    if (item->data[i].type == NULL) {
+      slot = &item->data[i];
+      break;
+    }
+  }
+  if (slot == NULL) {
+    return;
+  }
+  slot->bytes = (unsigned char *)malloc(datalen);
+  if (datalen > 0 && slot->bytes == NULL) {
+    return;
+  }
+  memcpy(slot->bytes, bytes, datalen);
+  slot->type = strdup(type);
+  slot->datalen = datalen;
+  slot->last_used = ++cache_clock;
+  cached_bytes += datalen;
+}
+
+// Item ids run from 1 to INT16_MAX and start over; an id is "at or after"
+// another if it is less than half the ring of ids ahead of it
+static int item_at_or_after(uint16_t item_id, uint16_t other_id)
+{
+  return (item_id - other_id + INT16_MAX) % INT16_MAX < INT16_MAX / 2;
+}
+
+// The ring changed: the count is what the signal says, and items that are
+// no longer on the ring (or are from before clipd restarted) are dropped
+static void cache_ring_changed(struct board_state *state, uint16_t last_item_id, uint16_t item_count)
+{
+  struct board_cache *cache = &state->cache;
+  // Queued from before something newer we learned, say from ItemCount
+  if (cache->count_known && !item_at_or_after(last_item_id, cache->last_item_id)) {
+    return;
+  }
+  if (cache->awaited_item_id != 0) {
+    if (!item_at_or_after(last_item_id, cache->awaited_item_id)) {
+      return;
+    }
+    cache->awaited_item_id = 0;
+  }
+  cache->count_known = 1;
+  cache->last_item_id = last_item_id;
+  cache->item_count = item_count;
+  for (int i = 0; i < CACHE_ITEMS; i++) {
+    uint16_t item_id = cache->items[i].item_id;
+    if (item_id != 0 && (item_id > last_item_id || last_item_id - item_id >= item_count)) {
+      forget_item(&cache->items[i]);
+    }
+  }
+}
+
+// We made item_id, and clipd's reply can beat the signal for it here: the
+// count and last item we have are behind until that signal comes
+static void cache_item_created(uint16_t board, uint16_t item_id)
+{
+  struct board_state *state = find_board(board, 1);
+  if (state && item_id != 0) {
+    state->cache.count_known = 0;
+    state->cache.awaited_item_id = item_id;
+  }
+}
+
+// clipd went away or came back; nothing we know is reliable
+static int owner_changed_cb(sd_bus_message *m, void *user_data, sd_bus_error *ret_error)
+{
+  forget_everything();
+  close_peer();
+  peer_wanted = 1;
+  return 0;
+}
+
+// Items pushed out without a new item: a byte budget or a smaller ring
+static int items_pushed_out_cb(sd_bus_message *m, void *user_data, sd_bus_error *ret_error)
+{
+  uint16_t board, last_item_id, item_count;
+  if (sd_bus_message_read(m, "qqq", &board, &last_item_id, &item_count) > 0) {
+    struct board_state *state = find_board(board, 0);
+    if (state) {
+      cache_ring_changed(state, last_item_id, item_count);
+    }
+  }
+  return 0;
+}
+
+static int board_dropped_cb(sd_bus_message *m, void *user_data, sd_bus_error *ret_error)
+{
+  uint16_t board;
+  if (sd_bus_message_read(m, "q", &board) > 0) {
+    drop_board(board);
+  }
+  return 0;
+}
+
+
+// The arguments of ClipboardChanged. Older clipds don't say how many
+// items the signal stands for, or how long the next ones may be held back.
+static int read_clipboard_changed(sd_bus_message *m, uint16_t *clipboard, uint16_t *last_item_id,
+				  char **label, uint16_t *item_count, uint32_t *skipped,
+				  uint64_t *window)
+{
+  int r = sd_bus_message_read(m, "qqsq", clipboard, last_item_id, label, item_count);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse signal message: %s\n", strerror(-r));
+    return r;
+  }
+  *skipped = 0;
+  *window = 0;
+  if (sd_bus_message_read(m, "u", skipped) <= 0) {
+    *skipped = 0;
+  } else if (sd_bus_message_read(m, "t", window) <= 0) {
+    *window = 0;
+  }
+  return r;
+}
+
+static void cache_clipboard_changed(struct board_state *state, uint16_t last_item_id,
+				    uint16_t item_count, uint64_t window)
+{
+  cache_ring_changed(state, last_item_id, item_count);
+  if (window > 0) {
+    state->cache.count_unsure_until = monotonic_usec() + window + SIGNAL_SLACK_USEC;
+  }
+}
+
+// ClipboardChanged on cache_bus: only the cache hears it there
+static int cache_signal_cb(sd_bus_message *m, void *user_data, sd_bus_error *ret_error)
+{
+  uint16_t clipboard, last_item_id, item_count;
+  char *label;
+  uint32_t skipped;
+  uint64_t window;
+  if (read_clipboard_changed(m, &clipboard, &last_item_id, &label, &item_count,
+			     &skipped, &window) < 0) {
+    return -1;
+  }
+  struct board_state *state = find_board(clipboard, 0);
+  if (state) {
+    cache_clipboard_changed(state, last_item_id, item_count, window);
+  }
+  return 0;
+}
 
 // A callback for received signals
 static int bus_signal_cb(sd_bus_message *m, void *user_data, sd_bus_error
@@ -18,22 +582,134 @@ static int bus_signal_cb(sd_bus_message *m, void *user_data, sd_bus_error
     int r = 0;
     uint16_t clipboard, last_item_id, item_count;
     char *label;
+    uint32_t skipped;
+    uint64_t window;
 
-    r = sd_bus_message_read(m, "qqsq", &clipboard, &last_item_id, &label, &item_count);
+    r = read_clipboard_changed(m, &clipboard, &last_item_id, &label, &item_count,
+			       &skipped, &window);
     if (r < 0) {
-        fprintf(stderr, "Failed to parse signal message: %s\n", strerror(-r));
         return -1;
     }
+    // Boards we have never used have no cache and no handlers
+    struct board_state *state = find_board(clipboard, 0);
+    if (state == NULL) {
+        return 0;
+    }
+    // cache_bus may not have this one yet, and the handlers are likely to
+    // read the new item. Anything it has already had is left alone.
+    if (!state->cache.count_known || last_item_id != state->cache.last_item_id) {
+        cache_clipboard_changed(state, last_item_id, item_count, window);
+    }
 
-    clip_change_handler ch = change_handlers[clipboard];
+    clip_change_handler ch = state->change_handler;
     if (ch) {
       ch(clipboard, last_item_id, label, item_count);
     } 
+    clip_coalesced_change_handler cch = state->coalesced_change_handler;
+    if (cch) {
+      cch(clipboard, last_item_id, label, item_count, skipped);
+    }
     // fprintf(stderr, "Note: Clipboard %u, item %u: \"%s\" was added for a total of %u items\n", clipboard, last_item_id, label, item_count);
 
-    sd_bus_message_unref(m);
+    // The message belongs to sd-bus
+    return 0;
+}
+
+
+// clipd calls this when a reader wants data that was promised but not pushed
+static int method_provide_data(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  int r;
+  uint16_t board, item_id;
+  char *type;
+  r = sd_bus_message_read(m, "qqs", &board, &item_id, &type);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse ProvideData call: %s\n", strerror(-r));
+    return r;
+  }
+
+  struct board_state *state = find_board(board, 0);
+  clip_data_provider provider = state ? state->data_provider : NULL;
+  if (provider == NULL) {
+    return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_FAILED, "No data provider for clipboard %u", board);
+  }
+
+  unsigned char *data = NULL;
+  size_t datalen = provider(board, item_id, type, &data);
+  if (data == NULL && datalen > 0) {
+    return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_FAILED, "Provider had no %s for item %u", type, item_id);
+  }
+
+  sd_bus_message *reply = NULL;
+  r = sd_bus_message_new_method_return(m, &reply);
+  if (r >= 0) {
+    sd_bus_message_append_array(reply, 'y', data, datalen);
+    r = sd_bus_send(bus, reply, NULL);
+  }
+  sd_bus_message_unref(reply);
+  free(data);
+  return r;
+}
+
+// clipd calls this, once for many items, when items we created are
+// pushed out
+static int method_release_items(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  int r;
+  uint16_t board, item_id;
+  r = sd_bus_message_enter_container(m, 'a', "(qq)");
+  while (r >= 0 && (r = sd_bus_message_read(m, "(qq)", &board, &item_id)) > 0) {
+    struct board_state *state = find_board(board, 0);
+    if (state && state->provider_release) {
+      state->provider_release(board, item_id);
+    }
+  }
+  if (r >= 0) {
+    r = sd_bus_message_exit_container(m);
+  }
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse ReleaseItems call: %s\n", strerror(-r));
+    return r;
+  }
+  return sd_bus_reply_method_return(m, "");
 }
 
+static const sd_bus_vtable provider_vtable[] =
+  {SD_BUS_VTABLE_START(0),
+   SD_BUS_METHOD("ProvideData", "qqs", "ay",
+		 method_provide_data, SD_BUS_VTABLE_UNPRIVILEGED),
+   SD_BUS_METHOD("ReleaseItems", "a(qq)", "",
+		 method_release_items, SD_BUS_VTABLE_UNPRIVILEGED),
+   SD_BUS_VTABLE_END
+};
+
+// Everything the cache listens to, and nothing else
+static int open_cache_bus()
+{
+  int r = sd_bus_open_user(&cache_bus);
+  if (r < 0) {
+    fprintf(stderr, "Failed to connect to user bus: %s\n", strerror(-r));
+    return r;
+  }
+
+  r = sd_bus_add_match(cache_bus, NULL, "type='signal',member='ClipboardChanged'",
+		       cache_signal_cb, NULL);
+  if (r >= 0) {
+    r = sd_bus_add_match(cache_bus, NULL, "type='signal',member='BoardDropped'",
+			 board_dropped_cb, NULL);
+  }
+  if (r >= 0) {
+    r = sd_bus_add_match(cache_bus, NULL, "type='signal',member='ItemsPushedOut'",
+			 items_pushed_out_cb, NULL);
+  }
+  if (r >= 0) {
+    r = sd_bus_add_match(cache_bus, NULL,
+			 "type='signal',sender='org.freedesktop.DBus',member='NameOwnerChanged',"
+			 "arg0='" CLIP_DESTIN "'", owner_changed_cb, NULL);
+  }
+  if (r < 0) {
+    fprintf(stderr, "Failed: sd_bus_add_match: %s\n", strerror(-r));
+  }
+  return r;
+}
 
 int
 clip_open() {
@@ -56,34 +732,83 @@ clip_open() {
     fprintf(stderr, "Failed: sd_bus_add_match: %s\n", strerror(-r));
     return r;
   }
-    
+
+  r = open_cache_bus();
+  if (r < 0) {
+    return r;
+  }
+
+  // Answer clipd when it needs promised data
+  r = sd_bus_add_object_vtable(bus, NULL, CLIP_PATH, CLIP_PROVIDER_INTERFACE, provider_vtable, NULL);
+  if (r < 0) {
+    fprintf(stderr, "Failed: sd_bus_add_object_vtable: %s\n", strerror(-r));
+    return r;
+  }
+
+  open_peer();
   return 1;
 }
 
 int
 clip_close(){
   // FIXME: Provide needed data
+  close_peer();
   sd_bus_unref(bus);
   bus = NULL;
+  cache_bus = sd_bus_unref(cache_bus);
+  forget_everything();
 }
 
-uint16_t
-clip_create_item(uint16_t board, const char *label, char **typelist)
+int clip_open_board(const char *name, uint16_t max_items, uint64_t max_bytes)
 {
   int r;
-  uint16_t item_id = 0;
-
   if (!bus) {
     r = clip_open();
     if (r < 0) {
-      return 0;
+      return r;
     }
   }
 
   sd_bus_error error = SD_BUS_ERROR_NULL;
-  sd_bus_message *send_message = NULL;
-  sd_bus_message *reply_message = NULL;
-
+  sd_bus_message *m = NULL;
+  uint16_t board;
+  r = sd_bus_call_method(bus, CLIP_DESTIN, CLIP_PATH, CLIP_INTERFACE, "OpenBoard",
+			 &error, &m, "sqt", name, max_items, max_bytes);
+  if (r < 0) {
+    fprintf(stderr, "Call failed in OpenBoard: %s\n", error.message);
+    goto finish;
+  }
+
+  r = sd_bus_message_read(m, "q", &board);
+  if (r < 0) {
+    fprintf(stderr, "Read failed in OpenBoard\n");
+    goto finish;
+  }
+  r = board;
+
+ finish:
+  sd_bus_error_free(&error);
+  sd_bus_message_unref(m);
+  return r < 0 ? -1 : r;
+}
+
+uint16_t
+clip_create_item(uint16_t board, const char *label, char **typelist)
+{
+  int r;
+  uint16_t item_id = 0;
+
+  if (!bus) {
+    r = clip_open();
+    if (r < 0) {
+      return 0;
+    }
+  }
+
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *send_message = NULL;
+  sd_bus_message *reply_message = NULL;
+
   r = sd_bus_message_new_method_call(bus, &send_message, CLIP_DESTIN, CLIP_PATH,
 				     CLIP_INTERFACE, "CreateItem");
   if (r < 0) {
@@ -107,6 +832,87 @@ clip_create_item(uint16_t board, const char *label, char **typelist)
     fprintf(stderr, "Read failed in CreateItem\n");
     goto finish;
   }
+  cache_item_created(board, item_id);
+
+ finish:
+  sd_bus_error_free(&error);
+  sd_bus_message_unref(send_message);
+  sd_bus_message_unref(reply_message);
+  return item_id;
+}
+
+// The arguments of CreateItemWithData: the label and a dictionary of type
+// to data
+static int append_item_with_data(sd_bus_message *m, uint16_t board, const char *label,
+				 char **typelist, const size_t *datalens, const char **datas)
+{
+  int r = sd_bus_message_append(m, "qs", board, label);
+  if (r >= 0) {
+    r = sd_bus_message_open_container(m, 'a', "{say}");
+  }
+  for (int i = 0; r >= 0 && typelist[i] != NULL; i++) {
+    r = sd_bus_message_open_container(m, 'e', "say");
+    if (r >= 0) {
+      r = sd_bus_message_append(m, "s", typelist[i]);
+    }
+    if (r >= 0) {
+      r = sd_bus_message_append_array(m, 'y', datas[i], datalens[i]);
+    }
+    if (r >= 0) {
+      r = sd_bus_message_close_container(m);
+    }
+  }
+  if (r >= 0) {
+    r = sd_bus_message_close_container(m);
+  }
+  return r;
+}
+
+uint16_t
+clip_create_item_with_data(uint16_t board, const char *label, char **typelist,
+			   const size_t *datalens, const char **datas)
+{
+  int r;
+  uint16_t item_id = 0;
+
+  if (!bus) {
+    r = clip_open();
+    if (r < 0) {
+      return 0;
+    }
+  }
+
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *send_message = NULL;
+  sd_bus_message *reply_message = NULL;
+
+  r = sd_bus_message_new_method_call(bus, &send_message, CLIP_DESTIN, CLIP_PATH,
+				     CLIP_INTERFACE, "CreateItemWithData");
+  if (r < 0) {
+    fprintf(stderr, "Failed to create message to send: %s\n", strerror(-r));
+    goto finish;
+  }
+
+  r = append_item_with_data(send_message, board, label, typelist, datalens, datas);
+  if (r < 0) {
+    fprintf(stderr, "Failed to build CreateItemWithData: %s\n", strerror(-r));
+    goto finish;
+  }
+
+  r = sd_bus_call(bus, send_message, -1, &error, &reply_message);
+  if (r < 0) {
+    fprintf(stderr, "Call failed in CreateItemWithData: %s\n", error.message);
+    goto finish;
+  }
+
+  uint16_t pushed_out_id;
+  r = sd_bus_message_read(reply_message, "qq", &item_id, &pushed_out_id);
+  if (r < 0) {
+    fprintf(stderr, "Read failed in CreateItemWithData\n");
+    item_id = 0;
+    goto finish;
+  }
+  cache_item_created(board, item_id);
 
  finish:
   sd_bus_error_free(&error);
@@ -123,174 +929,1401 @@ int clip_push_data(uint16_t board, uint16_t item_id, const char *type, size_t da
   sd_bus_error error = SD_BUS_ERROR_NULL;
   sd_bus_message *send_message = NULL;
   sd_bus_message *reply_message = NULL;
-  r = sd_bus_message_new_method_call(bus, &send_message, CLIP_DESTIN, CLIP_PATH,
-				     CLIP_INTERFACE, "PushData");
+  r = new_clipd_call(&send_message, "PushData");
+  if (r < 0) {
+    fprintf(stderr, "Failed to create message to send: %s\n", strerror(-r));
+    goto finish;
+  }
+
+  sd_bus_message_append(send_message, "q", board);
+  sd_bus_message_append(send_message, "q", item_id);
+  sd_bus_message_append(send_message, "s", type);
+  sd_bus_message_append_array(send_message, 'y', (const void **)data, datalen);
+  
+  r = call_clipd_message(send_message, &error, &reply_message);
+  if (r < 0) {
+    fprintf(stderr, "Call failed in PushData\n");
+    goto finish;
+  }
+
+  uint16_t pushed_out_id;
+  r = sd_bus_message_read(reply_message, "");
+  if (r < 0) {
+    fprintf(stderr, "Read failed in PushData\n");
+    goto finish;
+  }
+
+  // Success!
+  r = 1;
+  
+ finish:
+  sd_bus_error_free(&error);
+  sd_bus_message_unref(send_message);
+  sd_bus_message_unref(reply_message);
+  return r;
+}
+
+int clip_push_fd(uint16_t board, uint16_t item_id, const char *type, int fd)
+{
+  int r;
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *reply_message = NULL;
+
+  // sd-bus duplicates fd into the message, so the caller keeps theirs
+  r = call_clipd("PushDataFd", &error, &reply_message, "qqsh", board, item_id, type, fd);
+  if (r < 0) {
+    fprintf(stderr, "Call failed in PushDataFd: %s\n", error.message);
+    goto finish;
+  }
+
+  // Success!
+  r = 1;
+
+ finish:
+  sd_bus_error_free(&error);
+  sd_bus_message_unref(reply_message);
+  return r;
+}
+
+int clip_push_data_fd(uint16_t board, uint16_t item_id, const char *type, size_t datalen, const char *data)
+{
+  int fd = clip_sealed_memfd(type, datalen, data);
+  if (fd < 0) {
+    fprintf(stderr, "Unable to create sealed memfd for %s\n", type);
+    return -1;
+  }
+  int r = clip_push_fd(board, item_id, type, fd);
+  close(fd);
+  return r;
+}
+
+uint32_t clip_begin_push(uint16_t board, uint16_t item_id, const char *type)
+{
+  int r;
+  uint32_t upload_id = 0;
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *m = NULL;
+
+  r = call_clipd("BeginPush", &error, &m, "qqs", board, item_id, type);
+  if (r < 0) {
+    fprintf(stderr, "Call failed in BeginPush: %s\n", error.message);
+    goto finish;
+  }
+
+  r = sd_bus_message_read(m, "u", &upload_id);
+  if (r < 0) {
+    fprintf(stderr, "Read failed in BeginPush\n");
+    upload_id = 0;
+  }
+
+ finish:
+  sd_bus_error_free(&error);
+  sd_bus_message_unref(m);
+  return upload_id;
+}
+
+int clip_append_chunk(uint32_t upload_id, size_t datalen, const char *data)
+{
+  int r;
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *send_message = NULL;
+  sd_bus_message *reply_message = NULL;
+  r = new_clipd_call(&send_message, "AppendChunk");
   if (r < 0) {
     fprintf(stderr, "Failed to create message to send: %s\n", strerror(-r));
     goto finish;
   }
 
-  sd_bus_message_append(send_message, "q", board);
-  sd_bus_message_append(send_message, "q", item_id);
-  sd_bus_message_append(send_message, "s", type);
-  sd_bus_message_append_array(send_message, 'y', (const void **)data, datalen);
-  
-  r = sd_bus_call(bus, send_message, -1, &error, &reply_message);
+  sd_bus_message_append(send_message, "u", upload_id);
+  sd_bus_message_append_array(send_message, 'y', data, datalen);
+
+  r = call_clipd_message(send_message, &error, &reply_message);
+  if (r < 0) {
+    fprintf(stderr, "Call failed in AppendChunk: %s\n", error.message);
+    goto finish;
+  }
+
+  // Success!
+  r = 1;
+
+ finish:
+  sd_bus_error_free(&error);
+  sd_bus_message_unref(send_message);
+  sd_bus_message_unref(reply_message);
+  return r;
+}
+
+// CommitPush and AbortPush take just the upload id and return nothing
+static int finish_push(uint32_t upload_id, const char *member)
+{
+  int r;
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *m = NULL;
+
+  r = call_clipd(member, &error, &m, "u", upload_id);
+  if (r < 0) {
+    fprintf(stderr, "Call failed in %s: %s\n", member, error.message);
+  } else {
+    r = 1;
+  }
+
+  sd_bus_error_free(&error);
+  sd_bus_message_unref(m);
+  return r;
+}
+
+int clip_commit_push(uint32_t upload_id)
+{
+  return finish_push(upload_id, "CommitPush");
+}
+
+int clip_abort_push(uint32_t upload_id)
+{
+  return finish_push(upload_id, "AbortPush");
+}
+
+static int push_chunks(uint16_t board, uint16_t item_id, const char *type, size_t datalen,
+		       const char *data)
+{
+  unsigned losses = peer_losses;
+  uint32_t upload_id = clip_begin_push(board, item_id, type);
+  if (upload_id == 0) {
+    return -1;
+  }
+
+  size_t offset = 0;
+  while (offset < datalen) {
+    size_t chunklen = datalen - offset;
+    if (chunklen > CLIP_CHUNK_SIZE) {
+      chunklen = CLIP_CHUNK_SIZE;
+    }
+    if (clip_append_chunk(upload_id, chunklen, data + offset) < 0) {
+      // clipd drops the uploads of a peer connection that goes away
+      if (peer_losses == losses) {
+	clip_abort_push(upload_id);
+      }
+      return -1;
+    }
+    offset += chunklen;
+  }
+
+  return clip_commit_push(upload_id);
+}
+
+int clip_push_data_chunked(uint16_t board, uint16_t item_id, const char *type, size_t datalen, const char *data)
+{
+  // If the peer connection drops partway, the upload is gone with it:
+  // start over once, on the session bus
+  unsigned losses = peer_losses;
+  int r = push_chunks(board, item_id, type, datalen, data);
+  if (r < 0 && peer_losses != losses) {
+    r = push_chunks(board, item_id, type, datalen, data);
+  }
+  return r;
+}
+
+// Lazy data providers register callback for data
+// void size_t provide_data(uint16_t board, uint16_t item, char *datatype, char** data_ptr)
+// Returns -1 on error (usually 'board' does not exist)
+int clip_set_data_provider(uint16_t board, clip_data_provider provider)
+{
+  struct board_state *state = find_board(board, 1);
+  if (state == NULL) {
+    return -1;
+  }
+  state->data_provider = provider;
+  return 1;
+}
+
+int clip_set_provider_release(uint16_t board, clip_provider_release provider_release)
+{
+  struct board_state *state = find_board(board, 1);
+  if (state == NULL) {
+    return -1;
+  }
+  state->provider_release = provider_release;
+  return 1;
+}
+
+#pragma mark Data readers
+
+// clip_item_count tells you how many items are on the clipboard and
+// what the last item_id is.
+// Return -1 error (ususually can't connect to server, no such board) occurs
+int clip_item_count(uint16_t board, uint16_t *last_item_id_ptr, uint16_t *item_count_ptr)
+{
+  int r;
+  if (!bus) {
+    r = clip_open();
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  catch_up();
+  struct board_state *state = find_board(board, 0);
+  if (state && count_trusted(&state->cache)) {
+    if (last_item_id_ptr) {
+      *last_item_id_ptr = state->cache.last_item_id;
+    }
+    if (item_count_ptr) {
+      *item_count_ptr = state->cache.item_count;
+    }
+    return 1;
+  }
+
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *m = NULL;
+
+  /* Issue the method call and store the respons message in m */
+  r = call_clipd("ItemCount", &error, &m, "q", board);
+  if (r < 0) {
+    fprintf(stderr, "Failed to issue method call: %s\n", error.message);
+    goto finish;
+  }
+
+  /* Parse the response message */
+  uint16_t last_item_id;
+  uint16_t item_count;
+  r = sd_bus_message_read(m, "qq", &last_item_id, &item_count);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
+    goto finish;
+  }
+
+  if (last_item_id_ptr) {
+    *last_item_id_ptr = last_item_id;
+  }
+
+  if (item_count_ptr) {
+    *item_count_ptr = item_count;
+  }
+
+  // From now on ClipboardChanged keeps this up to date
+  state = find_board(board, 1);
+  if (state) {
+    state->cache.count_known = 1;
+    state->cache.last_item_id = last_item_id;
+    state->cache.item_count = item_count;
+    state->cache.awaited_item_id = 0;
+  }
+  
+ finish:
+  sd_bus_error_free(&error);
+  sd_bus_message_unref(m);
+  return r;
+}
+
+// clip_item_typelist tells you what types are available for a particular
+// item. types will be NULL terminated. Caller is responsible for freeing
+// Returns -1 if error occurs
+int clip_item_typelist(uint16_t board, uint16_t item_id, char ***types_ptr)
+{
+  int r;
+  struct cached_item *cached = cached_item(board, item_id);
+  if (cached && cached->typelist) {
+    *types_ptr = clip_copy_typelist(cached->typelist);
+    return 1;
+  }
+
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *m = NULL;
+
+  /* Issue the method call and store the response message in m */
+  r = call_clipd("FetchTypelist", &error, &m, "qq", board, item_id);
+  if (r < 0) {
+    fprintf(stderr, "Failed to issue method call: %s\n", error.message);
+    goto finish;
+  }
+
+  /* Parse the response message */
+  r = sd_bus_message_read_strv (m, types_ptr);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
+    goto finish;
+  }
+
+  // Item 0 can't be cached until we know which item it is
+  cached = item_id ? cache_slot(board, item_id) : NULL;
+  if (cached && cached->typelist == NULL) {
+    cached->typelist = clip_copy_typelist(*types_ptr);
+  }
+  
+ finish:
+  sd_bus_error_free(&error);
+  sd_bus_message_unref(m);
+  return r;
+}
+
+// Hands out a copy of cached data, if there is any
+static int copy_cached_data(uint16_t board, uint16_t item_id, const char *type,
+			    size_t *datalen_ptr, unsigned char **bytes_ptr)
+{
+  struct cached_data *cached = cached_data(board, item_id, type);
+  if (cached == NULL) {
+    return 0;
+  }
+  if (bytes_ptr) {
+    *bytes_ptr = (unsigned char *)malloc(cached->datalen);
+    memcpy(*bytes_ptr, cached->bytes, cached->datalen);
+  }
+  if (datalen_ptr) {
+    *datalen_ptr = cached->datalen;
+  }
+  return 1;
+}
+
+int clip_item_data_for_type(uint16_t board, uint16_t item_id, char *type, size_t *datalen_ptr, unsigned char **bytes_ptr)
+{
+  int r;
+  if (copy_cached_data(board, item_id, type, datalen_ptr, bytes_ptr)) {
+    return 1;
+  }
+
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *m = NULL;
+
+  /* Issue the method call and store the response message in m */
+  r = call_clipd("FetchData", &error, &m, "qqs", board, item_id, type);
+  if (r < 0) {
+    fprintf(stderr, "Failed to issue method call: %s\n", error.message);
+    goto finish;
+  }
+
+  /* Parse the response message */
+  size_t datalen;
+  unsigned char *bytes;
+  r = sd_bus_message_read_array (m, 'y', (const void **)&bytes, &datalen);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
+    goto finish;
+  }
+
+  if (bytes_ptr) {
+    *bytes_ptr = (unsigned char *)malloc(datalen);
+    memcpy(*bytes_ptr, bytes, datalen);
+  }
+
+  if (datalen_ptr) {
+    *datalen_ptr = datalen;
+  }
+
+  if (item_id) {
+    cache_data(board, item_id, type, bytes, datalen);
+  }
+  
+ finish:
+  sd_bus_error_free(&error);
+  sd_bus_message_unref(m);
+  return r;
+}
+
+int clip_item_data_compressed_for_type(uint16_t board, uint16_t item_id, char *type, size_t *datalen_ptr, unsigned char **bytes_ptr)
+{
+  int r;
+  if (copy_cached_data(board, item_id, type, datalen_ptr, bytes_ptr)) {
+    return 1;
+  }
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *m = NULL;
+
+  r = call_clipd("FetchDataCompressed", &error, &m, "qqs", board, item_id, type);
+  if (r < 0) {
+    fprintf(stderr, "Failed to issue method call: %s\n", error.message);
+    goto finish;
+  }
+
+  const char *encoding;
+  uint64_t rawlen;
+  r = sd_bus_message_read(m, "st", &encoding, &rawlen);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
+    goto finish;
+  }
+  size_t framelen;
+  const unsigned char *frame;
+  r = sd_bus_message_read_array(m, 'y', (const void **)&frame, &framelen);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
+    goto finish;
+  }
+
+  int compressed = strcmp(encoding, CLIP_ENCODING_LZ4) == 0;
+  if (!compressed && strcmp(encoding, CLIP_ENCODING_IDENTITY) != 0) {
+    fprintf(stderr, "Unknown encoding %s for %u:%s\n", encoding, item_id, type);
+    r = -1;
+    goto finish;
+  }
+  if (!compressed && rawlen != framelen) {
+    r = -1;
+    goto finish;
+  }
+
+  if (bytes_ptr) {
+    unsigned char *bytes = (unsigned char *)malloc(rawlen);
+    if (rawlen > 0 && bytes == NULL) {
+      r = -1;
+      goto finish;
+    }
+    if (!compressed) {
+      memcpy(bytes, frame, rawlen);
+    } else if (clip_lz4_frame_decode(frame, framelen, bytes, rawlen) < 0) {
+      fprintf(stderr, "Damaged compressed data for %u:%s\n", item_id, type);
+      free(bytes);
+      r = -1;
+      goto finish;
+    }
+    *bytes_ptr = bytes;
+    if (item_id) {
+      cache_data(board, item_id, type, bytes, rawlen);
+    }
+  }
+
+  if (datalen_ptr) {
+    *datalen_ptr = rawlen;
+  }
+
+ finish:
+  sd_bus_error_free(&error);
+  sd_bus_message_unref(m);
+  return r;
+}
+
+int clip_item_data_mapped_for_type(uint16_t board, uint16_t item_id, char *type, size_t *datalen_ptr, const unsigned char **bytes_ptr)
+{
+  int r;
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *m = NULL;
+
+  r = call_clipd("FetchDataFd", &error, &m, "qqs", board, item_id, type);
+  if (r < 0) {
+    fprintf(stderr, "Failed to issue method call: %s\n", error.message);
+    goto finish;
+  }
+
+  // The fd belongs to the message; the mapping outlives it
+  int fd;
+  r = sd_bus_message_read(m, "h", &fd);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
+    goto finish;
+  }
+
+  if (!clip_fd_is_sealed(fd)) {
+    fprintf(stderr, "clipd sent an unsealed fd for %u:%s\n", item_id, type);
+    r = -1;
+    goto finish;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    r = -1;
+    goto finish;
+  }
+
+  const unsigned char *bytes = NULL;
+  if (st.st_size > 0) {
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+      fprintf(stderr, "Unable to map data for %u:%s\n", item_id, type);
+      r = -1;
+      goto finish;
+    }
+    bytes = (const unsigned char *)mapping;
+  }
+
+  if (bytes_ptr) {
+    *bytes_ptr = bytes;
+  } else if (bytes) {
+    munmap((void *)bytes, st.st_size);
+  }
+
+  if (datalen_ptr) {
+    *datalen_ptr = st.st_size;
+  }
+
+ finish:
+  sd_bus_error_free(&error);
+  sd_bus_message_unref(m);
+  return r;
+}
+
+void clip_unmap_data(const unsigned char *bytes, size_t datalen)
+{
+  if (bytes) {
+    munmap((void *)bytes, datalen);
+  }
+}
+
+int clip_item_data_size(uint16_t board, uint16_t item_id, char *type, uint64_t *datalen_ptr)
+{
+  int r;
+  size_t cached_len;
+  if (copy_cached_data(board, item_id, type, &cached_len, NULL)) {
+    *datalen_ptr = cached_len;
+    return 1;
+  }
+
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *m = NULL;
+  r = call_clipd("GetDataSize", &error, &m, "qqs", board, item_id, type);
+  if (r < 0) {
+    fprintf(stderr, "Failed to issue method call: %s\n", error.message);
+    goto finish;
+  }
+
+  r = sd_bus_message_read(m, "t", datalen_ptr);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
+  }
+
+ finish:
+  sd_bus_error_free(&error);
+  sd_bus_message_unref(m);
+  return r;
+}
+
+// Issues FetchRange; on success *m holds the reply, positioned at the chunk
+static int fetch_range(uint16_t board, uint16_t item_id, char *type, uint64_t offset, size_t maxlen,
+		       uint64_t *total_ptr, sd_bus_message **m)
+{
+  int r;
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+
+  if (maxlen > CLIP_MAX_CHUNK) {
+    maxlen = CLIP_MAX_CHUNK;
+  }
+  r = call_clipd("FetchRange", &error, m, "qqstu", board, item_id, type, offset, (uint32_t)maxlen);
+  if (r < 0) {
+    fprintf(stderr, "Failed to issue method call: %s\n", error.message);
+    sd_bus_error_free(&error);
+    return r;
+  }
+  sd_bus_error_free(&error);
+
+  r = sd_bus_message_read(*m, "t", total_ptr);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
+  }
+  return r;
+}
+
+int clip_item_data_range(uint16_t board, uint16_t item_id, char *type, uint64_t offset, size_t maxlen,
+			 uint64_t *total_ptr, size_t *datalen_ptr, unsigned char **bytes_ptr)
+{
+  int r;
+  sd_bus_message *m = NULL;
+  uint64_t total;
+
+  r = fetch_range(board, item_id, type, offset, maxlen, &total, &m);
+  if (r < 0) {
+    goto finish;
+  }
+
+  size_t datalen;
+  unsigned char *bytes;
+  r = sd_bus_message_read_array(m, 'y', (const void **)&bytes, &datalen);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
+    goto finish;
+  }
+
+  if (bytes_ptr) {
+    *bytes_ptr = (unsigned char *)malloc(datalen);
+    memcpy(*bytes_ptr, bytes, datalen);
+  }
+  if (datalen_ptr) {
+    *datalen_ptr = datalen;
+  }
+  if (total_ptr) {
+    *total_ptr = total;
+  }
+
+ finish:
+  sd_bus_message_unref(m);
+  return r;
+}
+
+int clip_item_data_stream(uint16_t board, uint16_t item_id, char *type, clip_chunk_handler handler,
+			  void *userdata)
+{
+  uint64_t offset = 0;
+  uint64_t total;
+  do {
+    sd_bus_message *m = NULL;
+    int r = fetch_range(board, item_id, type, offset, CLIP_CHUNK_SIZE, &total, &m);
+    if (r < 0) {
+      sd_bus_message_unref(m);
+      return r;
+    }
+
+    size_t chunklen;
+    const unsigned char *chunk;
+    r = sd_bus_message_read_array(m, 'y', (const void **)&chunk, &chunklen);
+    if (r < 0) {
+      fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
+      sd_bus_message_unref(m);
+      return r;
+    }
+
+    // The chunk lives in the message, so hand it over before unref
+    if (chunklen > 0 || total == 0) {
+      r = handler(chunk, chunklen, total, userdata);
+    }
+    sd_bus_message_unref(m);
+    if (r < 0) {
+      return r;
+    }
+    if (chunklen == 0) {
+      break;
+    }
+    offset += chunklen;
+  } while (offset < total);
+
+  return 1;
+}
+
+// Reads one (qssasa{say}) of a FetchItems reply into item
+static int read_item_info(sd_bus_message *m, struct clip_item_info *item)
+{
+  const char *label;
+  const char *sender;
+  int r = sd_bus_message_read(m, "qss", &item->item_id, &label, &sender);
+  if (r < 0) {
+    return r;
+  }
+  item->label = strdup(label);
+  item->sender = strdup(sender);
+  r = sd_bus_message_read_strv(m, &item->typelist);
+  if (r < 0) {
+    return r;
+  }
+
+  size_t count = clip_typelist_count(item->typelist);
+  item->inline_types = (char **)calloc(count + 1, sizeof(char *));
+  item->inline_datalens = (size_t *)calloc(count + 1, sizeof(size_t));
+  item->inline_datas = (unsigned char **)calloc(count + 1, sizeof(unsigned char *));
+  if (!item->inline_types || !item->inline_datalens || !item->inline_datas) {
+    return -ENOMEM;
+  }
+
+  r = sd_bus_message_enter_container(m, 'a', "{say}");
+  size_t n = 0;
+  while (r >= 0 && (r = sd_bus_message_enter_container(m, 'e', "say")) > 0) {
+    const char *type;
+    const void *data;
+    size_t datalen;
+    r = sd_bus_message_read(m, "s", &type);
+    if (r >= 0) {
+      r = sd_bus_message_read_array(m, 'y', &data, &datalen);
+    }
+    if (r >= 0) {
+      r = sd_bus_message_exit_container(m);
+    }
+    // clipd only sends data for types on the typelist, each once
+    if (r >= 0 && n >= count) {
+      r = -EBADMSG;
+    }
+    if (r < 0) {
+      return r;
+    }
+    item->inline_types[n] = strdup(type);
+    item->inline_datalens[n] = datalen;
+    item->inline_datas[n] = (unsigned char *)malloc(datalen);
+    memcpy(item->inline_datas[n], data, datalen);
+    n++;
+  }
+  if (r >= 0) {
+    r = sd_bus_message_exit_container(m);
+  }
+  return r;
+}
+
+// Remember what FetchItems brought, for later clip_item_typelist and
+// clip_item_data_for_type calls
+static void cache_item_info(uint16_t board, struct clip_item_info *item)
+{
+  struct cached_item *cached = cache_slot(board, item->item_id);
+  if (cached && cached->typelist == NULL) {
+    cached->typelist = clip_copy_typelist(item->typelist);
+  }
+  for (int i = 0; item->inline_types[i] != NULL; i++) {
+    if (cached_data(board, item->item_id, item->inline_types[i]) == NULL) {
+      cache_data(board, item->item_id, item->inline_types[i], item->inline_datas[i],
+		 item->inline_datalens[i]);
+    }
+  }
+}
+
+int clip_fetch_items(uint16_t board, uint16_t first_item_id, uint16_t last_item_id, size_t max_inline,
+		     struct clip_item_info **items_ptr)
+{
+  int r;
+  if (!bus) {
+    r = clip_open();
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *m = NULL;
+  struct clip_item_info *items = NULL;
+  int count = 0;
+
+  uint32_t inline_limit = max_inline > UINT32_MAX ? UINT32_MAX : max_inline;
+  r = call_clipd("FetchItems", &error, &m, "qqqu", board, first_item_id, last_item_id, inline_limit);
+  if (r < 0) {
+    fprintf(stderr, "Failed to issue method call: %s\n", error.message);
+    goto finish;
+  }
+
+  r = sd_bus_message_enter_container(m, 'a', "(qssasa{say})");
+  while (r >= 0 && (r = sd_bus_message_enter_container(m, 'r', "qssasa{say}")) > 0) {
+    struct clip_item_info *grown = (struct clip_item_info *)realloc(items, (count + 1) * sizeof(*items));
+    if (grown == NULL) {
+      r = -ENOMEM;
+      break;
+    }
+    items = grown;
+    memset(&items[count], 0, sizeof(*items));
+    count++;
+    r = read_item_info(m, &items[count - 1]);
+    if (r >= 0) {
+      r = sd_bus_message_exit_container(m);
+    }
+  }
+  if (r >= 0) {
+    r = sd_bus_message_exit_container(m);
+  }
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
+    clip_free_items(items, count);
+    goto finish;
+  }
+
+  for (int i = 0; i < count; i++) {
+    cache_item_info(board, &items[i]);
+  }
+  *items_ptr = items;
+  r = count;
+
+ finish:
+  sd_bus_error_free(&error);
+  sd_bus_message_unref(m);
+  return r;
+}
+
+void clip_free_items(struct clip_item_info *items, int count)
+{
+  for (int i = 0; i < count; i++) {
+    free(items[i].label);
+    free(items[i].sender);
+    if (items[i].typelist) {
+      clip_free_typelist(items[i].typelist);
+    }
+    if (items[i].inline_types) {
+      for (int j = 0; items[i].inline_datas && items[i].inline_types[j] != NULL; j++) {
+	free(items[i].inline_datas[j]);
+      }
+      clip_free_typelist(items[i].inline_types);
+    }
+    free(items[i].inline_datalens);
+    free(items[i].inline_datas);
+  }
+  free(items);
+}
+
+int clip_search_items(uint16_t board, const char *query, uint32_t limit,
+		      struct clip_search_result **results_ptr)
+{
+  int r;
+  if (!bus) {
+    r = clip_open();
+    if (r < 0) {
+      return r;
+    }
+  }
+
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *m = NULL;
+  struct clip_search_result *results = NULL;
+  int count = 0;
+
+  r = call_clipd("SearchItems", &error, &m, "qsu", board, query, limit);
+  if (r < 0) {
+    fprintf(stderr, "Failed to issue method call: %s\n", error.message);
+    goto finish;
+  }
+
+  r = sd_bus_message_enter_container(m, 'a', "(qss)");
+  while (r >= 0) {
+    uint16_t item_id;
+    const char *type;
+    const char *snippet;
+    r = sd_bus_message_read(m, "(qss)", &item_id, &type, &snippet);
+    if (r <= 0) {
+      break;
+    }
+    struct clip_search_result *grown =
+      (struct clip_search_result *)realloc(results, (count + 1) * sizeof(*results));
+    if (grown == NULL) {
+      r = -ENOMEM;
+      break;
+    }
+    results = grown;
+    results[count].item_id = item_id;
+    results[count].type = strdup(type);
+    results[count].snippet = strdup(snippet);
+    count++;
+  }
+  if (r >= 0) {
+    r = sd_bus_message_exit_container(m);
+  }
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
+    clip_free_search_results(results, count);
+    goto finish;
+  }
+
+  *results_ptr = results;
+  r = count;
+
+ finish:
+  sd_bus_error_free(&error);
+  sd_bus_message_unref(m);
+  return r;
+}
+
+void clip_free_search_results(struct clip_search_result *results, int count)
+{
+  for (int i = 0; i < count; i++) {
+    free(results[i].type);
+    free(results[i].snippet);
+  }
+  free(results);
+}
+
+#pragma mark Type atoms
+
+// The types we have learned atoms for, indexed by atom. Atoms are only
+// good for one run of clipd, identified by atom_epoch.
+static char **atom_types = NULL;
+static size_t atom_capacity = 0;
+static uint64_t atom_epoch = 0;
+
+static void forget_atoms()
+{
+  for (size_t i = 0; i < atom_capacity; i++) {
+    free(atom_types[i]);
+  }
+  free(atom_types);
+  atom_types = NULL;
+  atom_capacity = 0;
+  atom_epoch = 0;
+}
+
+// Atoms from a different epoch mean clipd restarted: the old ones are
+// meaningless now
+static void note_epoch(uint64_t epoch)
+{
+  if (epoch != atom_epoch) {
+    forget_atoms();
+    atom_epoch = epoch;
+  }
+}
+
+static void remember_atom(uint32_t atom, const char *type)
+{
+  if (atom == 0 || *type == '\0') {
+    return;
+  }
+  if (atom >= atom_capacity) {
+    size_t capacity = atom_capacity ? atom_capacity : 64;
+    while (capacity <= atom) {
+      capacity *= 2;
+    }
+    char **grown = (char **)realloc(atom_types, capacity * sizeof(char *));
+    if (grown == NULL) {
+      return;
+    }
+    memset(grown + atom_capacity, 0, (capacity - atom_capacity) * sizeof(char *));
+    atom_types = grown;
+    atom_capacity = capacity;
+  }
+  if (atom_types[atom] == NULL) {
+    atom_types[atom] = strdup(type);
+  }
+}
+
+// Clients use a handful of types, so a scan is fine
+static uint32_t known_atom(const char *type)
+{
+  for (size_t i = 1; i < atom_capacity; i++) {
+    if (atom_types[i] && strcmp(atom_types[i], type) == 0) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+uint32_t clip_atom_for_type(const char *type)
+{
+  if (!bus && clip_open() < 0) {
+    return 0;
+  }
+  catch_up();
+  uint32_t atom = known_atom(type);
+  if (atom) {
+    return atom;
+  }
+
+  sd_bus_error error = SD_BUS_ERROR_NULL;
+  sd_bus_message *m = NULL;
+  uint64_t epoch;
+  const void *atoms;
+  size_t atomslen = 0;
+  int r = call_clipd("InternTypes", &error, &m, "as", 1, type);
   if (r < 0) {
-    fprintf(stderr, "Call failed in PushData\n");
+    fprintf(stderr, "Failed to issue method call: %s\n", error.message);
     goto finish;
   }
-
-  uint16_t pushed_out_id;
-  r = sd_bus_message_read(reply_message, "");
-  if (r < 0) {
-    fprintf(stderr, "Read failed in PushData\n");
+  r = sd_bus_message_read(m, "t", &epoch);
+  if (r >= 0) {
+    r = sd_bus_message_read_array(m, 'u', &atoms, &atomslen);
+  }
+  if (r < 0 || atomslen != sizeof(uint32_t)) {
+    fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
     goto finish;
   }
+  note_epoch(epoch);
+  atom = *(const uint32_t *)atoms;
+  remember_atom(atom, type);
 
-  // Success!
-  r = 1;
-  
  finish:
   sd_bus_error_free(&error);
-  sd_bus_message_unref(send_message);
-  sd_bus_message_unref(reply_message);
-  return r;
-}
-
-// Lazy data providers register callback for data
-// void size_t provide_data(uint16_t board, uint16_t item, char *datatype, char** data_ptr)
-// Returns -1 on error (usually 'board' does not exist)
-int clip_set_data_provider(uint16_t board, clip_data_provider provider)
-{
-  data_providers[board] = provider;
-  return 1;
+  sd_bus_message_unref(m);
+  return atom;
 }
 
-#pragma mark Data readers
-
-// clip_item_count tells you how many items are on the clipboard and
-// what the last item_id is.
-// Return -1 error (ususually can't connect to server, no such board) occurs
-int clip_item_count(uint16_t board, uint16_t *last_item_id_ptr, uint16_t *item_count_ptr)
+const char *clip_type_for_atom(uint32_t atom)
 {
-  int r;
-  if (!bus) {
-    r = clip_open();
-    if (r < 0) {
-      return r;
-    }
+  if (!bus && clip_open() < 0) {
+    return NULL;
+  }
+  catch_up();
+  if (atom < atom_capacity && atom_types[atom]) {
+    return atom_types[atom];
+  }
+  if (atom == 0 || atom_epoch == 0) {
+    return NULL;
   }
 
   sd_bus_error error = SD_BUS_ERROR_NULL;
   sd_bus_message *m = NULL;
-
-  /* Issue the method call and store the respons message in m */
-  r = sd_bus_call_method(bus, CLIP_DESTIN, CLIP_PATH, CLIP_INTERFACE, "ItemCount",
-			 &error, &m, "q", board);
+  const char *type = NULL;
+  int r = call_clipd("TypesForAtoms", &error, &m, "tau", atom_epoch, 1, atom);
   if (r < 0) {
-    fprintf(stderr, "Failed to issue method call: %s\n", error.message);
+    if (sd_bus_error_has_name(&error, CLIP_ERROR_STALE_ATOMS)) {
+      forget_atoms();
+    } else {
+      fprintf(stderr, "Failed to issue method call: %s\n", error.message);
+    }
     goto finish;
   }
-
-  /* Parse the response message */
-  uint16_t last_item_id;
-  uint16_t item_count;
-  r = sd_bus_message_read(m, "qq", &last_item_id, &item_count);
+  char **types;
+  r = sd_bus_message_read_strv(m, &types);
   if (r < 0) {
     fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
     goto finish;
   }
-
-  if (last_item_id_ptr) {
-    *last_item_id_ptr = last_item_id;
+  if (types[0]) {
+    remember_atom(atom, types[0]);
   }
-
-  if (item_count_ptr) {
-    *item_count_ptr = item_count;
+  clip_free_typelist(types);
+  if (atom < atom_capacity) {
+    type = atom_types[atom];
   }
-  
+
  finish:
   sd_bus_error_free(&error);
   sd_bus_message_unref(m);
-  return r;
+  return type;
 }
 
-// clip_item_typelist tells you what types are available for a particular
-// item. types will be NULL terminated. Caller is responsible for freeing
-// Returns -1 if error occurs
-int clip_item_typelist(uint16_t board, uint16_t item_id, char ***types_ptr)
+int clip_item_atoms(uint16_t board, uint16_t item_id, uint32_t **atoms_ptr)
 {
-  int r;
+  if (!bus && clip_open() < 0) {
+    return -1;
+  }
+
   sd_bus_error error = SD_BUS_ERROR_NULL;
   sd_bus_message *m = NULL;
-
-  /* Issue the method call and store the response message in m */
-  r = sd_bus_call_method(bus, CLIP_DESTIN, CLIP_PATH, CLIP_INTERFACE, "FetchTypelist",
-			 &error, &m, "qq", board, item_id);
+  uint64_t epoch;
+  const void *atoms;
+  size_t atomslen = 0;
+  int r = call_clipd("FetchTypelistAtoms", &error, &m, "qq", board, item_id);
   if (r < 0) {
     fprintf(stderr, "Failed to issue method call: %s\n", error.message);
     goto finish;
   }
-
-  /* Parse the response message */
-  r = sd_bus_message_read_strv (m, types_ptr);
+  r = sd_bus_message_read(m, "t", &epoch);
+  if (r >= 0) {
+    r = sd_bus_message_read_array(m, 'u', &atoms, &atomslen);
+  }
   if (r < 0) {
     fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
     goto finish;
   }
-  
+  note_epoch(epoch);
+  *atoms_ptr = (uint32_t *)malloc(atomslen ? atomslen : 1);
+  if (*atoms_ptr == NULL) {
+    r = -ENOMEM;
+    goto finish;
+  }
+  memcpy(*atoms_ptr, atoms, atomslen);
+  r = atomslen / sizeof(uint32_t);
+
  finish:
   sd_bus_error_free(&error);
   sd_bus_message_unref(m);
   return r;
 }
 
-int clip_item_data_for_type(uint16_t board, uint16_t item_id, char *type, size_t *datalen_ptr, unsigned char **bytes_ptr)
+int clip_item_data_for_atom(uint16_t board, uint16_t item_id, uint32_t atom, size_t *datalen_ptr,
+			    unsigned char **bytes_ptr)
 {
-  int r;
+  if (!bus && clip_open() < 0) {
+    return -1;
+  }
+  catch_up();
+  const char *type = atom < atom_capacity ? atom_types[atom] : NULL;
+  if (type && copy_cached_data(board, item_id, type, datalen_ptr, bytes_ptr)) {
+    return 1;
+  }
+
   sd_bus_error error = SD_BUS_ERROR_NULL;
   sd_bus_message *m = NULL;
-
-  /* Issue the method call and store the response message in m */
-  r = sd_bus_call_method(bus, CLIP_DESTIN, CLIP_PATH, CLIP_INTERFACE, "FetchData",
-			 &error, &m, "qqs", board, item_id, type);
+  int r = call_clipd("FetchDataByAtom", &error, &m, "qqtu", board, item_id, atom_epoch, atom);
+  if (r < 0 && sd_bus_error_has_name(&error, CLIP_ERROR_STALE_ATOMS) && type) {
+    // clipd restarted under us. We know the type, so ask by its new atom.
+    char *retry_type = strdup(type);
+    sd_bus_error_free(&error);
+    forget_atoms();
+    uint32_t new_atom = retry_type ? clip_atom_for_type(retry_type) : 0;
+    free(retry_type);
+    if (new_atom == 0) {
+      return -1;
+    }
+    return clip_item_data_for_atom(board, item_id, new_atom, datalen_ptr, bytes_ptr);
+  }
   if (r < 0) {
     fprintf(stderr, "Failed to issue method call: %s\n", error.message);
     goto finish;
   }
 
-  /* Parse the response message */
   size_t datalen;
-  unsigned char *bytes;
-  r = sd_bus_message_read_array (m, 'y', (const void **)&bytes, &datalen);
+  const void *bytes;
+  r = sd_bus_message_read_array(m, 'y', &bytes, &datalen);
   if (r < 0) {
     fprintf(stderr, "Failed to parse response message: %s\n", strerror(-r));
     goto finish;
   }
-
   if (bytes_ptr) {
     *bytes_ptr = (unsigned char *)malloc(datalen);
     memcpy(*bytes_ptr, bytes, datalen);
   }
-
   if (datalen_ptr) {
     *datalen_ptr = datalen;
   }
-  
+  if (item_id && type) {
+    cache_data(board, item_id, type, bytes, datalen);
+  }
+
  finish:
   sd_bus_error_free(&error);
   sd_bus_message_unref(m);
   return r;
 }
 
+#pragma mark Asynchronous calls
+
+// What a call in flight needs once its reply arrives
+struct async_call {
+  union {
+    clip_item_callback item;
+    clip_done_callback done;
+    clip_count_callback count;
+    clip_typelist_callback typelist;
+    clip_data_callback data;
+  } callback;
+  void *userdata;
+  // For creating calls: the board the item goes on
+  uint16_t board;
+};
+
+static int ensure_open()
+{
+  return bus ? 1 : clip_open();
+}
+
+static struct async_call *new_async_call(void *userdata)
+{
+  struct async_call *call = (struct async_call *)calloc(1, sizeof(struct async_call));
+  if (call) {
+    call->userdata = userdata;
+  }
+  return call;
+}
+
+// Sends the call and hands the reply to handler with async. Takes over
+// the message; frees async if the call can't be sent.
+static int send_async(sd_bus_message *m, const char *member, sd_bus_message_handler_t handler,
+		      struct async_call *async)
+{
+  int r = sd_bus_call_async(bus, NULL, m, handler, async, 0);
+  sd_bus_message_unref(m);
+  if (r < 0) {
+    fprintf(stderr, "Failed to send %s: %s\n", member, strerror(-r));
+    free(async);
+    return r;
+  }
+  return 1;
+}
+
+static int new_call(sd_bus_message **m, const char *member)
+{
+  int r = sd_bus_message_new_method_call(bus, m, CLIP_DESTIN, CLIP_PATH, CLIP_INTERFACE, member);
+  if (r < 0) {
+    fprintf(stderr, "Failed to create message to send: %s\n", strerror(-r));
+  }
+  return r;
+}
+
+// -1 if clipd answered with an error
+static int reply_status(sd_bus_message *reply)
+{
+  const sd_bus_error *error = sd_bus_message_get_error(reply);
+  if (error) {
+    fprintf(stderr, "Call to %s failed: %s\n", CLIP_DESTIN, error->message);
+    return -1;
+  }
+  return 1;
+}
+
+static int item_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+  struct async_call *async = (struct async_call *)userdata;
+  uint16_t item_id = 0;
+  uint16_t pushed_out_id;
+  int r = reply_status(m);
+  if (r > 0 && sd_bus_message_read(m, "qq", &item_id, &pushed_out_id) < 0) {
+    r = -1;
+  }
+  if (r > 0) {
+    cache_item_created(async->board, item_id);
+  }
+  async->callback.item(r, item_id, async->userdata);
+  free(async);
+  return 0;
+}
+
+static int done_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+  struct async_call *async = (struct async_call *)userdata;
+  async->callback.done(reply_status(m), async->userdata);
+  free(async);
+  return 0;
+}
+
+static int count_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+  struct async_call *async = (struct async_call *)userdata;
+  uint16_t last_item_id = 0;
+  uint16_t item_count = 0;
+  int r = reply_status(m);
+  if (r > 0 && sd_bus_message_read(m, "qq", &last_item_id, &item_count) < 0) {
+    r = -1;
+  }
+  async->callback.count(r, last_item_id, item_count, async->userdata);
+  free(async);
+  return 0;
+}
+
+static int typelist_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+  struct async_call *async = (struct async_call *)userdata;
+  char **typelist = NULL;
+  int r = reply_status(m);
+  if (r > 0 && sd_bus_message_read_strv(m, &typelist) < 0) {
+    r = -1;
+  }
+  async->callback.typelist(r, typelist, async->userdata);
+  free(async);
+  return 0;
+}
+
+static int data_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+  struct async_call *async = (struct async_call *)userdata;
+  const void *bytes = NULL;
+  size_t datalen = 0;
+  int r = reply_status(m);
+  if (r > 0 && sd_bus_message_read_array(m, 'y', &bytes, &datalen) < 0) {
+    r = -1;
+  }
+  // The bytes belong to the reply, so the handler reads them in place
+  async->callback.data(r, (const unsigned char *)bytes, datalen, async->userdata);
+  free(async);
+  return 0;
+}
+
+int clip_create_item_async(uint16_t board, const char *label, char **typelist,
+			   clip_item_callback callback, void *userdata)
+{
+  sd_bus_message *m = NULL;
+  int r = ensure_open();
+  if (r < 0 || (r = new_call(&m, "CreateItem")) < 0) {
+    return r;
+  }
+  r = sd_bus_message_append(m, "qs", board, label);
+  if (r >= 0) {
+    r = sd_bus_message_append_strv(m, typelist);
+  }
+  struct async_call *async = new_async_call(userdata);
+  if (r < 0 || async == NULL) {
+    sd_bus_message_unref(m);
+    free(async);
+    return -1;
+  }
+  async->callback.item = callback;
+  async->board = board;
+  return send_async(m, "CreateItem", item_reply, async);
+}
+
+int clip_create_item_with_data_async(uint16_t board, const char *label, char **typelist,
+				     const size_t *datalens, const char **datas,
+				     clip_item_callback callback, void *userdata)
+{
+  sd_bus_message *m = NULL;
+  int r = ensure_open();
+  if (r < 0 || (r = new_call(&m, "CreateItemWithData")) < 0) {
+    return r;
+  }
+  r = append_item_with_data(m, board, label, typelist, datalens, datas);
+  struct async_call *async = new_async_call(userdata);
+  if (r < 0 || async == NULL) {
+    sd_bus_message_unref(m);
+    free(async);
+    return -1;
+  }
+  async->callback.item = callback;
+  async->board = board;
+  return send_async(m, "CreateItemWithData", item_reply, async);
+}
+
+int clip_push_data_async(uint16_t board, uint16_t item_id, const char *type, size_t datalen,
+			 const char *data, clip_done_callback callback, void *userdata)
+{
+  sd_bus_message *m = NULL;
+  int r = ensure_open();
+  if (r < 0 || (r = new_call(&m, "PushData")) < 0) {
+    return r;
+  }
+  r = sd_bus_message_append(m, "qqs", board, item_id, type);
+  if (r >= 0) {
+    r = sd_bus_message_append_array(m, 'y', data, datalen);
+  }
+  struct async_call *async = new_async_call(userdata);
+  if (r < 0 || async == NULL) {
+    sd_bus_message_unref(m);
+    free(async);
+    return -1;
+  }
+  async->callback.done = callback;
+  return send_async(m, "PushData", done_reply, async);
+}
+
+int clip_item_count_async(uint16_t board, clip_count_callback callback, void *userdata)
+{
+  sd_bus_message *m = NULL;
+  int r = ensure_open();
+  if (r < 0 || (r = new_call(&m, "ItemCount")) < 0) {
+    return r;
+  }
+  r = sd_bus_message_append(m, "q", board);
+  struct async_call *async = new_async_call(userdata);
+  if (r < 0 || async == NULL) {
+    sd_bus_message_unref(m);
+    free(async);
+    return -1;
+  }
+  async->callback.count = callback;
+  return send_async(m, "ItemCount", count_reply, async);
+}
+
+int clip_item_typelist_async(uint16_t board, uint16_t item_id, clip_typelist_callback callback,
+			     void *userdata)
+{
+  sd_bus_message *m = NULL;
+  int r = ensure_open();
+  if (r < 0 || (r = new_call(&m, "FetchTypelist")) < 0) {
+    return r;
+  }
+  r = sd_bus_message_append(m, "qq", board, item_id);
+  struct async_call *async = new_async_call(userdata);
+  if (r < 0 || async == NULL) {
+    sd_bus_message_unref(m);
+    free(async);
+    return -1;
+  }
+  async->callback.typelist = callback;
+  return send_async(m, "FetchTypelist", typelist_reply, async);
+}
+
+int clip_item_data_for_type_async(uint16_t board, uint16_t item_id, const char *type,
+				  clip_data_callback callback, void *userdata)
+{
+  sd_bus_message *m = NULL;
+  int r = ensure_open();
+  if (r < 0 || (r = new_call(&m, "FetchData")) < 0) {
+    return r;
+  }
+  r = sd_bus_message_append(m, "qqs", board, item_id, type);
+  struct async_call *async = new_async_call(userdata);
+  if (r < 0 || async == NULL) {
+    sd_bus_message_unref(m);
+    free(async);
+    return -1;
+  }
+  async->callback.data = callback;
+  return send_async(m, "FetchData", data_reply, async);
+}
+
+#pragma mark Listeners
+
 // Listeners register function pointer to be called when new item
 // is added to clipboard
 // void handle_change(int board, int new_item_id, char *label, size_t item_count);
 // Returns -1 on error (can't connect to server, no such board)
 int clip_set_change_handler(uint16_t board, clip_change_handler ch)
 {
-  change_handlers[board] = ch;
+  struct board_state *state = find_board(board, 1);
+  if (state == NULL) {
+    return -1;
+  }
+  state->change_handler = ch;
+  return 1;
+}
+
+int clip_set_coalesced_change_handler(uint16_t board, clip_coalesced_change_handler ch)
+{
+  struct board_state *state = find_board(board, 1);
+  if (state == NULL) {
+    return -1;
+  }
+  state->coalesced_change_handler = ch;
+  return 1;
 }
 
 
@@ -311,26 +2344,78 @@ void wait_for_clipboard_events() {
 }
 
 void process_waiting_clipboard_events() {
-  int r;
-  if (!bus) {
-    r = clip_open();
-    if (r < 0) {
-      return;
-    }
+  clip_process();
+}
+
+int clip_get_fd()
+{
+  int r = ensure_open();
+  if (r < 0) {
+    return r;
   }
-  r = 1;
-  while (r > 0) {
-    // sd_bus_message *m = NULL;
+  return sd_bus_get_fd(bus);
+}
+
+int clip_get_events()
+{
+  int r = ensure_open();
+  if (r < 0) {
+    return r;
+  }
+  return sd_bus_get_events(bus);
+}
+
+int clip_get_timeout()
+{
+  int r = ensure_open();
+  if (r < 0) {
+    return r;
+  }
+
+  // sd-bus gives a deadline on CLOCK_MONOTONIC; poll wants a wait
+  uint64_t deadline;
+  r = sd_bus_get_timeout(bus, &deadline);
+  if (r < 0 || deadline == UINT64_MAX) {
+    return -1;
+  }
+  uint64_t now = monotonic_usec();
+  if (deadline <= now) {
+    return 0;
+  }
+  uint64_t msec = (deadline - now + 999) / 1000;
+  return msec > INT_MAX ? INT_MAX : (int)msec;
+}
+
+int clip_process()
+{
+  int r = ensure_open();
+  if (r < 0) {
+    return r;
+  }
+  do {
     r = sd_bus_process(bus, NULL);
     if (r < 0) {
       fprintf(stderr, "Failed to process bus: %s\n", strerror(-r));
-      return;
+      return r;
     }
-//const char* member = sd_bus_message_get_member(m);
-//  fprintf(stderr, "Received %s message\n", member);
-//  sd_bus_message_unref(m);
+  } while (r > 0);
+  // Don't let the cache's signals pile up between reading calls
+  catch_up();
+  return 1;
+}
 
+int clip_attach_event(struct sd_event *event, int priority)
+{
+  int r = ensure_open();
+  if (r < 0) {
+    return r;
   }
-  
+  r = sd_bus_attach_event(bus, event, priority);
+  if (r >= 0) {
+    r = sd_bus_attach_event(cache_bus, event, priority);
+  }
+  if (r < 0) {
+    fprintf(stderr, "Failed to attach to event loop: %s\n", strerror(-r));
+  }
+  return r;
 }
-
@@ -35,6 +35,18 @@
 #define CLIPBOARD_TYPE_MP3 "public.mp3"
 
 
+#pragma mark Named boards
+
+// Each application, workspace or container can have boards of its own.
+// clipd makes a board the first time its name is opened, holding up to
+// max_items items and max_bytes bytes of data (0 for clipd's defaults);
+// a board that exists keeps its settings. The built-in boards are also
+// called "general", "find", "style" and "drag". Use the returned id with
+// every other function. Named boards aren't kept across restarts of
+// clipd, and are dropped once nobody has used them for half an hour.
+// Returns -1 on error
+int clip_open_board(const char *name, uint16_t max_items, uint64_t max_bytes);
+
 #pragma mark Data providers
 
 // In all functions taking an item_id, if you supply 0 it will use the last
@@ -45,17 +57,63 @@
 // The item id is returned.
 // 'types' should be null terminated list of UTIs in ASCII.
 // 'label' is a UTF-8 string that describes the new item in 20 characters or less
-// Returns item_id of new item. MAX_UINT16 on error
+// Returns item_id of new item, 0 on error (item ids start at 1)
 uint16_t
 clip_create_item(uint16_t board, const char *label, char **typelist);
 
+// clip_create_item_with_data creates an item and pushes the data for
+// every type in typelist in one round trip. datalens and datas line up
+// with typelist. Watchers hear about the item only once all of its data
+// is on the clipboard.
+// Returns item_id of new item, 0 on error
+uint16_t
+clip_create_item_with_data(uint16_t board, const char *label, char **typelist,
+			   const size_t *datalens, const char **datas);
+
 // clip_push_data moves the actual data to the clipboard for the item
 // Returns -1 if an error (usually type is not available) occurs
 int
 clip_push_data(uint16_t board, uint16_t item_id, const char *type, size_t datalen, const char *data);
 
+// clip_push_data_fd does the same job as clip_push_data, but the data travels
+// in a sealed memfd, so only a file descriptor crosses the bus.
+// Use it for big payloads (images, audio).
+// Returns -1 if an error occurs
+int
+clip_push_data_fd(uint16_t board, uint16_t item_id, const char *type, size_t datalen, const char *data);
+
+// If you already have the data in a memfd sealed against writing, growing
+// and shrinking (see clip_sealed_memfd), hand it over directly.
+// You still own fd.
+// Returns -1 if an error occurs
+int
+clip_push_fd(uint16_t board, uint16_t item_id, const char *type, int fd);
+
+// Data too big for one message (video, disk images) can be streamed:
+// clip_begin_push returns an upload id (0 on error), clip_append_chunk
+// adds the next piece (at most CLIP_MAX_CHUNK bytes) and clip_commit_push
+// puts the finished data on the item. clip_abort_push throws away an
+// unfinished upload. If the connection drops partway the upload is lost
+// and these calls fail; start again from clip_begin_push.
+// Returns -1 if an error occurs
+uint32_t clip_begin_push(uint16_t board, uint16_t item_id, const char *type);
+int clip_append_chunk(uint32_t upload_id, size_t datalen, const char *data);
+int clip_commit_push(uint32_t upload_id);
+int clip_abort_push(uint32_t upload_id);
+
+// Streams data that is already in memory in CLIP_CHUNK_SIZE pieces,
+// starting over once if the connection drops partway
+// Returns -1 if an error occurs
+int
+clip_push_data_chunked(uint16_t board, uint16_t item_id, const char *type, size_t datalen, const char *data);
+
 // Lazy data providers register callback for data
 // void size_t provide_data(uint16_t board, uint16_t item, char *datatype, unsigned char** data_ptr)
+// When a reader asks for a type you promised but didn't push, clipd asks
+// you for it. Set *data_ptr to malloc'ed data (the library frees it) and
+// return its length. Readers of the same data share one request.
+// The request arrives through process_waiting_clipboard_events, so keep
+// processing events while you have promises outstanding.
 typedef size_t(*clip_data_provider)(uint16_t, uint16_t, const char *, unsigned char**);
 
 // Returns -1 on error
@@ -64,6 +122,9 @@ int clip_set_data_provider(uint16_t board, clip_data_provider provider);
 // Lazy data providers need to know when they are no longer responsible for
 // supplying data for a particular clipboard item.
 // void provider_release(uint16_t board, uint16_t item)
+// Called for each of your items clipd pushes out (the ring filled up, the
+// board was dropped), after which nobody will ask for its data. Like data
+// requests, releases arrive through process_waiting_clipboard_events.
 typedef void(*clip_provider_release)(uint16_t, uint16_t);
 
 // Returns negative number on error
@@ -77,6 +138,15 @@ int clip_close();
 
 #pragma mark Data readers
 
+// Counts, typelists and data of up to 1 MB are cached, so asking again
+// doesn't go to clipd. ClipboardChanged and ItemsPushedOut signals keep
+// the cache current: the reading calls handle any signals that are
+// waiting before they look. While clipd may be holding back a
+// ClipboardChanged, counts are asked for again.
+// Those signals come in on a second connection that nothing else uses, so
+// a reading call never runs your change handlers, data providers or async
+// callbacks; only clip_process (or the event loop) does.
+
 // clip_item_count tells you what the last item id is and how many items are
 // on the clipboard
 // Return -1 error (usually can't connect to server, no such board) occurs
@@ -88,10 +158,153 @@ int clip_item_count(uint16_t board, uint16_t *last_item_id_ptr, uint16_t *item_c
 int clip_item_typelist(uint16_t board, uint16_t item_id, char ***types_ptr);
 
 // Actually fetch the data for a particular clipboard/item/type
+// Returns -1 if an error occurs, including when the item has no data of
+// that type (empty data is still data)
 int
 clip_item_data_for_type(uint16_t board, uint16_t item_id, char *type, size_t *datalen,
 			unsigned char **bytes);
 
+// Like clip_item_data_for_type, but clipd hands over a sealed memfd and the
+// bytes are mapped read-only instead of copied. Release them with
+// clip_unmap_data. Empty data comes back as NULL with a length of 0.
+// Returns -1 if an error occurs
+int
+clip_item_data_mapped_for_type(uint16_t board, uint16_t item_id, char *type, size_t *datalen,
+			       const unsigned char **bytes);
+void clip_unmap_data(const unsigned char *bytes, size_t datalen);
+
+// Like clip_item_data_for_type, but data clipd holds compressed crosses
+// the bus compressed and is decompressed here. Cheaper for big text.
+// Returns -1 if an error occurs
+int
+clip_item_data_compressed_for_type(uint16_t board, uint16_t item_id, char *type, size_t *datalen,
+				   unsigned char **bytes);
+
+// How many bytes the data is, without fetching it. With
+// clip_item_data_range, a preview or a type sniffer reads only the part
+// it needs.
+// Returns -1 if an error occurs
+int
+clip_item_data_size(uint16_t board, uint16_t item_id, char *type, uint64_t *datalen);
+
+// Fetch at most maxlen bytes of the data, starting at offset. total gets
+// the size of the whole thing. clipd only decompresses or reads the part
+// asked for. Caller is responsible for freeing bytes.
+// Returns -1 if an error occurs
+int
+clip_item_data_range(uint16_t board, uint16_t item_id, char *type, uint64_t offset, size_t maxlen,
+		     uint64_t *total, size_t *datalen, unsigned char **bytes);
+
+// Receive data in CLIP_CHUNK_SIZE pieces, so it never has to be in memory
+// all at once. The chunk is only valid during the call.
+// int handle_chunk(const unsigned char *chunk, size_t chunklen, uint64_t total, void *userdata)
+// Return a negative number from the handler to stop early.
+typedef int (*clip_chunk_handler)(const unsigned char *, size_t, uint64_t, void *);
+
+// Returns -1 if an error occurs (or the handler's negative result)
+int
+clip_item_data_stream(uint16_t board, uint16_t item_id, char *type, clip_chunk_handler handler,
+		      void *userdata);
+
+// One item of a clipboard's history, as clip_fetch_items returns it
+struct clip_item_info {
+  uint16_t item_id;
+  char *label;
+  char *sender;
+  char **typelist;
+  // The data that came along: inline_datas[i] is inline_datalens[i] bytes
+  // of inline_types[i]. inline_types is NULL-terminated.
+  char **inline_types;
+  size_t *inline_datalens;
+  unsigned char **inline_datas;
+};
+
+// Fetch the items from first_item_id to last_item_id (0 for the oldest /
+// newest), oldest first, in one round trip. Data no bigger than max_inline
+// comes along. What comes back is cached, so fetching it again is free.
+// Free the items with clip_free_items.
+// Returns the number of items, -1 if an error occurs
+int
+clip_fetch_items(uint16_t board, uint16_t first_item_id, uint16_t last_item_id, size_t max_inline,
+		 struct clip_item_info **items);
+void clip_free_items(struct clip_item_info *items, int count);
+
+// An item whose text matched a search, as clip_search_items returns it
+struct clip_search_result {
+  uint16_t item_id;
+  // The type whose data matched
+  char *type;
+  // A line of text around the match
+  char *snippet;
+};
+
+// Find the items whose text holds query (ignoring ASCII case), newest
+// first, at most limit of them (0 for all). clipd searches its own copy,
+// so no data crosses the bus.
+// Free the results with clip_free_search_results.
+// Returns the number of results, -1 if an error occurs
+int
+clip_search_items(uint16_t board, const char *query, uint32_t limit,
+		  struct clip_search_result **results);
+void clip_free_search_results(struct clip_search_result *results, int count);
+
+#pragma mark Type atoms
+
+// A reader that asks for the same types over and over can name them by
+// atom: a number clipd hands out for each type, good until clipd
+// restarts. The library remembers the atoms it has seen and forgets them
+// when clipd goes away.
+
+// Returns 0 if an error occurs
+uint32_t clip_atom_for_type(const char *type);
+
+// You don't own the returned string -- don't free it
+// Returns NULL if clipd doesn't know the atom (or it is from before a restart)
+const char *clip_type_for_atom(uint32_t atom);
+
+// Like clip_item_typelist, as atoms. Caller is responsible for freeing
+// *atoms_ptr.
+// Returns the number of types, -1 if an error occurs
+int clip_item_atoms(uint16_t board, uint16_t item_id, uint32_t **atoms_ptr);
+
+// Like clip_item_data_for_type, with the type as an atom
+int
+clip_item_data_for_atom(uint16_t board, uint16_t item_id, uint32_t atom, size_t *datalen,
+			unsigned char **bytes);
+
+#pragma mark Asynchronous calls
+
+// These send the call and return at once; the callback runs from
+// clip_process (or the sd_event loop clip_attach_event attached to) when
+// clipd answers. status is -1 if the call failed.
+// They return -1 if the call couldn't be sent (the callback won't run).
+
+// void item_created(int status, uint16_t item_id, void *userdata)
+typedef void (*clip_item_callback)(int, uint16_t, void *);
+// void done(int status, void *userdata)
+typedef void (*clip_done_callback)(int, void *);
+// void counted(int status, uint16_t last_item_id, uint16_t item_count, void *userdata)
+typedef void (*clip_count_callback)(int, uint16_t, uint16_t, void *);
+// The typelist is yours -- free it with clip_free_typelist
+// void listed(int status, char **typelist, void *userdata)
+typedef void (*clip_typelist_callback)(int, char **, void *);
+// The bytes are only valid during the call
+// void fetched(int status, const unsigned char *bytes, size_t datalen, void *userdata)
+typedef void (*clip_data_callback)(int, const unsigned char *, size_t, void *);
+
+int clip_create_item_async(uint16_t board, const char *label, char **typelist,
+			   clip_item_callback callback, void *userdata);
+int clip_create_item_with_data_async(uint16_t board, const char *label, char **typelist,
+				     const size_t *datalens, const char **datas,
+				     clip_item_callback callback, void *userdata);
+int clip_push_data_async(uint16_t board, uint16_t item_id, const char *type, size_t datalen,
+			 const char *data, clip_done_callback callback, void *userdata);
+int clip_item_count_async(uint16_t board, clip_count_callback callback, void *userdata);
+int clip_item_typelist_async(uint16_t board, uint16_t item_id, clip_typelist_callback callback,
+			     void *userdata);
+int clip_item_data_for_type_async(uint16_t board, uint16_t item_id, const char *type,
+				  clip_data_callback callback, void *userdata);
+
 #pragma mark Listeners
 
 // Listeners register function pointer to be called when new item
@@ -102,7 +315,36 @@ typedef void (*clip_change_handler)(uint16_t, uint16_t, char *, size_t);
 // Returns -1 on error (can't connect to server, no such board)
 int clip_set_change_handler(uint16_t board, clip_change_handler ch);
 
+// clipd announces a burst of new items with one signal for the newest
+// item. This handler also hears how many items were added before it
+// without a signal of their own.
+// void handle_changes(uint16_t board, uint16_t new_item_id, char *label, size_t item_count, uint32_t skipped);
+typedef void (*clip_coalesced_change_handler)(uint16_t, uint16_t, char *, size_t, uint32_t);
+
+// Returns -1 on error (no such board)
+int clip_set_coalesced_change_handler(uint16_t board, clip_coalesced_change_handler ch);
+
 void wait_for_clipboard_events();
 void process_waiting_clipboard_events();
 
+#pragma mark Event loops
+
+// To run the library from your own poll loop, watch clip_get_fd for
+// clip_get_events (poll flags), wake up after clip_get_timeout
+// milliseconds (-1 for never), and call clip_process when either happens.
+// clip_get_fd and clip_get_events return -1 on error (usually can't
+// connect to server).
+int clip_get_fd();
+int clip_get_events();
+int clip_get_timeout();
+
+// Handle everything that has arrived: replies, signals, provider requests.
+// It also catches the cache up with its own connection, which isn't
+// behind clip_get_fd.
+int clip_process();
+
+// Or let an sd_event loop do all of that
+struct sd_event;
+int clip_attach_event(struct sd_event *event, int priority);
+
 #endif
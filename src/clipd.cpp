@@ -1,207 +1,2044 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <systemd/sd-bus.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
 extern "C" {
 #include "clip_common.h"
+#include "clip_lz4.h"
 }
 #include "store.h"
+#include "workers.h"
+
+using namespace std;
 
 static uint16_t last_item_id = 0;
 
-static int method_create_item(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-  int r;
-  uint16_t clipboard;
-  char *label;
-  r = sd_bus_message_read(m, "qs", &clipboard, &label);
+// Signals and calls to data providers always go out on the session bus,
+// even when the call that caused them came from a peer connection
+static sd_bus *session_bus = NULL;
+
+// Calls from a peer connection have no bus name, so each connection is
+// given a sender of its own, "peer:<n>". Uploads stay its own, but there
+// is no calling it back.
+#define PEER_SENDER_PREFIX "peer:"
+static map<sd_bus *, string> peer_senders;
+static uint64_t last_peer = 0;
+
+static bool is_peer_sender(const char *sender) {
+  return strncmp(sender, PEER_SENDER_PREFIX, strlen(PEER_SENDER_PREFIX)) == 0;
+}
+
+#define MEGABYTE (1024 * 1024)
+#define MILLISECOND (1000)
+
+// Data at least this big is kept in files under $XDG_RUNTIME_DIR/clipd
+#define SPILL_THRESHOLD (1 * MEGABYTE)
+
+// Data at least this big is held compressed if it compresses well
+#define COMPRESS_THRESHOLD (64 * 1024)
+
+// Data at least this big is copied on a worker thread, so that the bus
+// thread keeps answering small requests meanwhile
+#define WORKER_THRESHOLD (256 * 1024)
+#define WORKER_COUNT (4)
+
+static uint64_t now_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#pragma mark Call statistics
+
+// Calls and their latencies, by method, for GetStats. Latencies run from
+// the call arriving to its reply being sent, even when a worker or a data
+// provider answers it later. Everything is counted on the bus thread.
+
+// Bucket i counts calls answered in under 2^i microseconds (and at least
+// half that); the last bucket also counts any slower
+#define LATENCY_BUCKETS (24)
+
+class MethodStats {
+public:
+  const char *name;
+  uint64_t calls;
+  uint64_t latencies[LATENCY_BUCKETS];
+};
+
+// In the order the methods were first called
+static vector<MethodStats *> method_stats;
+
+// A call's method and when it arrived
+class CallTiming {
+public:
+  MethodStats *stats;
+  uint64_t started;
+};
+
+// The call being handled, if it is timed
+static CallTiming *current_call = NULL;
+// Set when the current call's reply was left for later
+static bool call_deferred = false;
+
+static void record_latency(const CallTiming &timing) {
+  if (timing.stats == NULL) {
+    return;
+  }
+  uint64_t usec = now_usec() - timing.started;
+  int bits = usec ? 64 - __builtin_clzll(usec) : 0;
+  timing.stats->latencies[min(bits, LATENCY_BUCKETS - 1)]++;
+}
+
+// For a handler that answers later: the timing to record once it does
+static CallTiming defer_call() {
+  if (current_call == NULL) {
+    CallTiming untimed = {NULL, 0};
+    return untimed;
+  }
+  call_deferred = true;
+  return *current_call;
+}
+
+// Handle the call with timing as the current one
+static int handle_timed(sd_bus_message_handler_t handler, const CallTiming &timing,
+			sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  CallTiming call = timing;
+  current_call = &call;
+  call_deferred = false;
+  int r = handler(m, userdata, ret_error);
+  current_call = NULL;
+  if (!call_deferred) {
+    record_latency(call);
+  }
+  return r;
+}
+
+// Wraps each method in the vtable
+template <sd_bus_message_handler_t handler>
+static int timed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  static MethodStats *stats = NULL;
+  if (stats == NULL) {
+    stats = new MethodStats();
+    stats->name = sd_bus_message_get_member(m);
+    stats->name = strdup(stats->name ? stats->name : "");
+    method_stats.push_back(stats);
+  }
+  stats->calls++;
+  CallTiming timing = {stats, now_usec()};
+  return handle_timed(handler, timing, m, userdata, ret_error);
+}
+
+#pragma mark Lazy data providers
+
+class ParkedCall {
+public:
+  sd_bus_message *m;
+  sd_bus_message_handler_t handler;
+  CallTiming timing;
+};
+
+// Readers waiting for a provider to supply one clipboard/item/type.
+// Concurrent fetches of the same data share a single ProvideData call.
+class PendingProvide {
+public:
+  uint16_t clipboard;
+  uint16_t item_id;
+  string type;
+  // Each parked request and the method handler to re-run it with
+  vector<ParkedCall> waiting;
+};
+
+typedef tuple<uint16_t, uint16_t, string> ProvideKey;
+static map<ProvideKey, PendingProvide *> pending_provides;
+
+// Passed as userdata when a parked request is re-run, so that it is
+// answered with whatever the store has instead of being parked again
+#define RETRY_AFTER_PROVIDE ((void *)1)
+
+// Re-run the calls parked on pending now that the store has what the
+// provider gave, or fail them all if error is set
+static void answer_parked(PendingProvide *pending, const sd_bus_error *error) {
+  pending_provides.erase(ProvideKey(pending->clipboard, pending->item_id, pending->type));
+
+  for (size_t i = 0; i < pending->waiting.size(); i++) {
+    ParkedCall &parked = pending->waiting[i];
+    sd_bus_message *m = parked.m;
+    if (error) {
+      sd_bus_reply_method_errorf(m, SD_BUS_ERROR_FAILED, "Provider failed: %s", error->message);
+      record_latency(parked.timing);
+    } else {
+      sd_bus_error handler_error = SD_BUS_ERROR_NULL;
+      sd_bus_message_rewind(m, 1);
+      int r = handle_timed(parked.handler, parked.timing, m, RETRY_AFTER_PROVIDE, &handler_error);
+      if (r < 0) {
+	sd_bus_reply_method_errno(m, r, &handler_error);
+      }
+      sd_bus_error_free(&handler_error);
+    }
+    sd_bus_message_unref(m);
+  }
+  delete pending;
+}
+
+// A big ProvideData reply whose bytes are being copied off the message.
+// pending stays in pending_provides meanwhile, so new readers of the
+// same data wait for it instead of asking the provider again.
+class ProvideJob {
+public:
+  sd_bus_message *reply;
+  PendingProvide *pending;
+  // Points into reply
+  const unsigned char *data;
+  size_t datalen;
+  PreparedData *prepared;
+};
+
+static void prepare_provide(void *job) {
+  ProvideJob *provide = (ProvideJob *)job;
+  provide->prepared = store_prepare_data(provide->datalen, provide->data);
+}
+
+static void finish_provide(void *job) {
+  ProvideJob *provide = (ProvideJob *)job;
+  PendingProvide *pending = provide->pending;
+  int r = -1;
+  if (provide->prepared) {
+    r = store_store_prepared(pending->clipboard, pending->item_id, pending->type.c_str(),
+			     provide->prepared);
+  }
+  if (r < 0) {
+    fprintf(stderr, "Saving provided data failed for clipboard %u, item %u, type %s\n",
+	    pending->clipboard, pending->item_id, pending->type.c_str());
+  }
+  answer_parked(pending, NULL);
+  sd_bus_message_unref(provide->reply);
+  delete provide;
+}
+
+static int provider_reply(sd_bus_message *reply, void *userdata, sd_bus_error *ret_error) {
+  PendingProvide *pending = (PendingProvide *)userdata;
+
+  const sd_bus_error *error = sd_bus_message_get_error(reply);
+  if (error) {
+    fprintf(stderr, "Provider failed for clipboard %u, item %u, type %s: %s\n",
+	    pending->clipboard, pending->item_id, pending->type.c_str(), error->message);
+  } else {
+    const void *data;
+    size_t datalen;
+    int r = sd_bus_message_read_array(reply, 'y', &data, &datalen);
+    if (r < 0) {
+      fprintf(stderr, "Failed to parse data in ProvideData reply: %s\n", strerror(-r));
+    } else {
+      // Big data is copied on a worker, like PushData's
+      if (datalen >= WORKER_THRESHOLD) {
+	ProvideJob *provide = new ProvideJob;
+	provide->reply = sd_bus_message_ref(reply);
+	provide->pending = pending;
+	provide->data = (const unsigned char *)data;
+	provide->datalen = datalen;
+	provide->prepared = NULL;
+	if (workers_submit(prepare_provide, finish_provide, provide) == 0) {
+	  return 0;
+	}
+	sd_bus_message_unref(reply);
+	delete provide;
+      }
+      // Keep it, so the provider is asked only once
+      store_store_data(pending->clipboard, pending->item_id, pending->type.c_str(), datalen,
+		       (const unsigned char *)data);
+    }
+  }
+
+  answer_parked(pending, error);
+  return 0;
+}
+
+// If type was promised for the item but never pushed, ask the item's
+// creator for it and park m until the answer comes back.
+// Returns 1 if m was parked, 0 if the caller should answer it now
+static int park_for_provider(sd_bus_message *m, void *userdata, sd_bus_message_handler_t handler,
+			     uint16_t clipboard, uint16_t item_id, const char *type) {
+  if (userdata == RETRY_AFTER_PROVIDE) {
+    return 0;
+  }
+  // Resolve 0 ("the last item") so the same data always has the same key
+  if (item_id == 0) {
+    item_id = store_last_item_id(clipboard);
+  }
+  if (!store_is_promised(clipboard, item_id, type)) {
+    return 0;
+  }
+
+  ProvideKey key(clipboard, item_id, type);
+  map<ProvideKey, PendingProvide *>::iterator it = pending_provides.find(key);
+  if (it == pending_provides.end()) {
+    const char *sender = store_sender_for_item(clipboard, item_id);
+    if (sender == NULL || *sender == '\0' || is_peer_sender(sender)) {
+      return 0;
+    }
+    PendingProvide *pending = new PendingProvide;
+    pending->clipboard = clipboard;
+    pending->item_id = item_id;
+    pending->type = type;
+    int r = sd_bus_call_method_async(session_bus, NULL, sender, CLIP_PATH,
+				     CLIP_PROVIDER_INTERFACE, "ProvideData", provider_reply,
+				     pending, "qqs", clipboard, item_id, type);
+    if (r < 0) {
+      fprintf(stderr, "Unable to ask %s for clipboard %u, item %u, type %s: %s\n",
+	      sender, clipboard, item_id, type, strerror(-r));
+      delete pending;
+      return 0;
+    }
+    it = pending_provides.insert(make_pair(key, pending)).first;
+  }
+
+  ParkedCall parked = {sd_bus_message_ref(m), handler, defer_call()};
+  it->second->waiting.push_back(parked);
+  return 1;
+}
+
+#pragma mark Change signals
+
+// Bursts of new items (scripts, drag sessions) would wake every watcher
+// for each item. After a signal, a board stays quiet for its window; the
+// items created meanwhile are announced by a single signal for the newest
+// one, which says how many were skipped.
+class BoardSignals {
+public:
+  uint64_t window = 0;
+  uint64_t last_sent = 0;
+  bool pending = false;
+  uint16_t item_id = 0;
+  string label;
+  uint32_t skipped = 0;
+};
+
+// Only boards that have had a new item are here
+static unordered_map<uint16_t, BoardSignals> board_signals;
+// The window of named boards
+static uint64_t named_signal_window = 0;
+// Boards with a signal held back
+static set<uint16_t> held_signals;
+// Boards that lost items since their last signal
+static set<uint16_t> trimmed_boards;
+
+static void set_signal_window(uint16_t clipboard, uint64_t window_usec) {
+  board_signals[clipboard].window = window_usec;
+}
+
+static BoardSignals &signals_for(uint16_t clipboard) {
+  unordered_map<uint16_t, BoardSignals>::iterator it = board_signals.find(clipboard);
+  if (it == board_signals.end()) {
+    it = board_signals.emplace(clipboard, BoardSignals()).first;
+    it->second.window = named_signal_window;
+  }
+  return it->second;
+}
+
+static int send_clipboard_changed(sd_bus *bus, uint16_t clipboard, uint16_t item_id, const char *label,
+				  uint32_t skipped) {
+  sd_bus_message *signal = NULL;
+  int r = sd_bus_message_new_signal(bus, &signal, CLIP_PATH, CLIP_INTERFACE, "ClipboardChanged");
+  if (r < 0) {
+    fprintf(stderr, "Creation of signal message failed\n");
+    return r;
+  }
+  // Readers can't trust a count they were told until the window is over:
+  // items made during it aren't announced before then
+  uint16_t item_count = store_item_count(clipboard);
+  r = sd_bus_message_append(signal,"qqsqut", clipboard, item_id, label, item_count, skipped,
+			    signals_for(clipboard).window);
+  if (r >= 0) {
+    r = sd_bus_send(bus, signal, NULL);
+  }
+  sd_bus_message_unref(signal);
+  return r;
+}
+
+// Tell watchers that an item was added, now or once the board's window
+// is over
+static int signal_clipboard_changed(sd_bus *bus, uint16_t clipboard, uint16_t item_id, const char *label) {
+  if (store_board_name(clipboard) == NULL) {
+    return 0;
+  }
+  BoardSignals &board = signals_for(clipboard);
+  uint64_t now = now_usec();
+  // This signal, now or held, carries the count
+  trimmed_boards.erase(clipboard);
+  if (!board.pending && now - board.last_sent >= board.window) {
+    board.last_sent = now;
+    return send_clipboard_changed(bus, clipboard, item_id, label, 0);
+  }
+  if (board.pending) {
+    board.skipped++;
+  }
+  board.pending = true;
+  board.item_id = item_id;
+  board.label = label;
+  held_signals.insert(clipboard);
+  return 0;
+}
+
+// Send the held signals whose window is over
+// Returns how many microseconds until the next one is due, UINT64_MAX if none is held
+static uint64_t flush_clipboard_changed(sd_bus *bus) {
+  uint64_t now = now_usec();
+  uint64_t next = UINT64_MAX;
+  set<uint16_t>::iterator it = held_signals.begin();
+  while (it != held_signals.end()) {
+    BoardSignals &board = board_signals[*it];
+    uint64_t due = board.last_sent + board.window;
+    if (due > now) {
+      next = min(next, due - now);
+      it++;
+      continue;
+    }
+    send_clipboard_changed(bus, *it, board.item_id, board.label.c_str(), board.skipped);
+    board.last_sent = now;
+    board.pending = false;
+    board.skipped = 0;
+    it = held_signals.erase(it);
+  }
+  return next;
+}
+
+#pragma mark Provider releases
+
+// Items pushed out since the last flush, by the sender that created them.
+// A budget cut, a smaller ring or a dropped board pushes out many items at
+// once, so each sender hears about them in one call.
+static map<string, vector<pair<uint16_t, uint16_t>>> pending_releases;
+
+static void item_evicted(uint16_t clipboard, uint16_t item_id, const char *sender) {
+  trimmed_boards.insert(clipboard);
+  // Without a bus name there is nobody to tell
+  if (*sender != '\0' && !is_peer_sender(sender)) {
+    pending_releases[sender].push_back(make_pair(clipboard, item_id));
+  }
+}
+
+// Tell each provider which of its items nobody can read any more, so it
+// can stop holding their data. Nothing waits for an answer.
+static void flush_releases(sd_bus *bus) {
+  map<string, vector<pair<uint16_t, uint16_t>>>::iterator it;
+  for (it = pending_releases.begin(); it != pending_releases.end(); it++) {
+    vector<pair<uint16_t, uint16_t>> &items = it->second;
+    sd_bus_message *call = NULL;
+    int r = sd_bus_message_new_method_call(bus, &call, it->first.c_str(), CLIP_PATH,
+					   CLIP_PROVIDER_INTERFACE, "ReleaseItems");
+    if (r >= 0) {
+      r = sd_bus_message_set_expect_reply(call, 0);
+    }
+    if (r >= 0) {
+      r = sd_bus_message_open_container(call, 'a', "(qq)");
+    }
+    for (size_t i = 0; r >= 0 && i < items.size(); i++) {
+      r = sd_bus_message_append(call, "(qq)", items[i].first, items[i].second);
+    }
+    if (r >= 0) {
+      r = sd_bus_message_close_container(call);
+    }
+    if (r >= 0) {
+      r = sd_bus_send(bus, call, NULL);
+    }
+    if (r < 0) {
+      fprintf(stderr, "Unable to release %zu items of %s: %s\n", items.size(), it->first.c_str(),
+	      strerror(-r));
+    }
+    sd_bus_message_unref(call);
+  }
+  pending_releases.clear();
+}
+
+// Items pushed out by anything but a new item (a byte budget, a smaller
+// ring) have no ClipboardChanged to say so, so readers hear the board's
+// new count from ItemsPushedOut
+static void flush_pushed_out(sd_bus *bus) {
+  set<uint16_t>::iterator it;
+  for (it = trimmed_boards.begin(); it != trimmed_boards.end(); it++) {
+    if (store_board_name(*it) == NULL) {
+      continue;
+    }
+    sd_bus_message *signal = NULL;
+    int r = sd_bus_message_new_signal(bus, &signal, CLIP_PATH, CLIP_INTERFACE, "ItemsPushedOut");
+    if (r >= 0) {
+      r = sd_bus_message_append(signal, "qqq", *it, store_last_item_id(*it), store_item_count(*it));
+    }
+    if (r >= 0) {
+      r = sd_bus_send(bus, signal, NULL);
+    }
+    if (r < 0) {
+      fprintf(stderr, "Unable to signal that board %u lost items: %s\n", *it, strerror(-r));
+    }
+    sd_bus_message_unref(signal);
+  }
+  trimmed_boards.clear();
+}
+
+#pragma mark Named boards
+
+// A board nobody has used for this long is dropped
+#define BOARD_IDLE_SECONDS (30 * 60)
+// How often to look for idle boards
+#define BOARD_SWEEP_SECONDS (60)
+
+// New boards get these ring settings unless they ask for others, and
+// can't ask for more than the general clipboard has
+#define NAMED_RING_SIZE (5)
+#define NAMED_RING_BUDGET (64 * MEGABYTE)
+#define MAX_NAMED_RING_SIZE (64)
+#define MAX_NAMED_RING_BUDGET (512 * MEGABYTE)
+
+static void board_dropped(void *context, uint16_t clipboard) {
+  sd_bus *bus = (sd_bus *)context;
+  board_signals.erase(clipboard);
+  held_signals.erase(clipboard);
+  trimmed_boards.erase(clipboard);
+
+  // Readers may still hold its id
+  sd_bus_message *signal = NULL;
+  int r = sd_bus_message_new_signal(bus, &signal, CLIP_PATH, CLIP_INTERFACE, "BoardDropped");
+  if (r >= 0) {
+    r = sd_bus_message_append(signal, "q", clipboard);
+  }
+  if (r >= 0) {
+    r = sd_bus_send(bus, signal, NULL);
+  }
+  if (r < 0) {
+    fprintf(stderr, "Unable to signal that board %u was dropped: %s\n", clipboard, strerror(-r));
+  }
+  sd_bus_message_unref(signal);
+}
+
+// Call when idle: drops the boards nobody has used for a while
+static void sweep_idle_boards(sd_bus *bus) {
+  static time_t last_sweep = 0;
+  time_t now = time(NULL);
+  if (now - last_sweep < BOARD_SWEEP_SECONDS) {
+    return;
+  }
+  last_sweep = now;
+  store_drop_idle_boards(BOARD_IDLE_SECONDS, board_dropped, bus);
+}
+
+#pragma mark Worker jobs
+
+// Workers only copy bytes. Everything else -- parsing, the store, sending
+// and every sd-bus ref or unref -- stays on the bus thread, because sd-bus
+// objects aren't thread-safe.
+
+// A FetchData or FetchRange reply whose bytes are being copied in
+class FetchJob {
+public:
+  sd_bus_message *m;
+  sd_bus_message *reply;
+  const Payload *payload;
+  // Copy the compressed frame as it is, rather than the data
+  bool frame;
+  uint64_t offset;
+  size_t length;
+  // Room for length bytes in the reply
+  void *space;
+  bool ok;
+  // Recorded once a worker has filled the reply
+  CallTiming timing;
+};
+
+static void fill_fetch(void *job) {
+  FetchJob *fetch = (FetchJob *)job;
+  if (fetch->frame) {
+    size_t framelen;
+    memcpy(fetch->space, store_payload_frame(fetch->payload, &framelen) + fetch->offset,
+	   fetch->length);
+    fetch->ok = true;
+    return;
+  }
+  // Spilled or compressed data is only read or decompressed where it
+  // covers the range
+  fetch->ok = store_payload_read(fetch->payload, fetch->offset, fetch->length,
+				 (unsigned char *)fetch->space) == 0;
+}
+
+static void finish_fetch(void *job) {
+  FetchJob *fetch = (FetchJob *)job;
+  store_payload_discard(fetch->payload);
+  int r;
+  if (fetch->ok) {
+    r = sd_bus_send(sd_bus_message_get_bus(fetch->m), fetch->reply, NULL);
+  } else {
+    r = sd_bus_reply_method_errorf(fetch->m, SD_BUS_ERROR_FAILED, "Unable to read data");
+  }
+  if (r < 0) {
+    fprintf(stderr, "Unable to send data: %s\n", strerror(-r));
+  }
+  record_latency(fetch->timing);
+  sd_bus_message_unref(fetch->reply);
+  sd_bus_message_unref(fetch->m);
+  delete fetch;
+}
+
+// Finish reply with length bytes of payload from offset, or of its
+// compressed frame, copied on a worker if there are many. Takes the reply
+// and the payload (retained with store_retain_payload, not yet opened).
+static int send_bytes(sd_bus_message *m, sd_bus_message *reply, const Payload *payload,
+		      bool frame, uint64_t offset, size_t length) {
+  FetchJob *fetch = new FetchJob;
+  int r = sd_bus_message_append_array_space(reply, 'y', length, &fetch->space);
+  if (r < 0) {
+    fprintf(stderr, "Unable to make room for %zu bytes in reply: %s\n", length, strerror(-r));
+    store_payload_discard(payload);
+    sd_bus_message_unref(reply);
+    delete fetch;
+    return r;
+  }
+  fetch->m = sd_bus_message_ref(m);
+  fetch->reply = reply;
+  fetch->payload = payload;
+  fetch->frame = frame;
+  fetch->offset = offset;
+  fetch->length = length;
+  fetch->ok = false;
+  fetch->timing.stats = NULL;
+  if (length < WORKER_THRESHOLD
+      || workers_submit(fill_fetch, finish_fetch, fetch) < 0) {
+    fill_fetch(fetch);
+    finish_fetch(fetch);
+  } else {
+    // finish_fetch only runs from workers_dispatch, after we return
+    fetch->timing = defer_call();
+  }
+  return 1;
+}
+
+static int send_payload(sd_bus_message *m, sd_bus_message *reply, const Payload *payload,
+			uint64_t offset, size_t length) {
+  return send_bytes(m, reply, payload, false, offset, length);
+}
+
+// PushData whose bytes are being copied off the bus message
+class PushJob {
+public:
+  sd_bus_message *m;
+  uint16_t clipboard;
+  uint16_t item_id;
+  // Point into m
+  const char *type;
+  const unsigned char *data;
+  size_t datalen;
+  PreparedData *prepared;
+  CallTiming timing;
+};
+
+static void prepare_push(void *job) {
+  PushJob *push = (PushJob *)job;
+  push->prepared = store_prepare_data(push->datalen, push->data);
+}
+
+static void finish_push(void *job) {
+  PushJob *push = (PushJob *)job;
+  int r = -1;
+  if (push->prepared) {
+    r = store_store_prepared(push->clipboard, push->item_id, push->type, push->prepared);
+  }
+  if (r < 0) {
+    fprintf(stderr, "Saving data failed in PushData\n");
+  }
+  r = sd_bus_reply_method_return(push->m, "");
+  if (r < 0) {
+    fprintf(stderr, "Unable to return in PushData: %s\n", strerror(-r));
+  }
+  record_latency(push->timing);
+  sd_bus_message_unref(push->m);
+  delete push;
+}
+
+// CreateItemWithData, waiting for its big payloads to be copied off the
+// bus message. The item is only made once they are ready, so nobody sees
+// it before all of its data is there.
+class CreateJob {
+public:
+  sd_bus_message *m;
+  uint16_t clipboard;
+  // Point into m
+  const char *label;
+  string sender;
+  vector<char *> typelist;
+  vector<const unsigned char *> datas;
+  vector<size_t> datalens;
+  // The big payloads, copied; NULL for the ones stored as they are
+  vector<PreparedData *> prepared;
+  CallTiming timing;
+};
+
+static void prepare_create(void *job) {
+  CreateJob *create = (CreateJob *)job;
+  for (size_t i = 0; i < create->datas.size(); i++) {
+    if (create->datalens[i] >= WORKER_THRESHOLD) {
+      create->prepared[i] = store_prepare_data(create->datalens[i], create->datas[i]);
+    }
+  }
+}
+
+// Makes the item and puts all its data on it in one go on the bus thread,
+// then answers
+static int create_with_data(CreateJob *create) {
+  uint16_t clipboard = create->clipboard;
+  uint16_t pushed_out_id;
+  char *owner;
+  uint16_t item_id = store_create_item(clipboard, create->label, create->sender.c_str(),
+				       &create->typelist[0], &pushed_out_id, &owner);
+  if (owner) {
+    free(owner);
+  }
+
+  bool gone = false;
+  for (size_t i = 0; i < create->datas.size(); i++) {
+    int r;
+    if (item_id == 0) {
+      store_discard_prepared(create->prepared[i]);
+      continue;
+    }
+    if (create->datalens[i] < WORKER_THRESHOLD) {
+      r = store_store_data(clipboard, item_id, create->typelist[i], create->datalens[i],
+			   create->datas[i]);
+    } else if (create->prepared[i]) {
+      r = store_store_prepared(clipboard, item_id, create->typelist[i], create->prepared[i]);
+    } else {
+      r = -1;
+    }
+    if (r == 0) {
+      gone = true;
+    } else if (r < 0) {
+      fprintf(stderr, "Saving data failed in CreateItemWithData\n");
+    }
+  }
+  if (item_id == 0) {
+    return sd_bus_reply_method_errorf(create->m, SD_BUS_ERROR_INVALID_ARGS,
+				      "Unable to create item on clipboard %u", clipboard);
+  }
+  if (gone) {
+    return sd_bus_reply_method_errorf(create->m, SD_BUS_ERROR_FAILED,
+				      "Item %u was pushed out of clipboard %u before its data was stored",
+				      item_id, clipboard);
+  }
+
+  int r = sd_bus_reply_method_return(create->m, "qq", item_id, pushed_out_id);
+  if (r < 0) {
+    fprintf(stderr, "Unable to return in CreateItemWithData\n");
+  }
+  return signal_clipboard_changed(session_bus, clipboard, item_id, create->label);
+}
+
+static void finish_create(void *job) {
+  CreateJob *create = (CreateJob *)job;
+  create_with_data(create);
+  record_latency(create->timing);
+  sd_bus_message_unref(create->m);
+  delete create;
+}
+
+#pragma mark Methods
+
+static const char *sender_of(sd_bus_message *m) {
+  const char *sender = sd_bus_message_get_sender(m);
+  if (sender) {
+    return sender;
+  }
+  map<sd_bus *, string>::iterator it = peer_senders.find(sd_bus_message_get_bus(m));
+  return it == peer_senders.end() ? "" : it->second.c_str();
+}
+
+static int method_create_item(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  int r;
+  uint16_t clipboard;
+  char *label;
+  r = sd_bus_message_read(m, "qs", &clipboard, &label);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse clipboard ID and label in CreateItem: %s\n", strerror(-r));
+    return r;
+  }
+  
+  char **typelist;
+  r = sd_bus_message_read_strv(m, &typelist);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse typelist in CreateItem: %s\n", strerror(-r));
+    return r;
+  }
+
+  const char *sender = sender_of(m);
+  // Promised data is asked for on the session bus, where a peer can't be
+  // reached
+  if (is_peer_sender(sender) && typelist[0] != NULL) {
+    clip_free_typelist(typelist);
+    return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_NOT_SUPPORTED,
+				      "Promised types can't be declared over a peer connection; "
+				      "use CreateItemWithData");
+  }
+  
+  char **current_type = typelist;
+  uint16_t pushed_out_id;
+  char *owner;
+  uint16_t last_item_id = store_create_item(clipboard, label, sender, typelist, &pushed_out_id, &owner);
+  // The former owner hears that it was released from item_evicted
+  if (owner) {
+    free(owner);
+  }
+  r = sd_bus_reply_method_return(m, "qq", last_item_id, pushed_out_id);
+  if (r < 0) {
+    fprintf(stderr, "Unable to return in CreateItem\n");
+  }
+  
+  return signal_clipboard_changed(session_bus, clipboard, last_item_id, label);
+}
+
+// CreateItem and a PushData for every type in one call, so watchers only
+// hear about the item once all its data is there
+static int method_create_item_with_data(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  int r;
+  uint16_t clipboard;
+  char *label;
+  r = sd_bus_message_read(m, "qs", &clipboard, &label);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse clipboard ID and label in CreateItemWithData: %s\n", strerror(-r));
+    return r;
+  }
+
+  // The types and bytes stay in the message until we are done
+  vector<char *> typelist;
+  vector<const void *> datas;
+  vector<size_t> datalens;
+  r = sd_bus_message_enter_container(m, 'a', "{say}");
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse data in CreateItemWithData: %s\n", strerror(-r));
+    return r;
+  }
+  while ((r = sd_bus_message_enter_container(m, 'e', "say")) > 0) {
+    char *type;
+    const void *data;
+    size_t datalen;
+    r = sd_bus_message_read(m, "s", &type);
+    if (r >= 0) {
+      r = sd_bus_message_read_array(m, 'y', &data, &datalen);
+    }
+    if (r >= 0) {
+      r = sd_bus_message_exit_container(m);
+    }
+    if (r < 0) {
+      fprintf(stderr, "Failed to parse data in CreateItemWithData: %s\n", strerror(-r));
+      return r;
+    }
+    typelist.push_back(type);
+    datas.push_back(data);
+    datalens.push_back(datalen);
+  }
+  if (r < 0 || (r = sd_bus_message_exit_container(m)) < 0) {
+    fprintf(stderr, "Failed to parse data in CreateItemWithData: %s\n", strerror(-r));
+    return r;
+  }
+  typelist.push_back(NULL);
+
+  CreateJob *create = new CreateJob;
+  create->m = m;
+  create->clipboard = clipboard;
+  create->label = label;
+  create->sender = sender_of(m);
+  create->typelist.swap(typelist);
+  for (size_t i = 0; i < datas.size(); i++) {
+    create->datas.push_back((const unsigned char *)datas[i]);
+    create->datalens.push_back(datalens[i]);
+  }
+  create->prepared.resize(datas.size(), NULL);
+
+  // Big data is copied on a worker first, as for PushData
+  bool big = false;
+  for (size_t i = 0; i < datalens.size(); i++) {
+    big = big || datalens[i] >= WORKER_THRESHOLD;
+  }
+  if (big) {
+    sd_bus_message_ref(m);
+    if (workers_submit(prepare_create, finish_create, create) == 0) {
+      create->timing = defer_call();
+      return 1;
+    }
+    sd_bus_message_unref(m);
+    prepare_create(create);
+  }
+  r = create_with_data(create);
+  delete create;
+  return r;
+}
+
+static int method_push_data(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  int r;
+  uint16_t clipboard;
+  uint16_t item_id;
+  char *type;
+  r = sd_bus_message_read(m, "qqs", &clipboard, &item_id, &type);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse clipboard ID, item_id, and type in PushData: %s\n", strerror(-r));
+    return r;
+  }
+  
+  unsigned char *data;
+  size_t datalen;
+  r = sd_bus_message_read_array(m, 'y', (const void **)&data, &datalen);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse data in PushData: %s\n", strerror(-r));
+    return r;
+  }
+
+  // Big data is copied on a worker; the message keeps type and data alive
+  if (datalen >= WORKER_THRESHOLD) {
+    PushJob *push = new PushJob;
+    push->m = sd_bus_message_ref(m);
+    push->clipboard = clipboard;
+    push->item_id = item_id;
+    push->type = type;
+    push->data = data;
+    push->datalen = datalen;
+    push->prepared = NULL;
+    if (workers_submit(prepare_push, finish_push, push) == 0) {
+      push->timing = defer_call();
+      return 1;
+    }
+    sd_bus_message_unref(m);
+    delete push;
+  }
+
+  // This will copy the type and data (which will be invalid after message
+  // is freed
+  r = store_store_data(clipboard, item_id, type, datalen, data);
+  if (r < 0) {
+    fprintf(stderr, "Saving data failed in PushData\n");
+  } 
+  
+  return sd_bus_reply_method_return(m, "");
+}
+
+static int method_fetch_data(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  int r;
+  uint16_t clipboard;
+  uint16_t item_id;
+  char *type;
+  r = sd_bus_message_read(m, "qqs", &clipboard, &item_id, &type);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse clipboard ID, item_id, type in FetchData: %s\n", strerror(-r));
+    return r;
+  }
+
+  // Borrow the stored bytes; they go straight into the reply. Plain text
+  // can be made from the RTF, say, without asking a lazy provider.
+  store_convert_data(clipboard, item_id, type);
+  const Payload *payload = store_retain_payload(clipboard, item_id, type);
+  if (payload == NULL && park_for_provider(m, userdata, method_fetch_data, clipboard, item_id, type)) {
+    return 1;
+  }
+  if (payload == NULL) {
+    fprintf(stderr, "Failed to fetch data from store: clipboard %u, item %u, type %s\n", clipboard, item_id, type);
+    return sd_bus_reply_method_errorf(m, CLIP_ERROR_NO_DATA,
+				      "No data for clipboard %u, item %u, type %s",
+				      clipboard, item_id, type);
+  }
+
+  sd_bus_message *reply;
+  r = sd_bus_message_new_method_return(m, &reply);
+  if (r < 0) {
+    fprintf(stderr, "Unable to make return message\n");
+    store_payload_discard(payload);
+    return -1;
+  }
+  return send_payload(m, reply, payload, 0, store_payload_length(payload));
+}
+
+// Like FetchData, but data held compressed is sent as is, for the reader
+// to decompress. Also returns the encoding and the decompressed length.
+static int method_fetch_data_compressed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  int r;
+  uint16_t clipboard;
+  uint16_t item_id;
+  char *type;
+  r = sd_bus_message_read(m, "qqs", &clipboard, &item_id, &type);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse clipboard ID, item_id, type in FetchDataCompressed: %s\n", strerror(-r));
+    return r;
+  }
+
+  store_convert_data(clipboard, item_id, type);
+  const Payload *payload = store_retain_payload(clipboard, item_id, type);
+  if (payload == NULL
+      && park_for_provider(m, userdata, method_fetch_data_compressed, clipboard, item_id, type)) {
+    return 1;
+  }
+  if (payload == NULL) {
+    return sd_bus_reply_method_errorf(m, CLIP_ERROR_NO_DATA,
+				      "No data for clipboard %u, item %u, type %s",
+				      clipboard, item_id, type);
+  }
+
+  // Data that isn't held compressed goes out as it is. Either way the
+  // bytes are copied into the reply like FetchData's.
+  size_t framelen;
+  bool compressed = store_payload_frame(payload, &framelen) != NULL;
+  size_t rawlen = store_payload_length(payload);
+  sd_bus_message *reply = NULL;
+  r = sd_bus_message_new_method_return(m, &reply);
+  if (r >= 0) {
+    r = sd_bus_message_append(reply, "st", compressed ? CLIP_ENCODING_LZ4 : CLIP_ENCODING_IDENTITY,
+			      (uint64_t)rawlen);
+  }
+  if (r < 0) {
+    fprintf(stderr, "Unable to make return message\n");
+    sd_bus_message_unref(reply);
+    store_payload_discard(payload);
+    return -1;
+  }
+  return send_bytes(m, reply, payload, compressed, 0, compressed ? framelen : rawlen);
+}
+
+static int method_push_data_fd(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  int r;
+  uint16_t clipboard;
+  uint16_t item_id;
+  char *type;
+  int fd;
+  r = sd_bus_message_read(m, "qqsh", &clipboard, &item_id, &type, &fd);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse clipboard ID, item_id, type and fd in PushDataFd: %s\n", strerror(-r));
+    return r;
+  }
+
+  // The message owns fd; the store keeps its own duplicate
+  r = store_store_fd(clipboard, item_id, type, fd);
+  if (r < 0) {
+    return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_INVALID_ARGS,
+				      "Unable to store sealed memfd for clipboard %u, item %u, type %s",
+				      clipboard, item_id, type);
+  }
+
+  return sd_bus_reply_method_return(m, "");
+}
+
+static int method_fetch_data_fd(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  int r;
+  uint16_t clipboard;
+  uint16_t item_id;
+  char *type;
+  r = sd_bus_message_read(m, "qqs", &clipboard, &item_id, &type);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse clipboard ID, item_id, type in FetchDataFd: %s\n", strerror(-r));
+    return r;
+  }
+
+  // sd-bus duplicates the fd into the reply, so ours is closed after
+  int fd;
+  store_convert_data(clipboard, item_id, type);
+  r = store_fetch_fd(clipboard, item_id, type, &fd);
+  if (r < 0 && park_for_provider(m, userdata, method_fetch_data_fd, clipboard, item_id, type)) {
+    return 1;
+  }
+  if (r < 0) {
+    return sd_bus_reply_method_errorf(m, CLIP_ERROR_NO_DATA,
+				      "No data for clipboard %u, item %u, type %s",
+				      clipboard, item_id, type);
+  }
+
+  r = sd_bus_reply_method_return(m, "h", fd);
+  close(fd);
+  return r;
+}
+
+static int method_begin_push(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  int r;
+  uint16_t clipboard;
+  uint16_t item_id;
+  char *type;
+  r = sd_bus_message_read(m, "qqs", &clipboard, &item_id, &type);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse clipboard ID, item_id, and type in BeginPush: %s\n", strerror(-r));
+    return r;
+  }
+
+  uint32_t upload_id = store_begin_upload(clipboard, item_id, type, sender_of(m));
+  if (upload_id == 0) {
+    return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_FAILED,
+				      "Unable to begin upload for clipboard %u, item %u, type %s",
+				      clipboard, item_id, type);
+  }
+  return sd_bus_reply_method_return(m, "u", upload_id);
+}
+
+static int method_append_chunk(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  int r;
+  uint32_t upload_id;
+  r = sd_bus_message_read(m, "u", &upload_id);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse upload ID in AppendChunk: %s\n", strerror(-r));
+    return r;
+  }
+
+  unsigned char *data;
+  size_t datalen;
+  r = sd_bus_message_read_array(m, 'y', (const void **)&data, &datalen);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse data in AppendChunk: %s\n", strerror(-r));
+    return r;
+  }
+  if (datalen > CLIP_MAX_CHUNK) {
+    return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_LIMITS_EXCEEDED,
+				      "Chunk of %zu bytes is bigger than %u", datalen, CLIP_MAX_CHUNK);
+  }
+
+  r = store_append_upload(upload_id, sender_of(m), datalen, data);
+  if (r < 0) {
+    return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_FAILED, "Unable to append to upload %u", upload_id);
+  }
+  return sd_bus_reply_method_return(m, "");
+}
+
+static int method_commit_push(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  int r;
+  uint32_t upload_id;
+  r = sd_bus_message_read(m, "u", &upload_id);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse upload ID in CommitPush: %s\n", strerror(-r));
+    return r;
+  }
+
+  r = store_commit_upload(upload_id, sender_of(m));
+  if (r < 0) {
+    return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_FAILED, "Unable to commit upload %u", upload_id);
+  }
+  return sd_bus_reply_method_return(m, "");
+}
+
+static int method_abort_push(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  int r;
+  uint32_t upload_id;
+  r = sd_bus_message_read(m, "u", &upload_id);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse upload ID in AbortPush: %s\n", strerror(-r));
+    return r;
+  }
+
+  store_abort_upload(upload_id, sender_of(m));
+  return sd_bus_reply_method_return(m, "");
+}
+
+static int method_fetch_range(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  int r;
+  uint16_t clipboard;
+  uint16_t item_id;
+  char *type;
+  uint64_t offset;
+  uint32_t length;
+  r = sd_bus_message_read(m, "qqstu", &clipboard, &item_id, &type, &offset, &length);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse clipboard ID, item_id, type, offset and length in FetchRange: %s\n", strerror(-r));
+    return r;
+  }
+
+  store_convert_data(clipboard, item_id, type);
+  const Payload *payload = store_retain_payload(clipboard, item_id, type);
+  if (payload == NULL && park_for_provider(m, userdata, method_fetch_range, clipboard, item_id, type)) {
+    return 1;
+  }
+  if (payload == NULL) {
+    return sd_bus_reply_method_errorf(m, CLIP_ERROR_NO_DATA,
+				      "No data for clipboard %u, item %u, type %s",
+				      clipboard, item_id, type);
+  }
+
+  // Reply with the total size and whatever part of the range exists
+  uint64_t total = store_payload_length(payload);
+  size_t chunklen = 0;
+  if (offset < total) {
+    chunklen = total - offset;
+    if (chunklen > length) {
+      chunklen = length;
+    }
+    if (chunklen > CLIP_MAX_CHUNK) {
+      chunklen = CLIP_MAX_CHUNK;
+    }
+  }
+
+  sd_bus_message *reply;
+  r = sd_bus_message_new_method_return(m, &reply);
+  if (r < 0) {
+    fprintf(stderr, "Unable to make return message\n");
+    store_payload_discard(payload);
+    return r;
+  }
+  sd_bus_message_append(reply, "t", total);
+  return send_payload(m, reply, payload, offset, chunklen);
+}
+
+// How big the data is, without sending any of it, so a reader can decide
+// how much of it to fetch
+static int method_get_data_size(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  int r;
+  uint16_t clipboard;
+  uint16_t item_id;
+  char *type;
+  r = sd_bus_message_read(m, "qqs", &clipboard, &item_id, &type);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse clipboard ID, item_id, type in GetDataSize: %s\n", strerror(-r));
+    return r;
+  }
+
+  size_t datalen;
+  store_convert_data(clipboard, item_id, type);
+  r = store_fetch_data(clipboard, item_id, type, &datalen, NULL);
+  if (r < 0 && park_for_provider(m, userdata, method_get_data_size, clipboard, item_id, type)) {
+    return 1;
+  }
+  if (r < 0) {
+    return sd_bus_reply_method_errorf(m, CLIP_ERROR_NO_DATA,
+				      "No data for clipboard %u, item %u, type %s",
+				      clipboard, item_id, type);
+  }
+  return sd_bus_reply_method_return(m, "t", (uint64_t)datalen);
+}
+
+// The id of the board with this name, made now if need be. 0 asks for
+// the default ring size or budget.
+static int method_open_board(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  int r;
+  char *name;
+  uint16_t max_items;
+  uint64_t max_bytes;
+  r = sd_bus_message_read(m, "sqt", &name, &max_items, &max_bytes);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse name, ring size and budget in OpenBoard: %s\n", strerror(-r));
+    return r;
+  }
+
+  if (max_items == 0) {
+    max_items = NAMED_RING_SIZE;
+  }
+  if (max_bytes == 0) {
+    max_bytes = NAMED_RING_BUDGET;
+  }
+  r = store_open_board(name, min<uint16_t>(max_items, MAX_NAMED_RING_SIZE),
+		       min<uint64_t>(max_bytes, MAX_NAMED_RING_BUDGET));
+  if (r < 0) {
+    return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_LIMITS_EXCEEDED, "Unable to open board %s", name);
+  }
+  return sd_bus_reply_method_return(m, "q", (uint16_t)r);
+}
+
+static int method_item_count(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  int r;
+  uint16_t clipboard;
+  r = sd_bus_message_read(m, "q", &clipboard);
+  if (r<0) {
+    sd_bus_reply_method_errorf(m, "Bad Format", "Unable to parse ItemCount call");
+    return r;
+  }
+
+  uint16_t last_item_id = store_last_item_id(clipboard);
+  uint16_t item_count = store_item_count(clipboard);
+
+  return sd_bus_reply_method_return(m, "qq", last_item_id, item_count);
+}
+
+static int method_typelist(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  int r;
+  uint16_t clipboard;
+  uint16_t item_id;
+  r = sd_bus_message_read(m, "qq", &clipboard, &item_id);
+  if (r<0) {
+    sd_bus_reply_method_errorf(m, "Bad Format", "Unable to parse TypeList call");
+    return r;
+  }
+
+  // The interned names go straight into the reply; nothing is copied
+  const uint32_t *atoms;
+  int count = store_item_atoms(clipboard, item_id, &atoms);
+  if (count < 0) {
+    sd_bus_reply_method_errorf(m, "Bad Format", "Unable to get type list for clipboard %u, item %u",
+			       clipboard, item_id);
+    return -1;
+  }
+
+  sd_bus_message *reply;
+  r = sd_bus_message_new_method_return(m, &reply);
+  if (r < 0) {
+    fprintf(stderr, "Unable to make return message\n");
+    return -1;
+  }
+  r = sd_bus_message_open_container(reply, 'a', "s");
+  for (int i = 0; r >= 0 && i < count; i++) {
+    r = sd_bus_message_append_basic(reply, 's', store_type_for_atom(atoms[i]));
+  }
+  if (r >= 0) {
+    r = sd_bus_message_close_container(reply);
+  }
+  if (r >= 0) {
+    r = sd_bus_send(sd_bus_message_get_bus(m), reply, NULL);
+  }
+  sd_bus_message_unref(reply);
+  return r;
+}
+
+static int method_types_without_data(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  int r;
+  uint16_t clipboard;
+  uint16_t item_id;
+  r = sd_bus_message_read(m, "qq", &clipboard, &item_id);
+  if (r<0) {
+    sd_bus_reply_method_errorf(m, "Bad Format", "Unable to parse TypesWithoutData call");
+    return r;
+  }
+
+  char **typelist = store_types_without_data(clipboard, item_id);
+  if (!typelist) {
+    sd_bus_reply_method_errorf(m, "Bad Format", "Unable to get type list for clipboard %u, item %u",
+			       clipboard, item_id);
+    return -1;
+  }
+
+  sd_bus_message *reply;
+  r = sd_bus_message_new_method_return(m, &reply);
+  if (r < 0) {
+    fprintf(stderr, "Unable to make return message\n");
+    clip_free_typelist(typelist);
+    return -1;
+  }
+  sd_bus_message_append_strv(reply, typelist);
+  r = sd_bus_send(sd_bus_message_get_bus(m), reply, NULL);
+  sd_bus_message_unref(reply);
+  clip_free_typelist(typelist);
+
+  return r;
+}
+
+// Clients can name types by atom instead of sending the string every time.
+// Atoms only mean something until clipd restarts, so each one travels with
+// this epoch, and atoms from another epoch are refused.
+static uint64_t atom_epoch = 0;
+
+// Returns 1 if epoch is ours; otherwise replies with an error and returns 0
+static int check_epoch(sd_bus_message *m, uint64_t epoch) {
+  if (epoch == atom_epoch) {
+    return 1;
+  }
+  sd_bus_reply_method_errorf(m, CLIP_ERROR_STALE_ATOMS, "Atoms are from another run of clipd");
+  return 0;
+}
+
+// Reply with the epoch and count atoms
+static int reply_atoms(sd_bus_message *m, const uint32_t *atoms, size_t count) {
+  sd_bus_message *reply;
+  int r = sd_bus_message_new_method_return(m, &reply);
   if (r < 0) {
-    fprintf(stderr, "Failed to parse clipboard ID and label in CreateItem: %s\n", strerror(-r));
+    fprintf(stderr, "Unable to make return message\n");
     return r;
   }
-  
-  char **typelist;
-  r = sd_bus_message_read_strv(m, &typelist);
+  r = sd_bus_message_append(reply, "t", atom_epoch);
+  if (r >= 0) {
+    r = sd_bus_message_append_array(reply, 'u', atoms, count * sizeof(uint32_t));
+  }
+  if (r >= 0) {
+    r = sd_bus_send(sd_bus_message_get_bus(m), reply, NULL);
+  }
+  sd_bus_message_unref(reply);
+  return r;
+}
+
+// The atom for each type, interning any that are new. 0 means clipd has
+// too many types to intern another.
+static int method_intern_types(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  char **types = NULL;
+  int r = sd_bus_message_read_strv(m, &types);
   if (r < 0) {
-    fprintf(stderr, "Failed to parse typelist in CreateItem: %s\n", strerror(-r));
+    fprintf(stderr, "Failed to parse types in InternTypes: %s\n", strerror(-r));
     return r;
   }
 
-  const char *sender = sd_bus_message_get_sender(m);
-  
-  char **current_type = typelist;
-  uint16_t pushed_out_id;
-  char *owner;
-  uint16_t last_item_id = store_create_item(clipboard, label, sender, typelist, &pushed_out_id, &owner);
-  if (owner) {
-    // FIXME: tell the former owner that they are released from duty
-    free(owner);
+  size_t count = clip_typelist_count(types);
+  vector<uint32_t> atoms(count);
+  for (size_t i = 0; i < count; i++) {
+    atoms[i] = store_atom_for_type(types[i]);
+  }
+  clip_free_typelist(types);
+  return reply_atoms(m, atoms.data(), count);
+}
+
+// The type for each atom, or "" for an atom clipd never handed out
+static int method_types_for_atoms(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  uint64_t epoch;
+  const void *atoms;
+  size_t atomslen;
+  int r = sd_bus_message_read(m, "t", &epoch);
+  if (r >= 0) {
+    r = sd_bus_message_read_array(m, 'u', &atoms, &atomslen);
   }
-  r = sd_bus_reply_method_return(m, "qq", last_item_id, pushed_out_id);
   if (r < 0) {
-    fprintf(stderr, "Unable to return in CreateItem\n");
+    fprintf(stderr, "Failed to parse epoch and atoms in TypesForAtoms: %s\n", strerror(-r));
+    return r;
   }
-  
-  sd_bus* bus = sd_bus_message_get_bus(m);
-  sd_bus_message *signal = NULL;
-  r = sd_bus_message_new_signal(bus, &signal, CLIP_PATH, CLIP_INTERFACE, "ClipboardChanged");
+  if (!check_epoch(m, epoch)) {
+    return 1;
+  }
+
+  sd_bus_message *reply;
+  r = sd_bus_message_new_method_return(m, &reply);
   if (r < 0) {
-    fprintf(stderr, "Creation of signal message failed\n");
+    fprintf(stderr, "Unable to make return message\n");
     return r;
   }
-  uint16_t item_count = store_item_count(clipboard);
-  r = sd_bus_message_append(signal,"qqsq", clipboard, last_item_id, label, item_count);
-  return sd_bus_send(bus, signal, NULL);
+  r = sd_bus_message_open_container(reply, 'a', "s");
+  for (size_t i = 0; r >= 0 && i < atomslen / sizeof(uint32_t); i++) {
+    const char *type = store_type_for_atom(((const uint32_t *)atoms)[i]);
+    r = sd_bus_message_append_basic(reply, 's', type ? type : "");
+  }
+  if (r >= 0) {
+    r = sd_bus_message_close_container(reply);
+  }
+  if (r >= 0) {
+    r = sd_bus_send(sd_bus_message_get_bus(m), reply, NULL);
+  }
+  sd_bus_message_unref(reply);
+  return r;
 }
 
-static int method_push_data(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-  int r;
+// Like FetchTypelist, as atoms
+static int method_typelist_atoms(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
   uint16_t clipboard;
   uint16_t item_id;
-  char *type;
-  r = sd_bus_message_read(m, "qqs", &clipboard, &item_id, &type);
-  if (r < 0) {
-    fprintf(stderr, "Failed to parse clipboard ID, item_id, and type in PushData: %s\n", strerror(-r));
-    return r;
-  }
-  
-  unsigned char *data;
-  size_t datalen;
-  r = sd_bus_message_read_array(m, 'y', (const void **)&data, &datalen);
+  int r = sd_bus_message_read(m, "qq", &clipboard, &item_id);
   if (r < 0) {
-    fprintf(stderr, "Failed to parse data in PushData: %s\n", strerror(-r));
+    fprintf(stderr, "Failed to parse clipboard ID, item_id in FetchTypelistAtoms: %s\n", strerror(-r));
     return r;
   }
 
-  // This will copy the type and data (which will be invalid after message
-  // is freed
-  r = store_store_data(clipboard, item_id, type, datalen, data);
-  if (r < 0) {
-    fprintf(stderr, "Saving data failed in PushData\n");
-  } 
-  
-  return sd_bus_reply_method_return(m, "");
+  const uint32_t *atoms;
+  int count = store_item_atoms(clipboard, item_id, &atoms);
+  if (count < 0) {
+    return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_INVALID_ARGS,
+				      "No item %u on clipboard %u", item_id, clipboard);
+  }
+  return reply_atoms(m, atoms, count);
 }
 
-static int method_fetch_data(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-  int r;
+// Like FetchData, with the type as an atom
+static int method_fetch_data_by_atom(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
   uint16_t clipboard;
   uint16_t item_id;
-  char *type;
-  r = sd_bus_message_read(m, "qqs", &clipboard, &item_id, &type);
+  uint64_t epoch;
+  uint32_t atom;
+  int r = sd_bus_message_read(m, "qqtu", &clipboard, &item_id, &epoch, &atom);
   if (r < 0) {
-    fprintf(stderr, "Failed to parse clipboard ID, item_id, type in FetchData: %s\n", strerror(-r));
+    fprintf(stderr, "Failed to parse clipboard ID, item_id, epoch, atom in FetchDataByAtom: %s\n",
+	    strerror(-r));
     return r;
   }
+  if (!check_epoch(m, epoch)) {
+    return 1;
+  }
 
-  size_t datalen;
-  unsigned char *data;
-  r = store_fetch_data(clipboard, item_id, type, &datalen, &data);
-  if (r<0) {
-    fprintf(stderr, "Failed to fetch data from store: clipboard %u, item %u, type %s\n", clipboard, item_id, type);
-    datalen = 0;
-    data = NULL;
+  const char *type = store_type_for_atom(atom);
+  if (type) {
+    store_convert_data(clipboard, item_id, type);
+  }
+  const Payload *payload = store_retain_payload_for_atom(clipboard, item_id, atom);
+  if (payload == NULL && type
+      && park_for_provider(m, userdata, method_fetch_data_by_atom, clipboard, item_id, type)) {
+    return 1;
+  }
+  if (payload == NULL) {
+    return sd_bus_reply_method_errorf(m, CLIP_ERROR_NO_DATA,
+				      "No data for clipboard %u, item %u, atom %u",
+				      clipboard, item_id, atom);
   }
 
   sd_bus_message *reply;
   r = sd_bus_message_new_method_return(m, &reply);
   if (r < 0) {
     fprintf(stderr, "Unable to make return message\n");
-    free(data);
+    store_payload_discard(payload);
     return -1;
   }
-  sd_bus_message_append_array(reply,'y', data, datalen);
-  sd_bus* bus = sd_bus_message_get_bus(m);
-  r = sd_bus_send(bus, reply, NULL);
-  
-  if (data) {
-    free(data);
-  }
-  return r;
+  return send_payload(m, reply, payload, 0, store_payload_length(payload));
 }
 
-static int method_item_count(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+// FetchItems never puts more than this much data inline in one reply;
+// the rest has to be fetched type by type
+#define FETCH_ITEMS_INLINE_MAX (32 * MEGABYTE)
+
+// Building a FetchItems reply
+class ItemsReply {
+public:
+  sd_bus_message *reply;
   int r;
-  uint16_t clipboard;
-  r = sd_bus_message_read(m, "q", &clipboard);
-  if (r<0) {
-    sd_bus_reply_method_errorf(m, "Bad Format", "Unable to parse ItemCount call");
-    return r;
-  }
+};
 
-  uint16_t last_item_id = store_last_item_id(clipboard);
-  uint16_t item_count = store_item_count(clipboard);
+static void append_item(void *context, uint16_t item_id, const char *label, const char *sender,
+			char **typelist, const Payload **payloads) {
+  ItemsReply *items = (ItemsReply *)context;
+  sd_bus_message *reply = items->reply;
+  int &r = items->r;
+  if (r < 0) {
+    return;
+  }
 
-  return sd_bus_reply_method_return(m, "qq", last_item_id, item_count);
+  r = sd_bus_message_open_container(reply, 'r', "qssasa{say}");
+  if (r >= 0) {
+    r = sd_bus_message_append(reply, "qss", item_id, label, sender);
+  }
+  if (r >= 0) {
+    r = sd_bus_message_append_strv(reply, typelist);
+  }
+  if (r >= 0) {
+    r = sd_bus_message_open_container(reply, 'a', "{say}");
+  }
+  for (int i = 0; r >= 0 && typelist[i] != NULL; i++) {
+    if (payloads[i] == NULL) {
+      continue;
+    }
+    r = sd_bus_message_open_container(reply, 'e', "say");
+    if (r >= 0) {
+      r = sd_bus_message_append(reply, "s", typelist[i]);
+    }
+    if (r >= 0) {
+      r = sd_bus_message_append_array(reply, 'y', store_payload_bytes(payloads[i]),
+				      store_payload_length(payloads[i]));
+    }
+    if (r >= 0) {
+      r = sd_bus_message_close_container(reply);
+    }
+  }
+  if (r >= 0) {
+    r = sd_bus_message_close_container(reply);
+  }
+  if (r >= 0) {
+    r = sd_bus_message_close_container(reply);
+  }
 }
 
-static int method_typelist(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+// Everything a history view needs in one call: for each item from first
+// to last, its label, sender and types, and the data for the types that
+// have data no bigger than max_inline
+static int method_fetch_items(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
   int r;
   uint16_t clipboard;
-  uint16_t item_id;
-  r = sd_bus_message_read(m, "qq", &clipboard, &item_id);
-  if (r<0) {
-    sd_bus_reply_method_errorf(m, "Bad Format", "Unable to parse TypeList call");
+  uint16_t first_item_id;
+  uint16_t last_item_id;
+  uint32_t max_inline;
+  r = sd_bus_message_read(m, "qqqu", &clipboard, &first_item_id, &last_item_id, &max_inline);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse clipboard ID, item range and size in FetchItems: %s\n", strerror(-r));
     return r;
   }
+  if (store_board_name(clipboard) == NULL) {
+    return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_INVALID_ARGS, "No clipboard %u", clipboard);
+  }
 
-  char **typelist;
-  typelist = store_typelist(clipboard, item_id);
-  if (!typelist) {
-    sd_bus_reply_method_errorf(m, "Bad Format", "Unable to get type list for clipboard %u, item %u",
-			       clipboard, item_id);
+  ItemsReply items;
+  items.r = sd_bus_message_new_method_return(m, &items.reply);
+  if (items.r < 0) {
+    fprintf(stderr, "Unable to make return message\n");
     return -1;
   }
+  items.r = sd_bus_message_open_container(items.reply, 'a', "(qssasa{say})");
+  // The store only opens the data that will go in
+  store_visit_items(clipboard, first_item_id, last_item_id,
+		    min<size_t>(max_inline, FETCH_ITEMS_INLINE_MAX), FETCH_ITEMS_INLINE_MAX,
+		    append_item, &items);
+  if (items.r >= 0) {
+    items.r = sd_bus_message_close_container(items.reply);
+  }
+  if (items.r < 0) {
+    fprintf(stderr, "Unable to build FetchItems reply: %s\n", strerror(-items.r));
+    sd_bus_message_unref(items.reply);
+    return items.r;
+  }
+  r = sd_bus_send(sd_bus_message_get_bus(m), items.reply, NULL);
+  sd_bus_message_unref(items.reply);
+  return r;
+}
 
+// Building a SearchItems reply
+class MatchesReply {
+public:
   sd_bus_message *reply;
-  r = sd_bus_message_new_method_return(m, &reply);
+  int r;
+};
+
+static void append_match(void *context, uint16_t item_id, const char *type, const char *snippet) {
+  MatchesReply *matches = (MatchesReply *)context;
+  if (matches->r >= 0) {
+    matches->r = sd_bus_message_append(matches->reply, "(qss)", item_id, type, snippet);
+  }
+}
+
+// The items whose text holds the query, newest first, each with the type
+// that matched and a line of text around the match, so a history view can
+// search without fetching any data
+static int method_search_items(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  int r;
+  uint16_t clipboard;
+  const char *query;
+  uint32_t limit;
+  r = sd_bus_message_read(m, "qsu", &clipboard, &query, &limit);
   if (r < 0) {
+    fprintf(stderr, "Failed to parse clipboard ID, query and limit in SearchItems: %s\n", strerror(-r));
+    return r;
+  }
+  if (store_board_name(clipboard) == NULL) {
+    return sd_bus_reply_method_errorf(m, SD_BUS_ERROR_INVALID_ARGS, "No clipboard %u", clipboard);
+  }
+
+  MatchesReply matches;
+  matches.r = sd_bus_message_new_method_return(m, &matches.reply);
+  if (matches.r < 0) {
     fprintf(stderr, "Unable to make return message\n");
-    clip_free_typelist(typelist);
     return -1;
   }
-  sd_bus_message_append_strv(reply, typelist);
-  sd_bus* bus = sd_bus_message_get_bus(m);
-  r = sd_bus_send(bus, reply, NULL);
-  clip_free_typelist(typelist);
-  
+  matches.r = sd_bus_message_open_container(matches.reply, 'a', "(qss)");
+  store_search(clipboard, query, limit, append_match, &matches);
+  if (matches.r >= 0) {
+    matches.r = sd_bus_message_close_container(matches.reply);
+  }
+  if (matches.r < 0) {
+    fprintf(stderr, "Unable to build SearchItems reply: %s\n", strerror(-matches.r));
+    sd_bus_message_unref(matches.reply);
+    return matches.r;
+  }
+  r = sd_bus_send(sd_bus_message_get_bus(m), matches.reply, NULL);
+  sd_bus_message_unref(matches.reply);
   return r;
 }
 
-static int method_types_without_data(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
-  fprintf(stderr, "*** Unimplemented!Types Without Data called\n");
-  return 1;
+// Building a GetStats reply
+class StatsReply {
+public:
+  sd_bus_message *reply;
+  int r;
+};
+
+static void append_board_stats(void *context, uint16_t clipboard, const char *name,
+			       uint16_t item_count, size_t bytes) {
+  StatsReply *stats = (StatsReply *)context;
+  if (stats->r >= 0) {
+    stats->r = sd_bus_message_append(stats->reply, "(qsqt)", clipboard, name, item_count,
+				     (uint64_t)bytes);
+  }
+}
+
+// What the kernel says we have in memory, 0 if it won't say
+static uint64_t resident_bytes() {
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm == NULL) {
+    return 0;
+  }
+  unsigned long size, resident = 0;
+  if (fscanf(statm, "%lu %lu", &size, &resident) != 2) {
+    resident = 0;
+  }
+  fclose(statm);
+  return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+// Everything an operator might watch, in one call:
+//   a(stat)  each method called so far: its name, calls, and latency
+//            histogram (calls answered in under 2^i microseconds)
+//   a(qsqt)  each board: id, name, items and bytes
+//   a{st}    memory use and other totals
+//   at       live payloads by size (under 2^i bytes)
+static int method_get_stats(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  StatsReply stats;
+  stats.r = sd_bus_message_new_method_return(m, &stats.reply);
+  if (stats.r < 0) {
+    fprintf(stderr, "Unable to make return message\n");
+    return stats.r;
+  }
+  sd_bus_message *reply = stats.reply;
+  int r = sd_bus_message_open_container(reply, 'a', "(stat)");
+  for (size_t i = 0; r >= 0 && i < method_stats.size(); i++) {
+    MethodStats *method = method_stats[i];
+    r = sd_bus_message_open_container(reply, 'r', "stat");
+    if (r >= 0) {
+      r = sd_bus_message_append(reply, "st", method->name, method->calls);
+    }
+    if (r >= 0) {
+      r = sd_bus_message_append_array(reply, 't', method->latencies, sizeof(method->latencies));
+    }
+    if (r >= 0) {
+      r = sd_bus_message_close_container(reply);
+    }
+  }
+  if (r >= 0) {
+    r = sd_bus_message_close_container(reply);
+  }
+
+  if (r >= 0) {
+    r = sd_bus_message_open_container(reply, 'a', "(qsqt)");
+  }
+  if (r >= 0) {
+    stats.r = r;
+    store_visit_boards(append_board_stats, &stats);
+    r = stats.r;
+  }
+  if (r >= 0) {
+    r = sd_bus_message_close_container(reply);
+  }
+
+  struct store_memory_stats memory;
+  store_get_memory_stats(&memory);
+  if (r >= 0) {
+    r = sd_bus_message_append(reply, "a{st}", 10,
+			      "resident_bytes", resident_bytes(),
+			      "logical_bytes", memory.logical_bytes,
+			      "stored_bytes", memory.stored_bytes,
+			      "payload_count", memory.payload_count,
+			      "dedup_hits", memory.dedup_hits,
+			      "idle_page_bytes", memory.idle_page_bytes,
+			      "evictions", memory.evictions,
+			      "search_entries", memory.search_entries,
+			      "board_count", (uint64_t)store_board_count(),
+			      "type_count", (uint64_t)store_atom_count());
+  }
+  if (r >= 0) {
+    r = sd_bus_message_append_array(reply, 't', memory.payload_sizes, sizeof(memory.payload_sizes));
+  }
+  if (r >= 0) {
+    r = sd_bus_send(sd_bus_message_get_bus(m), reply, NULL);
+  }
+  sd_bus_message_unref(reply);
+  return r;
 }
 
 static const sd_bus_vtable clipboard_vtable[] =
   {SD_BUS_VTABLE_START(0),
    SD_BUS_METHOD("CreateItem", "qsas", "qq",
-		 method_create_item, SD_BUS_VTABLE_UNPRIVILEGED),
+		 timed<method_create_item>, SD_BUS_VTABLE_UNPRIVILEGED),
+   SD_BUS_METHOD("CreateItemWithData", "qsa{say}", "qq",
+		 timed<method_create_item_with_data>, SD_BUS_VTABLE_UNPRIVILEGED),
    SD_BUS_METHOD("PushData", "qqsay", "",
-		 method_push_data, SD_BUS_VTABLE_UNPRIVILEGED),
+		 timed<method_push_data>, SD_BUS_VTABLE_UNPRIVILEGED),
    SD_BUS_METHOD("FetchData", "qqs", "ay",
-		 method_fetch_data, SD_BUS_VTABLE_UNPRIVILEGED),   
+		 timed<method_fetch_data>, SD_BUS_VTABLE_UNPRIVILEGED),   
+   SD_BUS_METHOD("FetchDataCompressed", "qqs", "stay",
+		 timed<method_fetch_data_compressed>, SD_BUS_VTABLE_UNPRIVILEGED),
+   SD_BUS_METHOD("PushDataFd", "qqsh", "",
+		 timed<method_push_data_fd>, SD_BUS_VTABLE_UNPRIVILEGED),
+   SD_BUS_METHOD("FetchDataFd", "qqs", "h",
+		 timed<method_fetch_data_fd>, SD_BUS_VTABLE_UNPRIVILEGED),
+   SD_BUS_METHOD("BeginPush", "qqs", "u",
+		 timed<method_begin_push>, SD_BUS_VTABLE_UNPRIVILEGED),
+   SD_BUS_METHOD("AppendChunk", "uay", "",
+		 timed<method_append_chunk>, SD_BUS_VTABLE_UNPRIVILEGED),
+   SD_BUS_METHOD("CommitPush", "u", "",
+		 timed<method_commit_push>, SD_BUS_VTABLE_UNPRIVILEGED),
+   SD_BUS_METHOD("AbortPush", "u", "",
+		 timed<method_abort_push>, SD_BUS_VTABLE_UNPRIVILEGED),
+   SD_BUS_METHOD("FetchRange", "qqstu", "tay",
+		 timed<method_fetch_range>, SD_BUS_VTABLE_UNPRIVILEGED),
+   SD_BUS_METHOD("GetDataSize", "qqs", "t",
+		 timed<method_get_data_size>, SD_BUS_VTABLE_UNPRIVILEGED),
+   SD_BUS_METHOD("OpenBoard", "sqt", "q",
+		 timed<method_open_board>, SD_BUS_VTABLE_UNPRIVILEGED),
    SD_BUS_METHOD("ItemCount", "q", "qq",
-		 method_item_count, SD_BUS_VTABLE_UNPRIVILEGED),
+		 timed<method_item_count>, SD_BUS_VTABLE_UNPRIVILEGED),
    SD_BUS_METHOD("FetchTypelist", "qq", "as",
-		 method_typelist, SD_BUS_VTABLE_UNPRIVILEGED),
+		 timed<method_typelist>, SD_BUS_VTABLE_UNPRIVILEGED),
    SD_BUS_METHOD("TypesWithoutData", "qq", "as",
-		 method_types_without_data, SD_BUS_VTABLE_UNPRIVILEGED),
+		 timed<method_types_without_data>, SD_BUS_VTABLE_UNPRIVILEGED),
+   SD_BUS_METHOD("FetchItems", "qqqu", "a(qssasa{say})",
+		 timed<method_fetch_items>, SD_BUS_VTABLE_UNPRIVILEGED),
+   SD_BUS_METHOD("SearchItems", "qsu", "a(qss)",
+		 timed<method_search_items>, SD_BUS_VTABLE_UNPRIVILEGED),
+   SD_BUS_METHOD("InternTypes", "as", "tau",
+		 timed<method_intern_types>, SD_BUS_VTABLE_UNPRIVILEGED),
+   SD_BUS_METHOD("TypesForAtoms", "tau", "as",
+		 timed<method_types_for_atoms>, SD_BUS_VTABLE_UNPRIVILEGED),
+   SD_BUS_METHOD("FetchTypelistAtoms", "qq", "tau",
+		 timed<method_typelist_atoms>, SD_BUS_VTABLE_UNPRIVILEGED),
+   SD_BUS_METHOD("FetchDataByAtom", "qqtu", "ay",
+		 timed<method_fetch_data_by_atom>, SD_BUS_VTABLE_UNPRIVILEGED),
+   SD_BUS_METHOD("GetStats", "", "a(stat)a(qsqt)a{st}at",
+		 timed<method_get_stats>, SD_BUS_VTABLE_UNPRIVILEGED),
    SD_BUS_VTABLE_END
 };
 
+// Where the journal lives: $XDG_STATE_HOME/clipd/history, creating
+// directories as needed. Empty if there is no good place.
+static string journal_path() {
+  string dir;
+  const char *state_home = getenv("XDG_STATE_HOME");
+  const char *home = getenv("HOME");
+  if (state_home && *state_home) {
+    dir = state_home;
+  } else if (home && *home) {
+    dir = string(home) + "/.local/state";
+  } else {
+    return "";
+  }
+  dir += "/clipd";
+
+  // mkdir -p
+  for (size_t slash = dir.find('/', 1); ; slash = dir.find('/', slash + 1)) {
+    string partial = dir.substr(0, slash);
+    if (mkdir(partial.c_str(), 0700) < 0 && errno != EEXIST) {
+      fprintf(stderr, "Unable to create %s: %s\n", partial.c_str(), strerror(errno));
+      return "";
+    }
+    if (slash == string::npos) {
+      break;
+    }
+  }
+  return dir + "/history";
+}
+
+#pragma mark Peer connections
+
+// Every byte sent on the session bus is read and written again by the
+// broker. Clients on this machine can instead connect straight to clipd
+// at $XDG_RUNTIME_DIR/clipd/bus and make the same calls there. Only the
+// calls go that way: signals, and calls to data providers, stay on the
+// session bus.
+
+static int peer_listener = -1;
+static vector<sd_bus *> peers;
+
+// Listen at dir/bus. The socket is bound under a name of its own and
+// renamed into place, so a clipd that fails to get the bus name never
+// takes the socket from the one that has it.
+static int listen_for_peers(const string &dir) {
+  if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) {
+    fprintf(stderr, "Unable to create %s: %s\n", dir.c_str(), strerror(errno));
+    return -1;
+  }
+  string path = dir + "/" + CLIP_PEER_SOCKET;
+  string bound = path + "." + to_string(getpid());
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (bound.size() >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", bound.c_str());
+    return -1;
+  }
+  strcpy(address.sun_path, bound.c_str());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Unable to create socket: %s\n", strerror(errno));
+    return -1;
+  }
+  unlink(bound.c_str());
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0
+      || listen(fd, SOMAXCONN) < 0
+      || rename(bound.c_str(), path.c_str()) < 0) {
+    fprintf(stderr, "Unable to listen at %s: %s\n", path.c_str(), strerror(errno));
+    unlink(bound.c_str());
+    close(fd);
+    return -1;
+  }
+  peer_listener = fd;
+  return 0;
+}
+
+// Serve the vtable on every connection waiting to be accepted
+static void accept_peers() {
+  for (;;) {
+    int fd = accept4(peer_listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EINTR) {
+	fprintf(stderr, "Unable to accept peer: %s\n", strerror(errno));
+      }
+      return;
+    }
+
+    sd_bus *peer = NULL;
+    sd_id128_t id;
+    int r = sd_bus_new(&peer);
+    if (r < 0) {
+      close(fd);
+    } else if ((r = sd_id128_randomize(&id)) >= 0
+	       && (r = sd_bus_set_fd(peer, fd, fd)) >= 0
+	       && (r = sd_bus_set_server(peer, 1, id)) >= 0
+	       && (r = sd_bus_negotiate_fds(peer, 1)) >= 0
+	       && (r = sd_bus_add_object_vtable(peer, NULL, CLIP_PATH, CLIP_INTERFACE,
+						clipboard_vtable, NULL)) >= 0
+	       && (r = sd_bus_start(peer)) >= 0) {
+      peers.push_back(peer);
+      peer_senders[peer] = PEER_SENDER_PREFIX + to_string(++last_peer);
+      continue;
+    } else {
+      // Closes fd too
+      sd_bus_unref(peer);
+    }
+    fprintf(stderr, "Unable to serve peer: %s\n", strerror(-r));
+  }
+}
+
+// Handle a message from each peer, dropping those that have gone away
+// Returns 1 if any message was handled
+static int process_peers() {
+  int handled = 0;
+  for (size_t i = 0; i < peers.size(); ) {
+    int r = sd_bus_process(peers[i], NULL);
+    if (r < 0 || sd_bus_is_open(peers[i]) <= 0) {
+      store_abort_uploads_of(peer_senders[peers[i]].c_str());
+      peer_senders.erase(peers[i]);
+      sd_bus_flush_close_unref(peers[i]);
+      peers[i] = peers.back();
+      peers.pop_back();
+      continue;
+    }
+    if (r > 0) {
+      handled = 1;
+    }
+    i++;
+  }
+  return handled;
+}
+
+// A client left the session bus: nobody will finish its uploads
+static int client_gone(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+  const char *name, *old_owner, *new_owner;
+  int r = sd_bus_message_read(m, "sss", &name, &old_owner, &new_owner);
+  if (r < 0) {
+    fprintf(stderr, "Failed to parse NameOwnerChanged: %s\n", strerror(-r));
+    return 0;
+  }
+  if (name[0] == ':' && *new_owner == '\0') {
+    store_abort_uploads_of(name);
+  }
+  return 0;
+}
+
+// Wait for a message on the bus or a peer, a new peer, a finished job,
+// or until timeout_usec has passed
+static int wait_for_work(sd_bus *bus, uint64_t timeout_usec) {
+  vector<sd_bus *> buses(1, bus);
+  buses.insert(buses.end(), peers.begin(), peers.end());
+
+  vector<struct pollfd> fds(buses.size() + 2);
+  for (size_t i = 0; i < buses.size(); i++) {
+    fds[i].fd = sd_bus_get_fd(buses[i]);
+    fds[i].events = sd_bus_get_events(buses[i]);
+    if (fds[i].events < 0) {
+      return fds[i].events;
+    }
+
+    // sd-bus has deadlines of its own, like replies from providers
+    uint64_t deadline;
+    if (sd_bus_get_timeout(buses[i], &deadline) >= 0 && deadline != UINT64_MAX) {
+      uint64_t now = now_usec();
+      timeout_usec = min(timeout_usec, deadline > now ? deadline - now : 0);
+    }
+  }
+  struct pollfd &workers = fds[buses.size()];
+  workers.fd = workers_fd();
+  workers.events = POLLIN;
+  // A negative fd is skipped
+  struct pollfd &listener = fds[buses.size() + 1];
+  listener.fd = peer_listener;
+  listener.events = POLLIN;
+
+  int timeout_ms = -1;
+  if (timeout_usec != UINT64_MAX) {
+    timeout_ms = (int)min<uint64_t>((timeout_usec + MILLISECOND - 1) / MILLISECOND, INT32_MAX);
+  }
+
+  if (poll(&fds[0], fds.size(), timeout_ms) < 0 && errno != EINTR) {
+    return -errno;
+  }
+  if (listener.revents & POLLIN) {
+    accept_peers();
+  }
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
+  int r;
+
+  // --no-history keeps the clipboards in memory only
+  // --coalesce-ms=N sets every board's signal window
+  bool keep_history = true;
+  long coalesce_ms = -1;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--no-history") == 0) {
+      keep_history = false;
+    } else if (strncmp(argv[i], "--coalesce-ms=", 14) == 0 && atol(argv[i] + 14) >= 0) {
+      coalesce_ms = atol(argv[i] + 14);
+    } else {
+      fprintf(stderr, "Usage: %s [--no-history] [--coalesce-ms=N]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
   // Initialize store
   store_set_ring_size(CLIPBOARD_GENERAL, 5);
   store_set_ring_size(CLIPBOARD_FIND, 10);
   store_set_ring_size(CLIPBOARD_STYLE, 1);
   store_set_ring_size(CLIPBOARD_DRAG, 3);
+  store_set_ring_budget(CLIPBOARD_GENERAL, 512 * MEGABYTE);
+  store_set_ring_budget(CLIPBOARD_FIND, 1 * MEGABYTE);
+  store_set_ring_budget(CLIPBOARD_STYLE, 16 * MEGABYTE);
+  store_set_ring_budget(CLIPBOARD_DRAG, 512 * MEGABYTE);
+
+  // The find clipboard changes with every keystroke in some search fields
+  set_signal_window(CLIPBOARD_GENERAL, 50 * MILLISECOND);
+  set_signal_window(CLIPBOARD_FIND, 250 * MILLISECOND);
+  set_signal_window(CLIPBOARD_STYLE, 50 * MILLISECOND);
+  set_signal_window(CLIPBOARD_DRAG, 100 * MILLISECOND);
+  named_signal_window = 50 * MILLISECOND;
+  if (coalesce_ms >= 0) {
+    for (int i = 0; i < CLIPBOARD_COUNT; i++) {
+      set_signal_window(i, coalesce_ms * MILLISECOND);
+    }
+    named_signal_window = coalesce_ms * MILLISECOND;
+  }
+
+  const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (runtime_dir && *runtime_dir) {
+    string spill_dir = string(runtime_dir) + "/clipd";
+    store_set_spill(spill_dir.c_str(), SPILL_THRESHOLD);
+  }
+  store_set_compression(COMPRESS_THRESHOLD);
+
+  // Bring back the rings from before a restart. Only the record headers
+  // are read; the data stays on disk until someone asks for it.
+  if (keep_history) {
+    string path = journal_path();
+    if (!path.empty()) {
+      r = store_open_journal(path.c_str());
+      if (r < 0) {
+	fprintf(stderr, "Unable to use journal %s; history will not survive a restart\n", path.c_str());
+      }
+    }
+  }
+
+  // Different on every run, so atoms from before a restart are caught
+  struct timespec started;
+  clock_gettime(CLOCK_REALTIME, &started);
+  atom_epoch = ((uint64_t)started.tv_sec * 1000000000 + started.tv_nsec) ^ ((uint64_t)getpid() << 48);
+
+  if (workers_start(WORKER_COUNT) < 0) {
+    fprintf(stderr, "Unable to start workers; big data will be copied on the bus thread\n");
+  }
 
   sd_bus_slot *slot = NULL;
   sd_bus *bus = NULL;
-  int r;
 
   // Connect to the user bus
-  r = sd_bus_open_user(&bus);
+  r = sd_bus_open_user(&session_bus);
+  bus = session_bus;
   if (r < 0) {
     fprintf(stderr, "Failed to connect to user bus: %s\n", strerror(-r));
     return EXIT_FAILURE;    
@@ -215,6 +2052,14 @@ int main(int argc, char *argv[]) {
     return EXIT_FAILURE;
   }
 
+  r = sd_bus_add_match(bus, NULL,
+		       "type='signal',sender='org.freedesktop.DBus',member='NameOwnerChanged',"
+		       "arg2=''", client_gone, NULL);
+  if (r < 0) {
+    fprintf(stderr, "Failed: sd_bus_add_match: %s\n", strerror(-r));
+    return EXIT_FAILURE;
+  }
+
   // Advertise!
   r = sd_bus_request_name(bus, CLIP_DESTIN, 0);
   if (r < 0) {
@@ -222,18 +2067,40 @@ int main(int argc, char *argv[]) {
     return EXIT_FAILURE;
   }
 
+  // Clients fall back to the session bus without it
+  if (runtime_dir && *runtime_dir) {
+    listen_for_peers(string(runtime_dir) + "/clipd");
+  }
+
+  // Only items pushed out from now on have a provider to tell
+  store_set_eviction_handler(item_evicted);
+
   for (;;) {
+    // Even a steady stream of requests mustn't hold back signals, or
+    // replies that workers have finished
+    flush_clipboard_changed(bus);
+    flush_releases(bus);
+    flush_pushed_out(bus);
+    workers_dispatch();
+
     /* Process requests */
     r = sd_bus_process(bus, NULL);
     if (r < 0) {
       fprintf(stderr, "Failed to process bus: %s\n", strerror(-r));
       return EXIT_FAILURE;
     }
-    if (r > 0) /* we processed a request, try to process another one, right-away */
+    if (process_peers() > 0 || r > 0) /* we processed a request, try to process another one, right-away */
       continue;
 
-    // Wait for another message
-    r = sd_bus_wait(bus, (uint64_t) -1);
+    // Nothing to do, so this is a good time to tidy up
+    store_compact_journal();
+    sweep_idle_boards(bus);
+    flush_releases(bus);
+    flush_pushed_out(bus);
+
+    // Wait for another message, a finished job, or until a held signal is
+    // due
+    r = wait_for_work(bus, flush_clipboard_changed(bus));
     if (r < 0) {
       fprintf(stderr, "Failed to wait on bus: %s\n", strerror(-r));
       return EXIT_FAILURE;
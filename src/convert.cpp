@@ -0,0 +1,584 @@
+#include <string>
+#include <algorithm>
+#include <vector>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "convert.h"
+
+using namespace std;
+
+#define PLAIN_TEXT "public.utf8-plain-text"
+
+#pragma mark Text
+
+static void append_utf8(string &out, uint32_t c)
+{
+  // Surrogates and numbers past Unicode aren't characters
+  if (c > 0x10FFFF || (c >= 0xD800 && c < 0xE000)) {
+    c = 0xFFFD;
+  }
+  if (c < 0x80) {
+    out += (char)c;
+  } else if (c < 0x800) {
+    out += (char)(0xC0 | c >> 6);
+    out += (char)(0x80 | (c & 0x3F));
+  } else if (c < 0x10000) {
+    out += (char)(0xE0 | c >> 12);
+    out += (char)(0x80 | (c >> 6 & 0x3F));
+    out += (char)(0x80 | (c & 0x3F));
+  } else {
+    out += (char)(0xF0 | c >> 18);
+    out += (char)(0x80 | (c >> 12 & 0x3F));
+    out += (char)(0x80 | (c >> 6 & 0x3F));
+    out += (char)(0x80 | (c & 0x3F));
+  }
+}
+
+// The length of the UTF-8 sequence at s, which has left bytes after it
+// Returns 0 if it is malformed, overlong, a surrogate or past U+10FFFF
+static size_t utf8_length(const unsigned char *s, size_t left)
+{
+  unsigned char c = s[0];
+  size_t length;
+  if (c < 0x80) {
+    return 1;
+  } else if (c >= 0xC2 && c < 0xE0) {
+    length = 2;
+  } else if (c >= 0xE0 && c < 0xF0) {
+    length = 3;
+  } else if (c >= 0xF0 && c < 0xF5) {
+    length = 4;
+  } else {
+    return 0;
+  }
+  if (length > left) {
+    return 0;
+  }
+  for (size_t i = 1; i < length; i++) {
+    if ((s[i] & 0xC0) != 0x80) {
+      return 0;
+    }
+  }
+  if ((c == 0xE0 && s[1] < 0xA0) || (c == 0xED && s[1] >= 0xA0)
+      || (c == 0xF0 && s[1] < 0x90) || (c == 0xF4 && s[1] >= 0x90)) {
+    return 0;
+  }
+  return length;
+}
+
+// Every conversion's result goes through here on its way out
+static string normalize_text(const string &text)
+{
+  const unsigned char *s = (const unsigned char *)text.data();
+  size_t length = text.size();
+  string out;
+  out.reserve(length);
+
+  size_t i = 0;
+  if (length >= 3 && memcmp(s, "\xEF\xBB\xBF", 3) == 0) {
+    i = 3;
+  }
+  while (i < length) {
+    if (s[i] == '\r') {
+      out += '\n';
+      i += (i + 1 < length && s[i + 1] == '\n') ? 2 : 1;
+      continue;
+    }
+    size_t n = utf8_length(s + i, length - i);
+    if (n == 0) {
+      append_utf8(out, 0xFFFD);
+      i++;
+      continue;
+    }
+    out.append((const char *)s + i, n);
+    i += n;
+  }
+  return out;
+}
+
+#pragma mark UTF-16
+
+// In the byte order of its byte order mark, if it has one
+static string from_utf16(size_t length, const unsigned char *data, bool big_endian)
+{
+  size_t i = 0;
+  if (length >= 2 && data[0] == 0xFE && data[1] == 0xFF) {
+    big_endian = true;
+    i = 2;
+  } else if (length >= 2 && data[0] == 0xFF && data[1] == 0xFE) {
+    big_endian = false;
+    i = 2;
+  }
+
+  string out;
+  out.reserve(length);
+  uint32_t high = 0;
+  for (; i + 1 < length; i += 2) {
+    uint32_t unit = big_endian ? data[i] << 8 | data[i + 1] : data[i + 1] << 8 | data[i];
+    if (high && unit >= 0xDC00 && unit < 0xE000) {
+      append_utf8(out, 0x10000 + ((high - 0xD800) << 10) + (unit - 0xDC00));
+      high = 0;
+      continue;
+    }
+    if (high) {
+      append_utf8(out, 0xFFFD);
+      high = 0;
+    }
+    if (unit >= 0xD800 && unit < 0xDC00) {
+      high = unit;
+    } else {
+      // A low surrogate on its own comes out as U+FFFD
+      append_utf8(out, unit);
+    }
+  }
+  // A dangling high surrogate, or an odd byte at the end
+  if (high || i < length) {
+    append_utf8(out, 0xFFFD);
+  }
+  return out;
+}
+
+// public.utf16-plain-text is in this machine's byte order
+static string from_utf16_native(size_t length, const unsigned char *data)
+{
+  return from_utf16(length, data, __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__);
+}
+
+// public.utf16-external-plain-text is big endian unless it says otherwise
+static string from_utf16_external(size_t length, const unsigned char *data)
+{
+  return from_utf16(length, data, true);
+}
+
+#pragma mark HTML
+
+// Elements whose contents aren't shown
+static const char *const html_hidden[] = {
+  "head", "script", "style", "template", "noscript", NULL
+};
+
+// Elements that begin on a line of their own
+static const char *const html_blocks[] = {
+  "address", "article", "aside", "blockquote", "dd", "div", "dl", "dt", "figcaption",
+  "figure", "footer", "form", "h1", "h2", "h3", "h4", "h5", "h6", "header", "hr", "li",
+  "main", "nav", "ol", "p", "pre", "section", "table", "tr", "ul", NULL
+};
+
+class HtmlEntity {
+public:
+  const char *name;
+  uint32_t c;
+};
+
+static const HtmlEntity html_entities[] = {
+  {"amp", '&'}, {"lt", '<'}, {"gt", '>'}, {"quot", '"'}, {"apos", '\''},
+  {"nbsp", 0xA0}, {"copy", 0xA9}, {"reg", 0xAE}, {"trade", 0x2122}, {"deg", 0xB0},
+  {"middot", 0xB7}, {"bull", 0x2022}, {"hellip", 0x2026}, {"ndash", 0x2013},
+  {"mdash", 0x2014}, {"lsquo", 0x2018}, {"rsquo", 0x2019}, {"ldquo", 0x201C},
+  {"rdquo", 0x201D}, {"laquo", 0xAB}, {"raquo", 0xBB}, {"times", 0xD7}, {"divide", 0xF7},
+  {"sect", 0xA7}, {"para", 0xB6}, {"cent", 0xA2}, {"pound", 0xA3}, {"yen", 0xA5},
+  {"euro", 0x20AC}, {NULL, 0}
+};
+
+static bool in_list(const char *const *list, const string &name)
+{
+  for (; *list; list++) {
+    if (name == *list) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The character reference at s (which starts with '&'), with left bytes
+// from there on
+// Returns its length, 0 if it isn't one we know
+static size_t html_entity(const unsigned char *s, size_t left, uint32_t *cptr)
+{
+  size_t semicolon = 1;
+  while (semicolon < left && semicolon < 12 && s[semicolon] != ';') {
+    semicolon++;
+  }
+  if (semicolon >= left || s[semicolon] != ';') {
+    return 0;
+  }
+  string name((const char *)s + 1, semicolon - 1);
+
+  if (name.size() > 1 && name[0] == '#') {
+    bool hex = name[1] == 'x' || name[1] == 'X';
+    const char *digits = name.c_str() + (hex ? 2 : 1);
+    char *end;
+    unsigned long c = strtoul(digits, &end, hex ? 16 : 10);
+    if (*digits == '\0' || *end != '\0') {
+      return 0;
+    }
+    *cptr = (c == 0 || c > 0x10FFFF) ? 0xFFFD : (uint32_t)c;
+    return semicolon + 1;
+  }
+  for (const HtmlEntity *entity = html_entities; entity->name; entity++) {
+    if (name == entity->name) {
+      *cptr = entity->c;
+      return semicolon + 1;
+    }
+  }
+  return 0;
+}
+
+// Where the end tag for name begins, at or after i; length if there is none
+static size_t html_end_tag(const unsigned char *s, size_t length, size_t i, const string &name)
+{
+  for (; i + 2 + name.size() <= length; i++) {
+    if (s[i] == '<' && s[i + 1] == '/'
+	&& strncasecmp((const char *)s + i + 2, name.c_str(), name.size()) == 0) {
+      return i;
+    }
+  }
+  return length;
+}
+
+// Start a new line, unless we are at the start of one
+static void html_break(string &out)
+{
+  while (!out.empty() && (out.back() == ' ' || out.back() == '\t')) {
+    out.pop_back();
+  }
+  if (!out.empty() && out.back() != '\n') {
+    out += '\n';
+  }
+}
+
+// Runs of white space become a single space, except in <pre>. Tags only
+// break lines and cells; everything else about them is dropped.
+static string from_html(size_t length, const unsigned char *s)
+{
+  string out;
+  out.reserve(length / 2);
+  int pre = 0;
+  // White space seen since the last text
+  bool space = false;
+
+  size_t i = 0;
+  while (i < length) {
+    unsigned char c = s[i];
+    if (c == '<' && i + 3 < length && memcmp(s + i, "<!--", 4) == 0) {
+      const unsigned char *end = (const unsigned char *)memmem(s + i + 4, length - i - 4, "-->", 3);
+      i = end ? end - s + 3 : length;
+      continue;
+    }
+
+    size_t j = i + 1;
+    bool closing = j < length && s[j] == '/';
+    if (closing) {
+      j++;
+    }
+    if (c == '<' && j < length && (isalpha(s[j]) || s[j] == '!' || s[j] == '?')) {
+      string name;
+      for (; j < length && isalnum(s[j]); j++) {
+	name += (char)tolower(s[j]);
+      }
+      // Skip the attributes, minding quotes
+      char quote = 0;
+      for (; j < length; j++) {
+	if (quote) {
+	  quote = s[j] == quote ? 0 : quote;
+	} else if (s[j] == '"' || s[j] == '\'') {
+	  quote = s[j];
+	} else if (s[j] == '>') {
+	  break;
+	}
+      }
+      i = j < length ? j + 1 : length;
+
+      if (!closing && in_list(html_hidden, name)) {
+	i = html_end_tag(s, length, i, name);
+      } else if (name == "br") {
+	out += '\n';
+      } else if (closing && (name == "td" || name == "th")) {
+	out += '\t';
+      } else if (in_list(html_blocks, name)) {
+	html_break(out);
+	if (name == "pre") {
+	  pre = closing ? max(pre - 1, 0) : pre + 1;
+	}
+      } else {
+	continue;
+      }
+      space = false;
+      continue;
+    }
+
+    if (!pre && (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f')) {
+      space = true;
+      i++;
+      continue;
+    }
+    if (space && !out.empty() && out.back() != '\n' && out.back() != '\t') {
+      out += ' ';
+    }
+    space = false;
+
+    uint32_t entity;
+    size_t entity_length = c == '&' ? html_entity(s + i, length - i, &entity) : 0;
+    if (entity_length) {
+      append_utf8(out, entity);
+      i += entity_length;
+    } else {
+      out += (char)c;
+      i++;
+    }
+  }
+
+  html_break(out);
+  while (!out.empty() && out.back() == '\n') {
+    out.pop_back();
+  }
+  return out;
+}
+
+#pragma mark RTF
+
+// \'hh escapes are nearly always in Windows-1252 (\ansicpg is ignored),
+// which only differs from Latin-1 from 0x80 to 0x9F
+static const uint16_t cp1252[32] = {
+  0x20AC, 0xFFFD, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+  0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0xFFFD, 0x017D, 0xFFFD,
+  0xFFFD, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+  0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0xFFFD, 0x017E, 0x0178
+};
+
+static uint32_t from_cp1252(unsigned char c)
+{
+  return c >= 0x80 && c < 0xA0 ? cp1252[c - 0x80] : c;
+}
+
+// Destinations whose text isn't part of the document
+static const char *const rtf_hidden[] = {
+  "fonttbl", "colortbl", "stylesheet", "info", "pict", "header", "headerl", "headerr",
+  "headerf", "footer", "footerl", "footerr", "footerf", "listtable", "listoverridetable",
+  "rsidtbl", "generator", "fldinst", "themedata", "colorschememapping", "latentstyles",
+  "datastore", "xmlnsdecl", "object", NULL
+};
+
+class RtfWord {
+public:
+  const char *word;
+  uint32_t c;
+};
+
+// Control words that stand for a character
+static const RtfWord rtf_characters[] = {
+  {"par", '\n'}, {"line", '\n'}, {"sect", '\n'}, {"page", '\n'}, {"row", '\n'},
+  {"tab", '\t'}, {"cell", '\t'}, {"emspace", ' '}, {"enspace", ' '},
+  {"emdash", 0x2014}, {"endash", 0x2013}, {"bullet", 0x2022}, {"lquote", 0x2018},
+  {"rquote", 0x2019}, {"ldblquote", 0x201C}, {"rdblquote", 0x201D}, {NULL, 0}
+};
+
+class RtfGroup {
+public:
+  bool hidden;
+  // Characters that follow \u as a fallback for older readers
+  long fallback;
+};
+
+static int hex_digit(unsigned char c)
+{
+  if (isdigit(c)) {
+    return c - '0';
+  }
+  if (isxdigit(c)) {
+    return tolower(c) - 'a' + 10;
+  }
+  return -1;
+}
+
+static string from_rtf(size_t length, const unsigned char *s)
+{
+  string out;
+  out.reserve(length / 2);
+  vector<RtfGroup> groups(1, RtfGroup{false, 1});
+  // Fallback characters still to skip after a \u
+  long skipping = 0;
+  // A \u high surrogate waiting for its low half
+  uint32_t high = 0;
+
+  size_t i = 0;
+  while (i < length) {
+    unsigned char c = s[i++];
+    uint32_t text;
+    if (c == '{') {
+      groups.push_back(groups.back());
+      skipping = 0;
+      continue;
+    } else if (c == '}') {
+      if (groups.size() > 1) {
+	groups.pop_back();
+      }
+      skipping = 0;
+      continue;
+    } else if (c == '\r' || c == '\n') {
+      // Line breaks in the source mean nothing
+      continue;
+    } else if (c != '\\') {
+      text = from_cp1252(c);
+    } else if (i >= length) {
+      break;
+    } else if (s[i] == '\'') {
+      int h = i + 1 < length ? hex_digit(s[i + 1]) : -1;
+      int l = i + 2 < length ? hex_digit(s[i + 2]) : -1;
+      i += 3;
+      if (h < 0 || l < 0) {
+	continue;
+      }
+      text = from_cp1252(h << 4 | l);
+    } else if (!isalpha(s[i])) {
+      // A control symbol
+      c = s[i++];
+      if (c == '*') {
+	// An optional destination: none of them hold the document's text
+	groups.back().hidden = true;
+	continue;
+      } else if (c == '\\' || c == '{' || c == '}') {
+	text = c;
+      } else if (c == '~') {
+	text = 0xA0;
+      } else if (c == '_') {
+	text = '-';
+      } else if (c == '\r' || c == '\n') {
+	text = '\n';
+      } else {
+	continue;
+      }
+    } else {
+      // A control word: letters, maybe a number, maybe a space
+      size_t start = i;
+      while (i < length && isalpha(s[i])) {
+	i++;
+      }
+      string word((const char *)s + start, i - start);
+      bool negative = i < length && s[i] == '-';
+      if (negative) {
+	i++;
+      }
+      long number = 0;
+      for (; i < length && isdigit(s[i]); i++) {
+	number = min(number * 10 + (s[i] - '0'), 0x7FFFFFFFL);
+      }
+      if (negative) {
+	number = -number;
+      }
+      if (i < length && s[i] == ' ') {
+	i++;
+      }
+
+      if (word == "bin") {
+	i += min((size_t)max(number, 0L), length - i);
+	continue;
+      } else if (word == "uc") {
+	groups.back().fallback = max(number, 0L);
+	continue;
+      } else if (word == "u") {
+	uint32_t u = number < 0 ? number + 0x10000 : number;
+	long fallback = groups.back().fallback;
+	if (!groups.back().hidden) {
+	  if (high && u >= 0xDC00 && u < 0xE000) {
+	    append_utf8(out, 0x10000 + ((high - 0xD800) << 10) + (u - 0xDC00));
+	    high = 0;
+	  } else if (u >= 0xD800 && u < 0xDC00) {
+	    high = u;
+	  } else {
+	    append_utf8(out, u);
+	  }
+	}
+	skipping = fallback;
+	continue;
+      } else if (in_list(rtf_hidden, word)) {
+	groups.back().hidden = true;
+	continue;
+      }
+      const RtfWord *character = rtf_characters;
+      while (character->word && word != character->word) {
+	character++;
+      }
+      if (character->word == NULL) {
+	continue;
+      }
+      text = character->c;
+    }
+
+    if (skipping > 0) {
+      skipping--;
+      continue;
+    }
+    if (!groups.back().hidden) {
+      if (high) {
+	append_utf8(out, 0xFFFD);
+	high = 0;
+      }
+      append_utf8(out, text);
+    }
+  }
+  return out;
+}
+
+#pragma mark Converters
+
+// Plain text to plain text only normalizes it
+static string as_is(size_t length, const unsigned char *data)
+{
+  return string((const char *)data, length);
+}
+
+class Converter {
+public:
+  const char *from;
+  const char *to;
+  string (*convert)(size_t, const unsigned char *);
+};
+
+static const Converter converters[] = {
+  {PLAIN_TEXT, PLAIN_TEXT, as_is},
+  {"public.utf16-plain-text", PLAIN_TEXT, from_utf16_native},
+  {"public.utf16-external-plain-text", PLAIN_TEXT, from_utf16_external},
+  {"public.html", PLAIN_TEXT, from_html},
+  {"public.rtf", PLAIN_TEXT, from_rtf},
+  {NULL, NULL, NULL}
+};
+
+// In the order of converters: UTF-16 loses nothing, and HTML is more
+// often what a browser or editor meant than RTF is
+static const char *const plain_text_sources[] = {
+  "public.utf16-plain-text", "public.utf16-external-plain-text", "public.html", "public.rtf", NULL
+};
+
+const char *const *convert_sources(const char *type)
+{
+  if (strcmp(type, PLAIN_TEXT) == 0) {
+    return plain_text_sources;
+  }
+  return NULL;
+}
+
+int convert_data(const char *from, const char *to, size_t datalen, const unsigned char *data,
+		 size_t *outlenptr, unsigned char **outptr)
+{
+  const Converter *converter = converters;
+  while (converter->from && (strcmp(converter->from, from) != 0 || strcmp(converter->to, to) != 0)) {
+    converter++;
+  }
+  if (converter->from == NULL) {
+    return -1;
+  }
+
+  string text = normalize_text(converter->convert(datalen, data));
+  unsigned char *out = (unsigned char *)malloc(text.size() ? text.size() : 1);
+  if (out == NULL) {
+    return -1;
+  }
+  memcpy(out, text.data(), text.size());
+  *outptr = out;
+  *outlenptr = text.size();
+  return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <stddef.h>
+
+// Data of one type made from data of another, for readers that ask for a
+// type the producer didn't push. Every conversion here is to plain text,
+// which always comes out as UTF-8 with \n line endings: CRLF and lone CR
+// become \n, a byte order mark is dropped, and bytes that aren't UTF-8
+// become U+FFFD. Converting plain text to itself does just that.
+// Safe to call from any thread.
+
+// The types that type can be made from, best first, ending with NULL
+// Returns NULL if type can't be made from anything
+const char *const *convert_sources(const char *type);
+
+// Make data of type to from datalen bytes of type from
+// Receiver should free *outptr
+// Returns -1 if there is no such conversion or it fails
+int convert_data(const char *from, const char *to, size_t datalen, const unsigned char *data,
+		 size_t *outlenptr, unsigned char **outptr);
+
+#endif
@@ -0,0 +1,468 @@
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstring>
+extern "C" {
+#include "clip_common.h"
+}
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "journal.h"
+
+using namespace std;
+
+#define JOURNAL_FILE_MAGIC "CLIPJNL1"
+#define JOURNAL_RECORD_MAGIC (0x4a50494c)
+
+#define JOURNAL_CREATE_ITEM (1)
+#define JOURNAL_STORE_DATA (2)
+// Data that couldn't be read when it was due to be written: its space is
+// left empty, and replay skips it
+#define JOURNAL_LOST_DATA (3)
+
+// Set in flags once data_checksum holds the data's checksum
+#define JOURNAL_DATA_CHECKED (1)
+
+// Every record starts with this. The names follow it (for an item: the
+// label and then each type, for data: the type; each NUL-terminated),
+// and then the data, if any.
+struct RecordHeader {
+  uint32_t magic;
+  uint16_t op;
+  uint16_t clipboard_id;
+  uint16_t item_id;
+  uint16_t flags;
+  uint32_t names_len;
+  uint64_t data_len;
+  // Covers the header (with checksum 0) and the names, but not the data:
+  // replay must not have to read the data
+  uint32_t checksum;
+  // Checked by whoever reads the data
+  uint32_t data_checksum;
+};
+
+// A record waiting for the writer
+class PendingRecord {
+public:
+  RecordHeader header;
+  string names;
+  // Where the data comes from, NULL for an item
+  void *token;
+  uint64_t offset;
+};
+
+class Journal {
+public:
+  string path;
+  int fd;
+  // Where the next record goes
+  uint64_t size;
+  journal_data_opener open_data;
+  journal_data_closer close_data;
+
+  // Shared with the writer thread
+  mutex lock;
+  condition_variable wake;
+  condition_variable caught_up;
+  deque<PendingRecord *> queue;
+  // Taken off the queue, not written yet
+  size_t writing;
+  // Tokens waiting for journal_reap
+  vector<void *> done;
+  // Set once a write fails; nothing more is written
+  bool broken;
+  bool stopping;
+  thread writer;
+};
+
+// FNV-1a; this guards against torn writes, not attackers
+static uint32_t checksum(uint32_t hash, const void *buf, size_t len)
+{
+  const unsigned char *bytes = (const unsigned char *)buf;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static uint32_t record_checksum(RecordHeader header, const char *names)
+{
+  header.checksum = 0;
+  uint32_t hash = checksum(2166136261u, &header, sizeof(header));
+  return checksum(hash, names, header.names_len);
+}
+
+uint32_t journal_data_checksum(const unsigned char *data, size_t datalen)
+{
+  uint64_t hash = clip_hash64(data, datalen);
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static int write_fully(int fd, uint64_t offset, struct iovec *iov, int iovcnt)
+{
+  while (iovcnt > 0) {
+    ssize_t written = pwritev(fd, iov, iovcnt, offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      return -1;
+    }
+    offset += written;
+    // Skip past whatever went out
+    while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 1;
+}
+
+// Write one record where it was given room. Data that can't be read
+// leaves its room empty.
+static int write_record(Journal *journal, PendingRecord *record)
+{
+  RecordHeader &header = record->header;
+  const unsigned char *data = NULL;
+  if (record->token) {
+    data = journal->open_data(record->token);
+    if (data || header.data_len == 0) {
+      header.data_checksum = journal_data_checksum(data, header.data_len);
+      header.flags |= JOURNAL_DATA_CHECKED;
+    } else {
+      header.op = JOURNAL_LOST_DATA;
+    }
+  }
+  header.checksum = record_checksum(header, record->names.data());
+
+  struct iovec iov[3];
+  iov[0].iov_base = &header;
+  iov[0].iov_len = sizeof(header);
+  iov[1].iov_base = (void *)record->names.data();
+  iov[1].iov_len = record->names.size();
+  iov[2].iov_base = (void *)data;
+  iov[2].iov_len = header.data_len;
+  int r = write_fully(journal->fd, record->offset, iov, data && header.data_len ? 3 : 2);
+  if (r > 0 && header.op == JOURNAL_LOST_DATA) {
+    // Records are written in order, so this one ends the file
+    if (ftruncate(journal->fd, record->offset + sizeof(header) + record->names.size()
+		  + header.data_len) < 0) {
+      r = -1;
+    }
+  }
+  if (record->token) {
+    journal->close_data(record->token);
+  }
+  return r;
+}
+
+// The journal's thread: writes the queue in order, and syncs whenever it
+// has caught up
+static void write_records(Journal *journal)
+{
+  unique_lock<mutex> guard(journal->lock);
+  for (;;) {
+    while (journal->queue.empty() && !journal->stopping) {
+      journal->wake.wait(guard);
+    }
+    if (journal->queue.empty()) {
+      return;
+    }
+    PendingRecord *record = journal->queue.front();
+    journal->queue.pop_front();
+    journal->writing++;
+    bool broken = journal->broken;
+    guard.unlock();
+
+    if (!broken && write_record(journal, record) < 0) {
+      fprintf(stderr, "Unable to append to journal %s: %s\n", journal->path.c_str(), strerror(errno));
+      // Don't leave half a record behind; nothing after it is written
+      if (ftruncate(journal->fd, record->offset) < 0) {
+	fprintf(stderr, "Unable to trim journal %s\n", journal->path.c_str());
+      }
+      guard.lock();
+      journal->broken = true;
+      journal->size = record->offset;
+      guard.unlock();
+    }
+
+    guard.lock();
+    if (record->token) {
+      journal->done.push_back(record->token);
+    }
+    delete record;
+    if (journal->queue.empty()) {
+      guard.unlock();
+      fdatasync(journal->fd);
+      guard.lock();
+      journal->writing--;
+      journal->caught_up.notify_all();
+    } else {
+      journal->writing--;
+    }
+  }
+}
+
+static Journal *open_path(const char *path, int flags, journal_data_opener open_data,
+			  journal_data_closer close_data)
+{
+  int fd = open(path, flags | O_RDWR | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "Unable to open journal %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+
+  // A new file gets the magic; an old one must have it
+  char magic[sizeof(JOURNAL_FILE_MAGIC) - 1];
+  if (st.st_size == 0) {
+    if (write(fd, JOURNAL_FILE_MAGIC, sizeof(magic)) != sizeof(magic)) {
+      close(fd);
+      return NULL;
+    }
+    st.st_size = sizeof(magic);
+  } else if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic)
+	     || memcmp(magic, JOURNAL_FILE_MAGIC, sizeof(magic)) != 0) {
+    fprintf(stderr, "%s is not a clipd journal\n", path);
+    close(fd);
+    return NULL;
+  }
+
+  Journal *journal = new Journal;
+  journal->path = path;
+  journal->fd = fd;
+  journal->size = st.st_size;
+  journal->open_data = open_data;
+  journal->close_data = close_data;
+  journal->writing = 0;
+  journal->broken = false;
+  journal->stopping = false;
+  journal->writer = thread(write_records, journal);
+  return journal;
+}
+
+Journal *journal_open(const char *path, journal_data_opener open_data,
+		      journal_data_closer close_data)
+{
+  return open_path(path, O_CREAT, open_data, close_data);
+}
+
+void journal_close(Journal *journal)
+{
+  if (journal) {
+    {
+      lock_guard<mutex> guard(journal->lock);
+      journal->stopping = true;
+    }
+    journal->wake.notify_one();
+    journal->writer.join();
+    close(journal->fd);
+    delete journal;
+  }
+}
+
+int journal_fd(Journal *journal)
+{
+  return journal->fd;
+}
+
+uint64_t journal_size(Journal *journal)
+{
+  lock_guard<mutex> guard(journal->lock);
+  return journal->size;
+}
+
+size_t journal_pending(Journal *journal)
+{
+  lock_guard<mutex> guard(journal->lock);
+  return journal->queue.size() + journal->writing;
+}
+
+void journal_flush(Journal *journal)
+{
+  unique_lock<mutex> guard(journal->lock);
+  while (!journal->queue.empty() || journal->writing > 0) {
+    journal->caught_up.wait(guard);
+  }
+}
+
+void journal_reap(Journal *journal, journal_token_handler done, void *context)
+{
+  vector<void *> tokens;
+  {
+    lock_guard<mutex> guard(journal->lock);
+    tokens.swap(journal->done);
+  }
+  for (size_t i = 0; i < tokens.size(); i++) {
+    done(context, tokens[i]);
+  }
+}
+
+// Gives the record its room in the file and queues it for the writer
+static int append_record(Journal *journal, uint16_t op, uint16_t clipboard_id, uint16_t item_id,
+			 const string &names, size_t datalen, void *token, uint64_t *offset_ptr)
+{
+  PendingRecord *record = new PendingRecord;
+  memset(&record->header, 0, sizeof(record->header));
+  record->header.magic = JOURNAL_RECORD_MAGIC;
+  record->header.op = op;
+  record->header.clipboard_id = clipboard_id;
+  record->header.item_id = item_id;
+  record->header.names_len = names.size();
+  record->header.data_len = datalen;
+  record->names = names;
+  record->token = token;
+
+  {
+    lock_guard<mutex> guard(journal->lock);
+    if (journal->broken) {
+      delete record;
+      return -1;
+    }
+    record->offset = journal->size;
+    journal->size += sizeof(RecordHeader) + names.size() + datalen;
+    journal->queue.push_back(record);
+  }
+  journal->wake.notify_one();
+  if (offset_ptr) {
+    *offset_ptr = record->offset + sizeof(RecordHeader) + names.size();
+  }
+  return 1;
+}
+
+int journal_append_item(Journal *journal, uint16_t clipboard_id, uint16_t item_id,
+			const char *label, char **typelist)
+{
+  string names(label, strlen(label) + 1);
+  for (int i = 0; typelist[i] != NULL; i++) {
+    names.append(typelist[i], strlen(typelist[i]) + 1);
+  }
+  return append_record(journal, JOURNAL_CREATE_ITEM, clipboard_id, item_id, names, 0, NULL, NULL);
+}
+
+int journal_append_data(Journal *journal, uint16_t clipboard_id, uint16_t item_id,
+			const char *type, size_t datalen, void *token, uint64_t *offset_ptr)
+{
+  string names(type, strlen(type) + 1);
+  return append_record(journal, JOURNAL_STORE_DATA, clipboard_id, item_id, names, datalen, token,
+		       offset_ptr);
+}
+
+// Called before anything is queued, so the writer isn't in the way
+int journal_replay(Journal *journal, journal_item_visitor visit_item,
+		   journal_data_visitor visit_data, void *context)
+{
+  uint64_t offset = sizeof(JOURNAL_FILE_MAGIC) - 1;
+  if (journal->size <= offset) {
+    return 0;
+  }
+
+  // Only the headers and names are touched, so the data's pages are never
+  // read in
+  void *mapping = mmap(NULL, journal->size, PROT_READ, MAP_SHARED, journal->fd, 0);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "Unable to map journal %s: %s\n", journal->path.c_str(), strerror(errno));
+    return -1;
+  }
+  const char *base = (const char *)mapping;
+
+  int count = 0;
+  vector<char *> typelist;
+  while (offset + sizeof(RecordHeader) <= journal->size) {
+    RecordHeader header;
+    memcpy(&header, base + offset, sizeof(header));
+    uint64_t names_offset = offset + sizeof(header);
+    if (header.magic != JOURNAL_RECORD_MAGIC
+	|| header.names_len == 0
+	|| names_offset + header.names_len < names_offset
+	|| names_offset + header.names_len > journal->size) {
+      break;
+    }
+    const char *names = base + names_offset;
+    uint64_t data_offset = names_offset + header.names_len;
+    if (names[header.names_len - 1] != '\0'
+	|| record_checksum(header, names) != header.checksum
+	|| data_offset + header.data_len < data_offset
+	|| data_offset + header.data_len > journal->size) {
+      break;
+    }
+
+    if (header.op == JOURNAL_CREATE_ITEM) {
+      // The label, then the types
+      typelist.clear();
+      const char *name = names + strlen(names) + 1;
+      while (name < names + header.names_len) {
+	typelist.push_back((char *)name);
+	name += strlen(name) + 1;
+      }
+      typelist.push_back(NULL);
+      visit_item(context, header.clipboard_id, header.item_id, names, &typelist[0]);
+    } else if (header.op == JOURNAL_STORE_DATA) {
+      visit_data(context, header.clipboard_id, header.item_id, names, data_offset, header.data_len,
+		 header.flags & JOURNAL_DATA_CHECKED ? &header.data_checksum : NULL);
+    }
+    count++;
+    offset = data_offset + header.data_len;
+  }
+  munmap(mapping, journal->size);
+
+  // Whatever follows the last good record was torn by a crash
+  if (offset < journal->size) {
+    fprintf(stderr, "Dropping %llu bytes of damaged journal %s\n",
+	    (unsigned long long)(journal->size - offset), journal->path.c_str());
+    if (ftruncate(journal->fd, offset) == 0) {
+      journal->size = offset;
+    }
+  }
+  return count;
+}
+
+Journal *journal_begin_rewrite(Journal *journal)
+{
+  string path = journal->path + ".new";
+  return open_path(path.c_str(), O_CREAT | O_TRUNC, journal->open_data, journal->close_data);
+}
+
+void journal_abort_rewrite(Journal *rewritten)
+{
+  unlink(rewritten->path.c_str());
+  journal_close(rewritten);
+}
+
+int journal_commit_rewrite(Journal *journal, Journal *rewritten)
+{
+  bool broken;
+  {
+    lock_guard<mutex> guard(rewritten->lock);
+    broken = rewritten->broken;
+  }
+  // The new file must be complete on disk before it replaces the old one
+  if (broken || fsync(rewritten->fd) < 0 || rename(rewritten->path.c_str(), journal->path.c_str()) < 0) {
+    fprintf(stderr, "Unable to replace journal %s: %s\n", journal->path.c_str(), strerror(errno));
+    journal_abort_rewrite(rewritten);
+    return -1;
+  }
+  rewritten->path = journal->path;
+  journal_close(journal);
+  return 1;
+}
@@ -0,0 +1,101 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The journal is an append-only file recording every item created and
+// every piece of data stored, so clipd can rebuild its rings after a
+// restart or a crash. Each record is a fixed-size header, the names it
+// needs (label and types), and then the data itself. Replaying walks the
+// headers and hops over the data, so restoring never reads payload bytes.
+//
+// A crash can leave a torn record at the end of the file; replay stops at
+// the first record that doesn't check out and cuts the file back to there.
+// The data has a checksum of its own in the header, for whoever reads it
+// later to check.
+//
+// Appending only queues a record. The journal's own thread writes the
+// records in order and syncs the file whenever it catches up, so nothing
+// waits for the disk. Data is written from a token the caller hands over,
+// through the journal's data access functions, and the token comes back
+// from journal_reap once the journal is done with it.
+
+class Journal;
+
+// const unsigned char *open_data(void *token) -- NULL if the data can't be read
+// void close_data(void *token) -- called after every open_data, even one that failed
+// Both are called on the journal's thread
+typedef const unsigned char *(*journal_data_opener)(void *);
+typedef void (*journal_data_closer)(void *);
+
+// Open the journal at path, creating it if needed
+// Returns NULL on error
+Journal *journal_open(const char *path, journal_data_opener open_data,
+		      journal_data_closer close_data);
+// Writes whatever is queued first. Tokens not reaped yet are forgotten.
+void journal_close(Journal *journal);
+
+// The journal's file, for mapping the data of replayed records
+// You don't own it -- don't close it
+int journal_fd(Journal *journal);
+
+// How many bytes the journal file holds, counting queued records
+uint64_t journal_size(Journal *journal);
+
+// How many records are queued or being written
+size_t journal_pending(Journal *journal);
+
+// Wait until every queued record is written and synced
+void journal_flush(Journal *journal);
+
+// Hands each token the journal is done with, written or not, to done
+// void done(void *context, void *token)
+typedef void (*journal_token_handler)(void *, void *);
+void journal_reap(Journal *journal, journal_token_handler done, void *context);
+
+// The checksum the header holds for data
+uint32_t journal_data_checksum(const unsigned char *data, size_t datalen);
+
+// Record a new item. The sender isn't recorded: it means nothing once
+// clipd restarts.
+// Returns -1 on error
+int journal_append_item(Journal *journal, uint16_t clipboard_id, uint16_t item_id,
+			const char *label, char **typelist);
+
+// Record datalen bytes of data stored on an item, read through token
+// Gets where the data will land in the file by reference, if offset_ptr isn't NULL
+// Returns -1 on error, and then the token isn't reaped
+int journal_append_data(Journal *journal, uint16_t clipboard_id, uint16_t item_id,
+			const char *type, size_t datalen, void *token, uint64_t *offset_ptr);
+
+// Called for each intact record, oldest first. The strings are only
+// valid during the call. Data is described by where it sits in the file,
+// and by its checksum (NULL for records from before data had one).
+// void visit_item(void *context, uint16_t clipboard_id, uint16_t item_id, const char *label, char **typelist)
+typedef void (*journal_item_visitor)(void *, uint16_t, uint16_t, const char *, char **);
+// void visit_data(void *context, uint16_t clipboard_id, uint16_t item_id, const char *type,
+//                 uint64_t offset, uint64_t datalen, const uint32_t *checksum)
+typedef void (*journal_data_visitor)(void *, uint16_t, uint16_t, const char *, uint64_t, uint64_t,
+				     const uint32_t *);
+
+// Returns the number of records replayed, -1 on error
+int journal_replay(Journal *journal, journal_item_visitor visit_item,
+		   journal_data_visitor visit_data, void *context);
+
+// Compaction writes the live records to a fresh journal next to the old
+// one, then swaps it into place. Until journal_commit_rewrite the old
+// journal is untouched, so a crash midway loses nothing.
+// Returns NULL on error
+Journal *journal_begin_rewrite(Journal *journal);
+
+// Throws away an unfinished rewrite
+void journal_abort_rewrite(Journal *rewritten);
+
+// Makes rewritten the journal at the old journal's path and closes the
+// old journal. Nothing may be pending on either: reap both first. On
+// error, the rewrite is thrown away and the old journal stays.
+// Returns -1 on error
+int journal_commit_rewrite(Journal *journal, Journal *rewritten);
+
+#endif
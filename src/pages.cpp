@@ -0,0 +1,126 @@
+#include <mutex>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "pages.h"
+
+using namespace std;
+
+// Four classes to each doubling from PAGES_MIN, so a block is never more
+// than a quarter bigger than asked for. Blocks past the biggest class are
+// mapped and unmapped one by one.
+#define MIN_SHIFT (16)
+#define MAX_SHIFT (26)
+#define CLASS_COUNT ((MAX_SHIFT - MIN_SHIFT + 1) * 4)
+
+// Freed blocks kept for reuse in each class; more are unmapped
+#define IDLE_PER_CLASS (8)
+
+static mutex pages_lock;
+static vector<void *> idle[CLASS_COUNT];
+static size_t idle_bytes = 0;
+
+// The size of the block for length (at least PAGES_MIN) bytes
+// Returns the block's class, -1 if it is too big for one
+static int size_class(size_t length, size_t *sizeptr)
+{
+  int shift = 63 - __builtin_clzll(length);
+  size_t step = (size_t)1 << (shift - 2);
+  size_t size = (length + step - 1) & ~(step - 1);
+  if (size == (size_t)2 << shift) {
+    shift++;
+  }
+  *sizeptr = size;
+  if (shift > MAX_SHIFT) {
+    return -1;
+  }
+  return (shift - MIN_SHIFT) * 4 + (int)(size >> (shift - 2)) - 4;
+}
+
+void *pages_alloc(size_t length)
+{
+  if (length < PAGES_MIN) {
+    return malloc(length);
+  }
+
+  size_t size;
+  int c = size_class(length, &size);
+  if (c >= 0) {
+    lock_guard<mutex> guard(pages_lock);
+    if (!idle[c].empty()) {
+      void *block = idle[c].back();
+      idle[c].pop_back();
+      idle_bytes -= size;
+      return block;
+    }
+  }
+
+  void *block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (block == MAP_FAILED) {
+    fprintf(stderr, "Unable to map %zu bytes: %s\n", size, strerror(errno));
+    return NULL;
+  }
+  return block;
+}
+
+void pages_free(void *block, size_t length)
+{
+  if (length < PAGES_MIN) {
+    free(block);
+    return;
+  }
+  if (block == NULL) {
+    return;
+  }
+
+  size_t size;
+  int c = size_class(length, &size);
+  // The pages go back now; the addresses wait for the next block
+  if (c >= 0 && madvise(block, size, MADV_DONTNEED) == 0) {
+    lock_guard<mutex> guard(pages_lock);
+    if (idle[c].size() < IDLE_PER_CLASS) {
+      idle[c].push_back(block);
+      idle_bytes += size;
+      return;
+    }
+  }
+  munmap(block, size);
+}
+
+void *pages_shrink(void *block, size_t length, size_t new_length)
+{
+  if (length < PAGES_MIN) {
+    void *shrunk = realloc(block, new_length ? new_length : 1);
+    return shrunk ? shrunk : block;
+  }
+
+  // Small enough for the heap: copy it there
+  if (new_length < PAGES_MIN) {
+    void *copy = malloc(new_length ? new_length : 1);
+    if (copy == NULL) {
+      return NULL;
+    }
+    memcpy(copy, block, new_length);
+    pages_free(block, length);
+    return copy;
+  }
+
+  // Every class size is whole pages, so the tail can simply be unmapped
+  size_t size, new_size;
+  size_class(length, &size);
+  size_class(new_length, &new_size);
+  if (new_size < size) {
+    munmap((unsigned char *)block + new_size, size - new_size);
+  }
+  return block;
+}
+
+size_t pages_idle_bytes()
+{
+  lock_guard<mutex> guard(pages_lock);
+  return idle_bytes;
+}
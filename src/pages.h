@@ -0,0 +1,30 @@
+#ifndef PAGES_H
+#define PAGES_H
+
+#include <stddef.h>
+
+// Memory for payload bytes. Blocks smaller than PAGES_MIN come from
+// malloc. Bigger ones are whole pages in size classes, mapped apart from
+// the heap so that weeks of big copies can't fragment it. A freed block's
+// pages go back to the kernel at once (madvise), but its addresses are
+// kept for the next block of the same class.
+// Safe to call from any thread.
+
+#define PAGES_MIN (64 * 1024)
+
+// Returns NULL if unsuccessful (or, maybe, if length is 0)
+void *pages_alloc(size_t length);
+
+// length must be what the block was allocated with
+void pages_free(void *block, size_t length);
+
+// Shrink a block to new_length, giving back the pages it no longer needs
+// Returns the block, which may have moved, or NULL if unsuccessful (the
+// block is left as it was)
+void *pages_shrink(void *block, size_t length, size_t new_length);
+
+// Address space held by freed blocks waiting to be reused. None of it is
+// resident.
+size_t pages_idle_bytes();
+
+#endif
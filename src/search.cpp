@@ -0,0 +1,216 @@
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "search.h"
+#include "convert.h"
+
+using namespace std;
+
+class BoardIndex {
+public:
+  // The documents holding each trigram, sorted by key
+  unordered_map<uint32_t, vector<uint64_t>> postings;
+  // The trigrams of each document, to take it out again
+  unordered_map<uint64_t, vector<uint32_t>> trigrams;
+};
+
+static unordered_map<uint16_t, BoardIndex> boards;
+static size_t entries = 0;
+
+static inline unsigned char fold(unsigned char c)
+{
+  return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+// Every trigram of the text, sorted, each once
+static vector<uint32_t> trigrams_of(const unsigned char *text, size_t length)
+{
+  vector<uint32_t> trigrams;
+  if (length < 3) {
+    return trigrams;
+  }
+  trigrams.reserve(length - 2);
+  uint32_t trigram = fold(text[0]) << 8 | fold(text[1]);
+  for (size_t i = 2; i < length; i++) {
+    trigram = (trigram << 8 | fold(text[i])) & 0xFFFFFF;
+    trigrams.push_back(trigram);
+  }
+  sort(trigrams.begin(), trigrams.end());
+  trigrams.erase(unique(trigrams.begin(), trigrams.end()), trigrams.end());
+  return trigrams;
+}
+
+void search_add(uint16_t clipboard_id, uint64_t key, const unsigned char *text, size_t length)
+{
+  search_remove(clipboard_id, key);
+  vector<uint32_t> trigrams = trigrams_of(text, length);
+  if (trigrams.empty()) {
+    return;
+  }
+
+  BoardIndex &board = boards[clipboard_id];
+  for (size_t i = 0; i < trigrams.size(); i++) {
+    vector<uint64_t> &keys = board.postings[trigrams[i]];
+    keys.insert(lower_bound(keys.begin(), keys.end(), key), key);
+  }
+  entries += trigrams.size();
+  board.trigrams[key].swap(trigrams);
+}
+
+void search_remove(uint16_t clipboard_id, uint64_t key)
+{
+  unordered_map<uint16_t, BoardIndex>::iterator board = boards.find(clipboard_id);
+  if (board == boards.end()) {
+    return;
+  }
+  unordered_map<uint64_t, vector<uint32_t>>::iterator doc = board->second.trigrams.find(key);
+  if (doc == board->second.trigrams.end()) {
+    return;
+  }
+
+  const vector<uint32_t> &trigrams = doc->second;
+  for (size_t i = 0; i < trigrams.size(); i++) {
+    unordered_map<uint32_t, vector<uint64_t>>::iterator posting = board->second.postings.find(trigrams[i]);
+    vector<uint64_t> &keys = posting->second;
+    keys.erase(lower_bound(keys.begin(), keys.end(), key));
+    if (keys.empty()) {
+      board->second.postings.erase(posting);
+    }
+  }
+  entries -= trigrams.size();
+  board->second.trigrams.erase(doc);
+  // Dropped boards leave nothing behind
+  if (board->second.trigrams.empty()) {
+    boards.erase(board);
+  }
+}
+
+static bool shorter(const vector<uint64_t> *a, const vector<uint64_t> *b)
+{
+  return a->size() < b->size();
+}
+
+int search_candidates(uint16_t clipboard_id, const char *query, vector<uint64_t> &keys)
+{
+  keys.clear();
+  vector<uint32_t> trigrams = trigrams_of((const unsigned char *)query, strlen(query));
+  if (trigrams.empty()) {
+    return -1;
+  }
+  unordered_map<uint16_t, BoardIndex>::iterator board = boards.find(clipboard_id);
+  if (board == boards.end()) {
+    return 0;
+  }
+
+  // Start from the rarest trigram and keep what every other one has too
+  vector<const vector<uint64_t> *> postings;
+  for (size_t i = 0; i < trigrams.size(); i++) {
+    unordered_map<uint32_t, vector<uint64_t>>::iterator posting = board->second.postings.find(trigrams[i]);
+    if (posting == board->second.postings.end()) {
+      return 0;
+    }
+    postings.push_back(&posting->second);
+  }
+  sort(postings.begin(), postings.end(), shorter);
+  keys = *postings[0];
+  for (size_t i = 1; i < postings.size() && !keys.empty(); i++) {
+    const vector<uint64_t> &other = *postings[i];
+    size_t kept = 0;
+    for (size_t j = 0; j < keys.size(); j++) {
+      if (binary_search(other.begin(), other.end(), keys[j])) {
+	keys[kept++] = keys[j];
+      }
+    }
+    keys.resize(kept);
+  }
+  return 0;
+}
+
+long search_find(const unsigned char *text, size_t length, const char *query)
+{
+  size_t query_length = strlen(query);
+  if (query_length == 0) {
+    return 0;
+  }
+  if (query_length > length) {
+    return -1;
+  }
+
+  // memchr is vectorized, so let it find where the first byte turns up
+  // in either case, and only compare the rest there
+  unsigned char first = fold(query[0]);
+  unsigned char other = toupper(first);
+  const unsigned char *last = text + length - query_length;
+  const unsigned char *lower = text;
+  const unsigned char *upper = other == first ? NULL : text;
+  for (;;) {
+    if (lower && lower <= last) {
+      lower = (const unsigned char *)memchr(lower, first, last - lower + 1);
+    } else {
+      lower = NULL;
+    }
+    if (upper && upper <= last) {
+      upper = (const unsigned char *)memchr(upper, other, last - upper + 1);
+    } else {
+      upper = NULL;
+    }
+    const unsigned char *candidate = lower && (!upper || lower < upper) ? lower : upper;
+    if (candidate == NULL) {
+      return -1;
+    }
+
+    size_t i = 1;
+    while (i < query_length && fold(candidate[i]) == fold(query[i])) {
+      i++;
+    }
+    if (i == query_length) {
+      return candidate - text;
+    }
+    if (candidate == lower) {
+      lower++;
+    } else {
+      upper++;
+    }
+  }
+}
+
+string search_snippet(const unsigned char *text, size_t length, size_t offset,
+		      size_t match_length, size_t width)
+{
+  size_t context = width > match_length ? (width - match_length) / 2 : 0;
+  size_t start = offset > context ? offset - context : 0;
+  size_t end = min(length, offset + match_length + context);
+  // Whole characters only
+  while (start > 0 && start < length && (text[start] & 0xC0) == 0x80) {
+    start++;
+  }
+  while (end < length && end > start && (text[end] & 0xC0) == 0x80) {
+    end--;
+  }
+
+  size_t normalized_length;
+  unsigned char *normalized;
+  if (convert_data("public.utf8-plain-text", "public.utf8-plain-text", end - start, text + start,
+		   &normalized_length, &normalized) < 0) {
+    return "";
+  }
+  string snippet((const char *)normalized, normalized_length);
+  free(normalized);
+  // D-Bus strings can't hold NUL, and a snippet is one line
+  for (size_t i = 0; i < snippet.size(); i++) {
+    if (snippet[i] == '\0' || snippet[i] == '\n' || snippet[i] == '\t') {
+      snippet[i] = ' ';
+    }
+  }
+  return snippet;
+}
+
+size_t search_index_entries()
+{
+  return entries;
+}
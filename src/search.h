@@ -0,0 +1,36 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// An index of the text on each board, so a search only reads the texts
+// that hold every three-byte run (trigram) of the query. Texts are
+// documents whose keys are up to the caller. Matching ignores ASCII case.
+// Not thread-safe: use it from the store's thread.
+
+// Index the first length bytes of text as document key on the board
+void search_add(uint16_t clipboard_id, uint64_t key, const unsigned char *text, size_t length);
+
+// Take a document out of the index; a key that isn't there is ignored
+void search_remove(uint16_t clipboard_id, uint64_t key);
+
+// Get the keys, sorted, of the documents on the board that may hold query
+// Returns -1 if query is too short to rule any document out
+int search_candidates(uint16_t clipboard_id, const char *query, std::vector<uint64_t> &keys);
+
+// Where query first turns up in the length bytes of text, ignoring ASCII case
+// Returns -1 if it doesn't
+long search_find(const unsigned char *text, size_t length, const char *query);
+
+// About width bytes of text around the match at offset, as one line of
+// UTF-8 fit for a D-Bus string
+std::string search_snippet(const unsigned char *text, size_t length, size_t offset,
+			   size_t match_length, size_t width);
+
+// How many document-trigram pairs the index holds
+size_t search_index_entries();
+
+#endif
@@ -1,260 +1,2050 @@
+#include <algorithm>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <map>
-#include <deque>
+#include <unordered_map>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <cstring>
+extern "C" {
 #include "clip_common.h"
+#include "clip_lz4.h"
+}
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "store.h"
+#include "journal.h"
+#include "pages.h"
+#include "convert.h"
+#include "search.h"
 
 using namespace std;
 
-class Buffer {
-public:
-  size_t length;
-  unsigned char *data;
-  bool owns_data;
-  Buffer() {
-    data = NULL;
-    length = 0;
-    owns_data = false;
-  }
-  Buffer(size_t len, const unsigned char *buf, bool owns) {
-    length = len;
-    // Playing fast and lose with const here because it is about
-    // to be copied when I put it into the map.
-    data = (unsigned char *)buf;
-    owns_data = owns;  
-  }
-  Buffer(const Buffer &b) {
-    length = b.length;
-    data = (unsigned char *)malloc(b.length);
-    memcpy(data, b.data, b.length);
-    owns_data = true;
+// Map a sealed memfd read-only. NULL for empty files.
+static unsigned char *map_fd(int fd, size_t length)
+{
+  if (length == 0) {
+    return NULL;
+  }
+  void *mapping = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    return NULL;
+  }
+  return (unsigned char *)mapping;
+}
+
+// Payloads at least this big are moved out of the heap into files under
+// spill_dir. An empty spill_dir means everything stays on the heap.
+static string spill_dir;
+static size_t spill_threshold = 0;
+
+// An unnamed file in spill_dir, gone as soon as it is closed
+static int open_spill_file()
+{
+  int fd = open(spill_dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd >= 0) {
+    return fd;
+  }
+
+  // Not every filesystem does O_TMPFILE; unlinking at once is close enough
+  string path = spill_dir + "/spill.XXXXXX";
+  vector<char> name(path.begin(), path.end());
+  name.push_back('\0');
+  fd = mkostemp(&name[0], O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  unlink(&name[0]);
+  return fd;
+}
+
+// A file that several payloads map pieces of, closed once the last one
+// is gone
+class SharedFile {
+public:
+  int fd;
+  explicit SharedFile(int file_fd) : fd(file_fd) {}
+  ~SharedFile() {
+    close(fd);
+  }
+};
+
+// Payloads at least this big are compressed if they compress well.
+// 0 means nothing is compressed.
+static size_t compress_threshold = 0;
+
+class Payload;
+static void forget_blob(Payload *payload);
+
+// Bytes held by live payloads, each counted once however many items
+// share it
+static atomic<uint64_t> stored_bytes(0);
+static atomic<uint64_t> payload_count(0);
+static uint64_t dedup_hits = 0;
+static uint64_t evictions = 0;
+// Live payloads by the bit length of their size
+static atomic<uint64_t> payload_sizes[STORE_SIZE_BUCKETS];
+
+static int size_bucket(size_t length)
+{
+  int bits = length ? 64 - __builtin_clzll(length) : 0;
+  return bits < STORE_SIZE_BUCKETS ? bits : STORE_SIZE_BUCKETS - 1;
+}
+
+// Immutable data shared between the ring and any replies being built
+// from it. The last release frees it, so an item can be pushed out while a
+// reader still holds its data.
+class Payload {
+public:
+  // ON_DISK data lives in a spill file or in the journal; COMPRESSED data
+  // is a frame of LZ4 blocks on the heap
+  enum Backing { HEAP, SEALED_MEMFD, ON_DISK, COMPRESSED };
+  Backing backing;
+  size_t length;
+  // On-disk data is only mapped, and compressed data only decompressed,
+  // while it has readers; data is NULL otherwise
+  const unsigned char *data;
+  // The sealed memfd behind data, -1 otherwise
+  int fd;
+  // Where on-disk data lives
+  shared_ptr<SharedFile> file;
+  uint64_t file_offset;
+  // What journal data must hash to, if its record says
+  bool checksummed;
+  uint32_t checksum;
+  // The compressed frame
+  unsigned char *frame;
+  size_t frame_length;
+  // Set once the payload is in the blob table, so others can share it
+  bool is_blob;
+  uint64_t hash;
+
+  // Copies the bytes once: compressed if that pays, else onto the heap, or
+  // into a spill file if big
+  static Payload *copy_of(size_t len, const unsigned char *buf) {
+    if (compress_threshold > 0 && len >= compress_threshold) {
+      Payload *compressed = compressed_copy_of(len, buf);
+      if (compressed) {
+	return compressed;
+      }
+    }
+    if (!spill_dir.empty() && len > 0 && len >= spill_threshold) {
+      Payload *spilled = spilled_copy_of(len, buf);
+      if (spilled) {
+	return spilled;
+      }
+      fprintf(stderr, "Unable to spill %zu bytes to %s, keeping them in memory\n", len,
+	      spill_dir.c_str());
+    }
+    unsigned char *copy = (unsigned char *)pages_alloc(len);
+    if (len > 0 && copy == NULL) {
+      return NULL;
+    }
+    memcpy(copy, buf, len);
+    return new Payload(HEAP, len, copy, -1);
+  }
+
+  // Maps our own duplicate of a sealed memfd
+  static Payload *from_fd(int sealed_fd) {
+    struct stat st;
+    if (fstat(sealed_fd, &st) < 0) {
+      return NULL;
+    }
+    int our_fd = dup(sealed_fd);
+    if (our_fd < 0) {
+      return NULL;
+    }
+    unsigned char *mapping = map_fd(our_fd, st.st_size);
+    if (st.st_size > 0 && mapping == NULL) {
+      close(our_fd);
+      return NULL;
+    }
+    return new Payload(SEALED_MEMFD, st.st_size, mapping, our_fd);
+  }
+
+  // len bytes at offset in a file that won't change underneath us
+  static Payload *on_disk(const shared_ptr<SharedFile> &f, uint64_t offset, size_t len) {
+    Payload *payload = new Payload(ON_DISK, len, NULL, -1);
+    payload->file = f;
+    payload->file_offset = offset;
+    return payload;
+  }
+
+  // The bytes are checked against checksum the first time they are mapped
+  void expect_checksum(uint32_t sum) {
+    checksummed = true;
+    checksum = sum;
+    unchecked = length > 0;
+  }
+
+  // Readers bracket their use of data with open_bytes and close_bytes.
+  // NULL if on-disk data can't be mapped. Workers read payloads too, so
+  // these are the only parts that take a lock.
+  const unsigned char *open_bytes() {
+    lock_guard<mutex> guard(bytes_lock);
+    if (backing == ON_DISK && readers++ == 0 && length > 0) {
+      // mmap wants a page-aligned offset
+      size_t slack = file_offset % sysconf(_SC_PAGESIZE);
+      void *mapping = mmap(NULL, length + slack, PROT_READ, MAP_SHARED, file->fd,
+			   file_offset - slack);
+      data = mapping == MAP_FAILED ? NULL : (const unsigned char *)mapping + slack;
+      if (data && unchecked) {
+	if (journal_data_checksum(data, length) != checksum) {
+	  fprintf(stderr, "Journal data at %llu is damaged\n", (unsigned long long)file_offset);
+	  unmap_disk();
+	} else {
+	  unchecked = false;
+	}
+      }
+    } else if (backing == COMPRESSED && readers++ == 0) {
+      unsigned char *bytes = (unsigned char *)pages_alloc(length);
+      if (bytes && clip_lz4_frame_decode(frame, frame_length, bytes, length) < 0) {
+	fprintf(stderr, "Compressed data is damaged\n");
+	pages_free(bytes, length);
+	bytes = NULL;
+      }
+      data = bytes;
+    }
+    return data;
+  }
+  void close_bytes() {
+    lock_guard<mutex> guard(bytes_lock);
+    if (backing == ON_DISK && --readers == 0) {
+      unmap_disk();
+    } else if (backing == COMPRESSED && --readers == 0) {
+      pages_free((void *)data, length);
+      data = NULL;
+    }
+  }
+
+  // Copies len bytes from offset into out without opening the bytes:
+  // compressed data is only decoded, and on-disk data only read, where it
+  // covers the range. The frame and the file never change, so no lock.
+  // Returns -1 if they can't be read.
+  int read_range(uint64_t offset, size_t len, unsigned char *out) {
+    if (offset > length || len > length - offset) {
+      return -1;
+    }
+    if (backing == COMPRESSED) {
+      if (clip_lz4_frame_decode_range(frame, frame_length, length, offset, out, len) < 0) {
+	fprintf(stderr, "Compressed data is damaged\n");
+	return -1;
+      }
+      return 0;
+    }
+    if (backing == ON_DISK) {
+      // Damaged data mustn't be read in pieces either
+      if (needs_check()) {
+	bool intact = open_bytes() != NULL;
+	close_bytes();
+	if (!intact) {
+	  return -1;
+	}
+      }
+      size_t done = 0;
+      while (done < len) {
+	ssize_t n = pread(file->fd, out + done, len - done, file_offset + offset + done);
+	if (n < 0 && errno == EINTR) {
+	  continue;
+	}
+	if (n <= 0) {
+	  return -1;
+	}
+	done += n;
+      }
+      return 0;
+    }
+    if (len > 0) {
+      memcpy(out, data + offset, len);
+    }
+    return 0;
+  }
+
+  Payload *retain() {
+    refcount.fetch_add(1, memory_order_relaxed);
+    return this;
+  }
+  void release() {
+    if (refcount.fetch_sub(1, memory_order_acq_rel) == 1) {
+      delete this;
+    }
+  }
+
+private:
+  atomic<unsigned> refcount;
+  mutex bytes_lock;
+  unsigned readers;
+  // Set until the bytes are found to match checksum
+  bool unchecked;
+
+  bool needs_check() {
+    lock_guard<mutex> guard(bytes_lock);
+    return unchecked;
+  }
+
+  Payload(Backing b, size_t len, const unsigned char *buf, int backing_fd)
+    : backing(b), length(len), data(buf), fd(backing_fd), file_offset(0), checksummed(false),
+      checksum(0), frame(NULL), frame_length(0), is_blob(false), hash(0), refcount(1), readers(0),
+      unchecked(false) {
+    stored_bytes += len;
+    payload_count++;
+    payload_sizes[size_bucket(len)]++;
+  }
+  // Only the frame counts as stored
+  Payload(size_t len, unsigned char *compressed, size_t compressed_len)
+    : backing(COMPRESSED), length(len), data(NULL), fd(-1), file_offset(0), checksummed(false),
+      checksum(0), frame(compressed), frame_length(compressed_len), is_blob(false), hash(0),
+      refcount(1), readers(0), unchecked(false) {
+    stored_bytes += compressed_len;
+    payload_count++;
+    payload_sizes[size_bucket(len)]++;
+  }
+  Payload(const Payload &) = delete;
+  Payload &operator=(const Payload &) = delete;
+  ~Payload() {
+    stored_bytes -= backing == COMPRESSED ? frame_length : length;
+    payload_count--;
+    payload_sizes[size_bucket(length)]--;
+    if (is_blob) {
+      forget_blob(this);
+    }
+    if (backing == SEALED_MEMFD) {
+      if (data) {
+	munmap((void *)data, length);
+      }
+      close(fd);
+    } else if (backing == ON_DISK) {
+      unmap_disk();
+    } else if (backing == COMPRESSED) {
+      pages_free((void *)data, length);
+      pages_free(frame, frame_length);
+    } else {
+      pages_free((void *)data, length);
+    }
+  }
+
+  void unmap_disk() {
+    if (data) {
+      size_t slack = file_offset % sysconf(_SC_PAGESIZE);
+      munmap((void *)(data - slack), length + slack);
+      data = NULL;
+    }
+  }
+
+  static Payload *spilled_copy_of(size_t len, const unsigned char *buf) {
+    int spill_fd = open_spill_file();
+    if (spill_fd < 0) {
+      return NULL;
+    }
+    if (clip_write_all(spill_fd, len, buf) < 0) {
+      close(spill_fd);
+      return NULL;
+    }
+    return on_disk(make_shared<SharedFile>(spill_fd), 0, len);
+  }
+
+  // NULL unless the bytes shrink by at least an eighth. A compressed frame
+  // still big enough to spill isn't worth it either: spilled data costs no
+  // memory and is read without decompressing.
+  static Payload *compressed_copy_of(size_t len, const unsigned char *buf) {
+    size_t bound = clip_lz4_frame_bound(len);
+    unsigned char *compressed = (unsigned char *)pages_alloc(bound);
+    if (compressed == NULL) {
+      return NULL;
+    }
+
+    // Data that is compressed already (images, archives) gives itself
+    // away in the first block, so don't try the rest
+    size_t probe = len < CLIP_LZ4_BLOCK_SIZE ? len : CLIP_LZ4_BLOCK_SIZE;
+    size_t compressed_len = clip_lz4_frame_encode(buf, probe, compressed);
+    if (compressed_len > probe - probe / 8) {
+      pages_free(compressed, bound);
+      return NULL;
+    }
+    // Blocks are independent, so the rest simply follows
+    compressed_len += clip_lz4_frame_encode(buf + probe, len - probe, compressed + compressed_len);
+    if (compressed_len > len - len / 8
+	|| (!spill_dir.empty() && compressed_len >= spill_threshold)) {
+      pages_free(compressed, bound);
+      return NULL;
+    }
+
+    unsigned char *frame = (unsigned char *)pages_shrink(compressed, bound, compressed_len);
+    if (frame == NULL) {
+      pages_free(compressed, bound);
+      return NULL;
+    }
+    return new Payload(len, frame, compressed_len);
+  }
+};
+
+// The ring's reference to a payload. Move-only, so putting one into a map
+// never copies or retains anything.
+class PayloadRef {
+public:
+  Payload *payload;
+  // Converted from another type, so it can be made again and isn't journaled
+  bool derived;
+  PayloadRef() : payload(NULL), derived(false) {}
+  explicit PayloadRef(Payload *p, bool made = false) : payload(p), derived(made) {}
+  PayloadRef(PayloadRef &&other) : payload(other.payload), derived(other.derived) {
+    other.payload = NULL;
+  }
+  PayloadRef &operator=(PayloadRef &&other) {
+    if (this != &other) {
+      if (payload) {
+	payload->release();
+      }
+      payload = other.payload;
+      derived = other.derived;
+      other.payload = NULL;
+    }
+    return *this;
+  }
+  PayloadRef(const PayloadRef &) = delete;
+  PayloadRef &operator=(const PayloadRef &) = delete;
+  ~PayloadRef() {
+    if (payload) {
+      payload->release();
+    }
+  }
+};
+
+// Payloads by the hash of their contents, so identical data copied to
+// several items, types or clipboards is held once
+static unordered_multimap<uint64_t, Payload *> blobs;
+
+static void forget_blob(Payload *payload)
+{
+  pair<unordered_multimap<uint64_t, Payload *>::iterator,
+       unordered_multimap<uint64_t, Payload *>::iterator> range = blobs.equal_range(payload->hash);
+  for (unordered_multimap<uint64_t, Payload *>::iterator it = range.first; it != range.second; it++) {
+    if (it->second == payload) {
+      blobs.erase(it);
+      return;
+    }
+  }
+}
+
+// A new reference to a payload already holding these bytes, or NULL
+static Payload *find_blob(uint64_t hash, size_t len, const unsigned char *buf)
+{
+  pair<unordered_multimap<uint64_t, Payload *>::iterator,
+       unordered_multimap<uint64_t, Payload *>::iterator> range = blobs.equal_range(hash);
+  for (unordered_multimap<uint64_t, Payload *>::iterator it = range.first; it != range.second; it++) {
+    Payload *candidate = it->second;
+    if (candidate->length != len) {
+      continue;
+    }
+    // Equal hashes make a match likely; the bytes make it certain
+    const unsigned char *bytes = candidate->open_bytes();
+    bool same = bytes && memcmp(bytes, buf, len) == 0;
+    candidate->close_bytes();
+    if (same) {
+      dedup_hits++;
+      return candidate->retain();
+    }
+  }
+  return NULL;
+}
+
+static void remember_blob(Payload *payload, uint64_t hash)
+{
+  payload->hash = hash;
+  payload->is_blob = true;
+  blobs.insert(make_pair(hash, payload));
+}
+
+// A payload holding a copy of buf, shared with identical data if there is any
+static Payload *intern_copy_of(size_t len, const unsigned char *buf)
+{
+  uint64_t hash = clip_hash64(buf, len);
+  Payload *payload = find_blob(hash, len, buf);
+  if (payload == NULL) {
+    payload = Payload::copy_of(len, buf);
+    if (payload) {
+      remember_blob(payload, hash);
+    }
+  }
+  return payload;
+}
+
+// Swap a freshly made payload whose bytes hash to hash for an identical
+// one, if there is one
+static Payload *intern_hashed(Payload *payload, uint64_t hash)
+{
+  // Only read the bytes back if something could match them
+  Payload *existing = NULL;
+  if (blobs.count(hash) > 0) {
+    const unsigned char *bytes = payload->open_bytes();
+    if (bytes || payload->length == 0) {
+      existing = find_blob(hash, payload->length, bytes);
+    }
+    payload->close_bytes();
+  }
+  if (existing) {
+    payload->release();
+    return existing;
+  }
+  remember_blob(payload, hash);
+  return payload;
+}
+
+// Swap a freshly made payload for an identical one, if there is one
+static Payload *intern(Payload *payload)
+{
+  const unsigned char *bytes = payload->open_bytes();
+  if (bytes == NULL && payload->length > 0) {
+    payload->close_bytes();
+    return payload;
+  }
+  uint64_t hash = clip_hash64(bytes, payload->length);
+  payload->close_bytes();
+  return intern_hashed(payload, hash);
+}
+
+// Data copied off the store's thread, waiting to be put on an item
+class PreparedData {
+public:
+  Payload *payload;
+  uint64_t hash;
+};
+
+#pragma mark Type atoms
+
+// Each type is interned once for the life of the process, and items hold
+// its atom. The table's keys view the interned copies, so looking a type
+// up hashes it in place without building a string.
+#define MAX_ATOMS (65535)
+
+static vector<const char *> atom_types(1, (const char *)NULL);
+static unordered_map<string_view, uint32_t> atoms;
+
+uint32_t store_find_atom(const char *type)
+{
+  if (type == NULL) {
+    return 0;
+  }
+  unordered_map<string_view, uint32_t>::iterator it = atoms.find(string_view(type));
+  return it == atoms.end() ? 0 : it->second;
+}
+
+uint32_t store_atom_for_type(const char *type)
+{
+  uint32_t atom = store_find_atom(type);
+  if (atom || type == NULL) {
+    return atom;
+  }
+  if (atom_types.size() > MAX_ATOMS) {
+    fprintf(stderr, "Too many types to intern %s\n", type);
+    return 0;
+  }
+  char *interned = strdup(type);
+  if (interned == NULL) {
+    return 0;
+  }
+  atom = atom_types.size();
+  atom_types.push_back(interned);
+  atoms.emplace(string_view(interned), atom);
+  return atom;
+}
+
+const char *store_type_for_atom(uint32_t atom)
+{
+  return atom < atom_types.size() ? atom_types[atom] : NULL;
+}
+
+size_t store_atom_count()
+{
+  return atom_types.size() - 1;
+}
+
+class ClipItem {
+public:
+  string label;
+  string sender;
+  // The declared types first, in order, then any whose data was pushed
+  // without being declared. payloads[i] holds the data for atoms[i], or
+  // NULL until it arrives.
+  vector<uint32_t> atoms;
+  vector<PayloadRef> payloads;
+  size_t declared_count = 0;
+  // Sum of the lengths of the payloads
+  size_t bytes = 0;
+
+  // Returns -1 if the item has no such type. Items have a handful of
+  // types, so a scan beats any index.
+  int slot_of(uint32_t atom) const {
+    for (size_t i = 0; i < atoms.size(); i++) {
+      if (atoms[i] == atom) {
+	return i;
+      }
+    }
+    return -1;
+  }
+
+  // NULL if the item has no data for the type
+  Payload *payload_for(uint32_t atom) const {
+    int slot = slot_of(atom);
+    return slot < 0 ? NULL : payloads[slot].payload;
+  }
+
+  // Empties the item, keeping its strings' and arrays' memory for the
+  // next item in this slot
+  void clear() {
+    label.clear();
+    sender.clear();
+    atoms.clear();
+    payloads.clear();
+    declared_count = 0;
+    bytes = 0;
+  }
+};
+
+// Ids run from 1 to INT16_MAX and then start over at 1, so a ring can't
+// hold more items than that and still tell them apart
+#define MAX_RING_SIZE (INT16_MAX)
+
+static uint16_t next_item_id(uint16_t item_id)
+{
+  return item_id >= INT16_MAX ? 1 : item_id + 1;
+}
+
+// A board's items, newest first, in slots allocated once when the ring
+// size is set. A new item takes over the slot the oldest one left, so
+// nothing is moved or copied as items come and go, and finding the slot
+// of an index is one addition.
+class Ring {
+public:
+  size_t capacity() const {
+    return slots.size();
+  }
+  size_t size() const {
+    return count;
+  }
+  bool empty() const {
+    return count == 0;
+  }
+  // 0 is the newest item
+  ClipItem &operator[](size_t index) {
+    size_t slot = front + index;
+    return slots[slot < slots.size() ? slot : slot - slots.size()];
+  }
+  ClipItem &back() {
+    return (*this)[count - 1];
+  }
+  // An empty slot in front of the newest item. The ring mustn't be full.
+  ClipItem &push_front() {
+    front = front == 0 ? slots.size() - 1 : front - 1;
+    count++;
+    return slots[front];
+  }
+  void pop_back() {
+    back().clear();
+    count--;
+  }
+  // Keeps the newest items that fit; push out the others first
+  void set_capacity(size_t capacity) {
+    vector<ClipItem> resized(capacity);
+    size_t kept = min(count, capacity);
+    for (size_t i = 0; i < kept; i++) {
+      resized[i] = std::move((*this)[i]);
+    }
+    slots.swap(resized);
+    front = 0;
+    count = kept;
+  }
+
+private:
+  vector<ClipItem> slots;
+  // The slot of the newest item
+  size_t front = 0;
+  size_t count = 0;
+};
+
+class Clipboard {
+public:
+  uint16_t front_item_id = 0;
+  // Oldest items are pushed out while the ring holds more than this
+  // (0 means no limit). The newest item always stays.
+  size_t byte_budget = 0;
+  size_t bytes = 0;
+  Ring ring;
+  // Only named boards have these: they are dropped once unused for a while
+  string name;
+  time_t last_used = 0;
+};
+
+// The built-in boards always exist. Named boards are made on demand and
+// found through hash maps, so thousands of them are as quick to look up
+// as four, and a dropped one leaves nothing behind.
+static Clipboard builtin_boards[CLIPBOARD_COUNT];
+static const char *builtin_board_names[CLIPBOARD_COUNT] = { "general", "find", "style", "drag" };
+static unordered_map<uint16_t, Clipboard> named_boards;
+static unordered_map<string, uint16_t> board_ids;
+static uint16_t last_board_id = CLIPBOARD_COUNT - 1;
+
+// A board holds at least its map entry, so cap how many can be made
+#define MAX_NAMED_BOARDS (16384)
+#define MAX_BOARD_NAME (255)
+
+// Returns NULL if there is no such board
+static Clipboard *find_board(uint16_t clipboard_id)
+{
+  if (clipboard_id < CLIPBOARD_COUNT) {
+    return &builtin_boards[clipboard_id];
+  }
+  unordered_map<uint16_t, Clipboard>::iterator it = named_boards.find(clipboard_id);
+  if (it == named_boards.end()) {
+    return NULL;
+  }
+  it->second.last_used = time(NULL);
+  return &it->second;
+}
+
+static store_eviction_handler eviction_handler = NULL;
+
+// Only the start of long text is searched, so indexing stays cheap
+#define SEARCH_MAX (256 * 1024)
+
+// Is data of this type text worth searching?
+static bool is_searchable(uint32_t atom)
+{
+  static const uint32_t text_atoms[] = {
+    store_atom_for_type("public.utf8-plain-text"),
+    store_atom_for_type("public.url"),
+    store_atom_for_type("public.file-url"),
+  };
+  for (size_t i = 0; i < sizeof(text_atoms) / sizeof(text_atoms[0]); i++) {
+    if (atom == text_atoms[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Reads the start of the text into buf, without opening the whole payload
+// Returns -1 if it can't be read
+static int read_searchable(Payload *payload, vector<unsigned char> &buf)
+{
+  buf.resize(min(payload->length, (size_t)SEARCH_MAX));
+  return payload->read_range(0, buf.size(), buf.data());
+}
+
+// The index knows each text by its item and type
+static inline uint64_t search_key(uint16_t item_id, uint32_t atom)
+{
+  return (uint64_t)item_id << 32 | atom;
+}
+
+// Every change is recorded here, if there is a journal
+static Journal *journal = NULL;
+// Our own descriptor of the journal, shared by the payloads that live in it
+static shared_ptr<SharedFile> journal_file;
+// The journal being compacted into, while its records are written. New
+// records go to both.
+static Journal *rewriting = NULL;
+
+// The journal writes data straight from the payloads. Each record holds a
+// reference until the journal hands it back.
+static const unsigned char *open_journaled(void *token)
+{
+  return ((Payload *)token)->open_bytes();
+}
+
+static void close_journaled(void *token)
+{
+  ((Payload *)token)->close_bytes();
+}
+
+static void release_journaled(void *context, void *token)
+{
+  ((Payload *)token)->release();
+}
+
+// Payloads are released on this thread only
+static void reap_journals()
+{
+  if (journal) {
+    journal_reap(journal, release_journaled, NULL);
+  }
+  if (rewriting) {
+    journal_reap(rewriting, release_journaled, NULL);
+  }
+}
+
+static void journal_payload(Journal *to, uint16_t clipboard_id, uint16_t item_id, uint32_t atom,
+			    Payload *payload)
+{
+  if (journal_append_data(to, clipboard_id, item_id, store_type_for_atom(atom), payload->length,
+			  payload->retain(), NULL) < 0) {
+    payload->release();
+  }
+}
+
+// Don't bother compacting a journal smaller than this
+#define JOURNAL_COMPACT_MIN (4 * 1024 * 1024)
+
+// Data still arriving in chunks. It grows in a memfd that is sealed and
+// mapped when the upload is committed, so it is never copied twice.
+class Upload {
+public:
+  uint16_t clipboard_id;
+  uint16_t item_id;
+  uint32_t atom;
+  string sender;
+  int fd;
+  // Appended so far
+  size_t bytes;
+};
+
+// Uploads abandoned by crashed clients hold memory until clipd notices
+// the client is gone, so limit them
+#define MAX_UPLOADS (64)
+
+static map<uint32_t, Upload> uploads;
+static uint32_t last_upload_id = 0;
+
+// Nothing can be done with an upload whose item has been pushed out
+static void drop_uploads_for_item(uint16_t clipboard_id, uint16_t item_id)
+{
+  map<uint32_t, Upload>::iterator it = uploads.begin();
+  while (it != uploads.end()) {
+    if (it->second.clipboard_id == clipboard_id && it->second.item_id == item_id) {
+      close(it->second.fd);
+      uploads.erase(it++);
+    } else {
+      it++;
+    }
+  }
+}
+
+// Returns -1 if no such item exists
+int ring_index(uint16_t clipboard_id, uint16_t item_id){
+  
+  Clipboard *board = find_board(clipboard_id);
+  if (board == NULL) {
+    fprintf(stderr, "Asked for clipboard %u\n", clipboard_id);
+    return -1;
+  }
+  uint16_t front_index = board->front_item_id;
+  if (front_index == 0) {
+    return -1;
+  }
+
+  // Zero means "What ever was added last"
+  if (item_id == 0) {
+    // Return the first index
+    return 0;
+  }
+  if (item_id > INT16_MAX) {
+    return -1;
+  }
+
+  // How many items back from the newest, counting across the wrap
+  int index = ((int)front_index - (int)item_id + INT16_MAX) % INT16_MAX;
+  if (index >= board->ring.size()) {
+    return -1;
+  }
+  return index;
+}
+
+int item_id_at_index(uint16_t clipboard_id, size_t idx) {
+  uint16_t front_id = find_board(clipboard_id)->front_item_id;
+  return ((int)front_id - 1 - (int)(idx % INT16_MAX) + INT16_MAX) % INT16_MAX + 1;
+}
+
+static void evict_oldest(uint16_t clipboard_id);
+
+// The ring keeps its newest max_items items
+static void resize_ring(uint16_t clipboard_id, size_t max_items)
+{
+  Clipboard &board = *find_board(clipboard_id);
+  max_items = max<size_t>(1, min<size_t>(max_items, MAX_RING_SIZE));
+  while (board.ring.size() > max_items) {
+    evict_oldest(clipboard_id);
+  }
+  board.ring.set_capacity(max_items);
+}
+
+void store_set_ring_size(uint16_t clipboard_id, uint16_t max_items)
+{
+  Clipboard *board = find_board(clipboard_id);
+  if (board == NULL) {
+    fprintf(stderr, "Asked set ring size for clipboard %u\n", clipboard_id);
+    return;
+  }
+
+  resize_ring(clipboard_id, max_items);
+}
+void store_set_ring_budget(uint16_t clipboard_id, size_t max_bytes)
+{
+  Clipboard *board = find_board(clipboard_id);
+  if (board == NULL) {
+    fprintf(stderr, "Asked set ring budget for clipboard %u\n", clipboard_id);
+    return;
+  }
+
+  board->byte_budget = max_bytes;
+}
+
+size_t store_byte_count(uint16_t clipboard_id)
+{
+  Clipboard *board = find_board(clipboard_id);
+  return board ? board->bytes : 0;
+}
+
+void store_set_spill(const char *dir, size_t threshold)
+{
+  if (dir == NULL) {
+    spill_dir.clear();
+    return;
+  }
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+    fprintf(stderr, "Unable to create spill directory %s: %s\n", dir, strerror(errno));
+    spill_dir.clear();
+    return;
+  }
+  spill_dir = dir;
+  spill_threshold = threshold;
+}
+
+void store_set_compression(size_t threshold)
+{
+  compress_threshold = threshold;
+}
+
+void store_set_eviction_handler(store_eviction_handler handler)
+{
+  eviction_handler = handler;
+}
+
+static void evict_oldest(uint16_t clipboard_id)
+{
+  Clipboard &board = *find_board(clipboard_id);
+  ClipItem &oldest = board.ring.back();
+  uint16_t item_id = item_id_at_index(clipboard_id, board.ring.size() - 1);
+  if (eviction_handler) {
+    eviction_handler(clipboard_id, item_id, oldest.sender.c_str());
+  }
+  for (size_t i = 0; i < oldest.atoms.size(); i++) {
+    search_remove(clipboard_id, search_key(item_id, oldest.atoms[i]));
+  }
+  board.bytes -= oldest.bytes;
+  board.ring.pop_back();
+  drop_uploads_for_item(clipboard_id, item_id);
+  evictions++;
+}
+
+// Push out the oldest items until the ring fits its byte budget
+static void enforce_byte_budget(uint16_t clipboard_id)
+{
+  Clipboard &board = *find_board(clipboard_id);
+  if (board.byte_budget == 0) {
+    return;
+  }
+  while (board.bytes > board.byte_budget && board.ring.size() > 1) {
+    evict_oldest(clipboard_id);
+  }
+}
+
+// Where a payload came from: only pushed data is journaled. Restored data
+// is there already, and converted data can be made again.
+enum PayloadOrigin { PUSHED, RESTORED, CONVERTED };
+
+// Put the payload on the item at index unless the type already has data,
+// and record it in the journal if it was pushed.
+// Takes over the caller's reference. May push out older items.
+static void cache_payload(uint16_t clipboard_id, int index, uint32_t atom, Payload *payload,
+			  PayloadOrigin origin)
+{
+  Clipboard &board = *find_board(clipboard_id);
+  ClipItem &item = board.ring[index];
+  size_t length = payload->length;
+  int slot = item.slot_of(atom);
+  if (slot < 0) {
+    slot = item.atoms.size();
+    item.atoms.push_back(atom);
+    item.payloads.emplace_back();
+  }
+  if (item.payloads[slot].payload) {
+    payload->release();
+    return;
+  }
+  item.payloads[slot] = PayloadRef(payload, origin == CONVERTED);
+
+  if (is_searchable(atom)) {
+    vector<unsigned char> text;
+    if (read_searchable(payload, text) == 0) {
+      search_add(clipboard_id, search_key(item_id_at_index(clipboard_id, index), atom), text.data(),
+		 text.size());
+    }
+  }
+
+  reap_journals();
+  // Named boards only last a session, so they aren't journaled
+  if (origin == PUSHED && journal && clipboard_id < CLIPBOARD_COUNT) {
+    uint16_t item_id = item_id_at_index(clipboard_id, index);
+    journal_payload(journal, clipboard_id, item_id, atom, payload);
+    if (rewriting) {
+      journal_payload(rewriting, clipboard_id, item_id, atom, payload);
+    }
+  }
+
+  item.bytes += length;
+  board.bytes += length;
+  enforce_byte_budget(clipboard_id);
+}
+
+uint16_t store_last_item_id(uint16_t clipboard_id)
+{
+  Clipboard *board = find_board(clipboard_id);
+  if (board == NULL) {
+    fprintf(stderr, "Asked for last item ID for clipboard %u\n", clipboard_id);
+    return 0;
+  }
+  return board->front_item_id;
+}
+uint16_t store_item_count(uint16_t clipboard_id)
+{
+  Clipboard *board = find_board(clipboard_id);
+  return board ? board->ring.size() : 0;
+}
+
+// Put a new item with the given id at the front of the ring.
+// Ids on a ring must run consecutively, so if item_id doesn't follow the
+// front item's, the ring is emptied first.
+static void push_item(uint16_t clipboard_id, uint16_t item_id, const char *label, const char *sender,
+		      char **typelist, uint16_t *pushed_out_ptr, char **pushed_sender_ptr)
+{
+  Clipboard &board = *find_board(clipboard_id);
+  if (item_id != next_item_id(board.front_item_id)) {
+    while (!board.ring.empty()) {
+      evict_oldest(clipboard_id);
+    }
+  }
+  // A ring whose size was never set holds one item
+  if (board.ring.capacity() == 0) {
+    resize_ring(clipboard_id, 1);
+  }
+
+  // Make room first, so the new item can have the oldest one's slot
+  uint16_t pushed_out_item_id = 0;
+  char *pushed_sender = NULL;
+  if (board.ring.size() == board.ring.capacity()) {
+    pushed_out_item_id = item_id_at_index(clipboard_id, board.ring.size() - 1);
+    pushed_sender = strdup(board.ring.back().sender.c_str());
+    evict_oldest(clipboard_id);
+  }
+
+  ClipItem &new_item = board.ring.push_front();
+  new_item.label = label;
+  new_item.sender = sender;
+  for (int i = 0; typelist[i] != NULL; i++) {
+    uint32_t atom = store_atom_for_type(typelist[i]);
+    if (atom && new_item.slot_of(atom) < 0) {
+      new_item.atoms.push_back(atom);
+    }
+  }
+  new_item.declared_count = new_item.atoms.size();
+  new_item.payloads.resize(new_item.declared_count);
+  board.front_item_id = item_id;
+
+  // Tell the caller what got pushed out
+  if (pushed_out_ptr) {
+    *pushed_out_ptr = pushed_out_item_id;
+  }
+  if (pushed_sender_ptr) {
+    *pushed_sender_ptr = pushed_sender;
+  } else {
+    free(pushed_sender);
+  }
+}
+
+uint16_t store_create_item(uint16_t clipboard_id, const char *label, const char *sender,
+			   char **typelist, uint16_t *pushed_out_ptr, char **pushed_sender_ptr)
+{
+  Clipboard *board = find_board(clipboard_id);
+  if (board == NULL) {
+    fprintf(stderr, "Asked to create item on clipboard %u\n", clipboard_id);
+    return 0;
+  }
+  uint16_t new_item_id = next_item_id(board->front_item_id);
+
+  if (journal && clipboard_id < CLIPBOARD_COUNT) {
+    journal_append_item(journal, clipboard_id, new_item_id, label, typelist);
+    if (rewriting) {
+      journal_append_item(rewriting, clipboard_id, new_item_id, label, typelist);
+    }
+  }
+  push_item(clipboard_id, new_item_id, label, sender, typelist, pushed_out_ptr, pushed_sender_ptr);
+  return new_item_id;
+}
+const char *store_sender_for_item(uint16_t clipboard_id, uint16_t item_id){
+  int index = ring_index(clipboard_id, item_id);
+  if (index < 0) {
+    fprintf(stderr, "No such item: %u, %u\n", clipboard_id, item_id);
+    return NULL;
+  }
+  return find_board(clipboard_id)->ring[index].sender.c_str();
+}
+
+const char *store_label_for_item(uint16_t clipboard_id, uint16_t item_id){
+    int index = ring_index(clipboard_id, item_id);
+  if (index < 0) {
+    fprintf(stderr, "No such item: %u, %u\n", clipboard_id, item_id);
+    return NULL;
+  }
+  return find_board(clipboard_id)->ring[index].label.c_str();
+}
+
+int store_store_data(uint16_t clipboard_id, uint16_t item_id, const char *type, size_t datalen, const unsigned char *data)
+{
+  int index = ring_index(clipboard_id, item_id);
+  if (index < 0) {
+    return 0;
+  }
+  uint32_t atom = store_atom_for_type(type);
+  if (atom == 0) {
+    return -1;
+  }
+
+  // The bytes belong to the bus message, so this is the one copy we make,
+  // unless the same bytes are already held
+  Payload *payload = intern_copy_of(datalen, data);
+  if (payload == NULL) {
+    return -1;
+  }
+  cache_payload(clipboard_id, index, atom, payload, PUSHED);
+  return 1;
+}
+
+PreparedData *store_prepare_data(size_t datalen, const unsigned char *data)
+{
+  // Hashing and copying are the slow parts, and neither touches the rings
+  Payload *payload = Payload::copy_of(datalen, data);
+  if (payload == NULL) {
+    return NULL;
+  }
+  PreparedData *prepared = new PreparedData;
+  prepared->payload = payload;
+  prepared->hash = clip_hash64(data, datalen);
+  return prepared;
+}
+
+int store_store_prepared(uint16_t clipboard_id, uint16_t item_id, const char *type,
+			 PreparedData *prepared)
+{
+  Payload *payload = prepared->payload;
+  uint64_t hash = prepared->hash;
+  delete prepared;
+
+  int index = ring_index(clipboard_id, item_id);
+  if (index < 0) {
+    payload->release();
+    return 0;
+  }
+  uint32_t atom = store_atom_for_type(type);
+  if (atom == 0) {
+    payload->release();
+    return -1;
+  }
+  cache_payload(clipboard_id, index, atom, intern_hashed(payload, hash), PUSHED);
+  return 1;
+}
+
+void store_discard_prepared(PreparedData *prepared)
+{
+  if (prepared) {
+    prepared->payload->release();
+    delete prepared;
+  }
+}
+
+int store_store_fd(uint16_t clipboard_id, uint16_t item_id, const char *type, int fd)
+{
+  int index = ring_index(clipboard_id, item_id);
+  uint32_t atom = store_atom_for_type(type);
+  if (index < 0 || atom == 0) {
+    return -1;
+  }
+
+  // Don't trust a file that its creator could still change under us
+  if (!clip_fd_is_sealed(fd)) {
+    fprintf(stderr, "Refusing unsealed fd for %u, %u, %s\n", clipboard_id, item_id, type);
+    return -1;
+  }
+
+  Payload *payload = Payload::from_fd(fd);
+  if (payload == NULL) {
+    return -1;
+  }
+  cache_payload(clipboard_id, index, atom, intern(payload), PUSHED);
+  return 1;
+}
+
+uint32_t store_begin_upload(uint16_t clipboard_id, uint16_t item_id, const char *type, const char *sender)
+{
+  uint32_t atom = store_atom_for_type(type);
+  if (ring_index(clipboard_id, item_id) < 0 || atom == 0) {
+    return 0;
+  }
+  if (uploads.size() >= MAX_UPLOADS) {
+    fprintf(stderr, "Too many uploads in progress\n");
+    return 0;
+  }
+
+  int fd = clip_growable_memfd(type);
+  if (fd < 0) {
+    return 0;
+  }
+
+  // Zero is "no upload", so skip it when the counter wraps
+  do {
+    last_upload_id++;
+  } while (last_upload_id == 0 || uploads.count(last_upload_id) > 0);
+
+  Upload &upload = uploads[last_upload_id];
+  upload.clipboard_id = clipboard_id;
+  // Resolve 0 ("the last item") now, in case another item arrives meanwhile
+  upload.item_id = item_id ? item_id : store_last_item_id(clipboard_id);
+  upload.atom = atom;
+  upload.sender = sender ? sender : "";
+  upload.fd = fd;
+  upload.bytes = 0;
+  return last_upload_id;
+}
+
+// Returns NULL unless upload_id exists and belongs to sender
+static Upload *find_upload(uint32_t upload_id, const char *sender)
+{
+  map<uint32_t, Upload>::iterator it = uploads.find(upload_id);
+  if (it == uploads.end()) {
+    return NULL;
+  }
+  if (it->second.sender != (sender ? sender : "")) {
+    fprintf(stderr, "%s tried to use upload %u belonging to %s\n", sender,
+	    upload_id, it->second.sender.c_str());
+    return NULL;
+  }
+  return &it->second;
+}
+
+int store_append_upload(uint32_t upload_id, const char *sender, size_t datalen, const unsigned char *data)
+{
+  Upload *upload = find_upload(upload_id, sender);
+  if (upload == NULL) {
+    return -1;
+  }
+  // Committed, it would push everything else off the board anyway
+  Clipboard *board = find_board(upload->clipboard_id);
+  if (board && board->byte_budget > 0 && upload->bytes + datalen > board->byte_budget) {
+    fprintf(stderr, "Upload %u would be larger than clipboard %u's %zu byte budget\n",
+	    upload_id, upload->clipboard_id, board->byte_budget);
+    return -1;
+  }
+  if (clip_write_all(upload->fd, datalen, data) < 0) {
+    return -1;
+  }
+  upload->bytes += datalen;
+  return 1;
+}
+
+int store_commit_upload(uint32_t upload_id, const char *sender)
+{
+  Upload *upload = find_upload(upload_id, sender);
+  if (upload == NULL) {
+    return -1;
+  }
+
+  int r = -1;
+  int index = ring_index(upload->clipboard_id, upload->item_id);
+  if (index >= 0 && clip_seal_memfd(upload->fd) >= 0) {
+    Payload *payload = Payload::from_fd(upload->fd);
+    if (payload) {
+      cache_payload(upload->clipboard_id, index, upload->atom, intern(payload), PUSHED);
+      r = 1;
+    }
+  }
+
+  close(upload->fd);
+  uploads.erase(upload_id);
+  return r;
+}
+
+void store_abort_upload(uint32_t upload_id, const char *sender)
+{
+  Upload *upload = find_upload(upload_id, sender);
+  if (upload == NULL) {
+    return;
+  }
+  close(upload->fd);
+  uploads.erase(upload_id);
+}
+
+void store_abort_uploads_of(const char *sender)
+{
+  map<uint32_t, Upload>::iterator it = uploads.begin();
+  while (it != uploads.end()) {
+    if (it->second.sender == sender) {
+      close(it->second.fd);
+      uploads.erase(it++);
+    } else {
+      it++;
+    }
+  }
+}
+
+// Returns NULL if the item or the data is missing
+static Payload *find_payload_for_atom(uint16_t clipboard_id, uint16_t item_id, uint32_t atom)
+{
+  int index = ring_index(clipboard_id, item_id);
+  if (index < 0 || atom == 0) {
+    return NULL;
+  }
+  return find_board(clipboard_id)->ring[index].payload_for(atom);
+}
+
+// A type that was never interned can't be on any item
+static Payload *find_payload(uint16_t clipboard_id, uint16_t item_id, const char *type)
+{
+  return find_payload_for_atom(clipboard_id, item_id, store_find_atom(type));
+}
+
+const Payload *store_retain_data(uint16_t clipboard_id, uint16_t item_id, const char *type)
+{
+  Payload *payload = find_payload(clipboard_id, item_id, type);
+  if (payload == NULL) {
+    return NULL;
+  }
+  if (payload->retain()->open_bytes() == NULL && payload->length > 0) {
+    fprintf(stderr, "Unable to map data for %u, %u, %s\n", clipboard_id, item_id, type);
+    payload->close_bytes();
+    payload->release();
+    return NULL;
+  }
+  return payload;
+}
+
+const Payload *store_retain_payload(uint16_t clipboard_id, uint16_t item_id, const char *type)
+{
+  Payload *payload = find_payload(clipboard_id, item_id, type);
+  return payload ? payload->retain() : NULL;
+}
+
+const Payload *store_retain_payload_for_atom(uint16_t clipboard_id, uint16_t item_id, uint32_t atom)
+{
+  Payload *payload = find_payload_for_atom(clipboard_id, item_id, atom);
+  return payload ? payload->retain() : NULL;
+}
+
+const unsigned char *store_payload_open(const Payload *payload)
+{
+  return const_cast<Payload *>(payload)->open_bytes();
+}
+
+int store_payload_read(const Payload *payload, uint64_t offset, size_t length, unsigned char *out)
+{
+  return const_cast<Payload *>(payload)->read_range(offset, length, out);
+}
+
+void store_payload_discard(const Payload *payload)
+{
+  const_cast<Payload *>(payload)->release();
+}
+
+const unsigned char *store_payload_bytes(const Payload *payload)
+{
+  return payload->data;
+}
+
+size_t store_payload_length(const Payload *payload)
+{
+  return payload->length;
+}
+
+void store_payload_release(const Payload *payload)
+{
+  Payload *p = const_cast<Payload *>(payload);
+  p->close_bytes();
+  p->release();
+}
+
+int store_fetch_data(uint16_t clipboard_id, uint16_t item_id, char *type, size_t *datalenptr, unsigned char **dataptr)
+{
+  Payload *payload = find_payload(clipboard_id, item_id, type);
+  if (payload == NULL) {
+    return -1;
+  }
+  
+  if (dataptr) {
+    const unsigned char *bytes = payload->open_bytes();
+    if (bytes == NULL && payload->length > 0) {
+      payload->close_bytes();
+      return -1;
+    }
+    *dataptr = (unsigned char *)malloc(payload->length);
+    memcpy(*dataptr, bytes, payload->length);
+    payload->close_bytes();
+  }
+
+  if (datalenptr) {
+    *datalenptr = payload->length;
+  }
+  return 1;  
+}
+
+int store_fetch_compressed(uint16_t clipboard_id, uint16_t item_id, const char *type,
+			   size_t *rawlenptr, size_t *framelenptr, unsigned char **frameptr)
+{
+  Payload *payload = find_payload(clipboard_id, item_id, type);
+  if (payload == NULL) {
+    return -1;
   }
-  
-  ~Buffer() {
-    if (owns_data) {
-      free(data);
-    }
+  if (payload->backing != Payload::COMPRESSED) {
+    return 0;
   }
-};
-  
 
-class ClipItem {
-public:
-  string label;
-  string sender;
-  vector<string> declared_types;
-  map<string, Buffer> data_cache;
-};
+  *frameptr = (unsigned char *)malloc(payload->frame_length);
+  if (*frameptr == NULL) {
+    return -1;
+  }
+  memcpy(*frameptr, payload->frame, payload->frame_length);
+  *framelenptr = payload->frame_length;
+  *rawlenptr = payload->length;
+  return 1;
+}
 
-class Clipboard {
-public:
-  uint16_t front_item_id;
-  uint16_t ring_size;
-  deque<ClipItem> ring;
-};
+const unsigned char *store_payload_frame(const Payload *payload, size_t *framelenptr)
+{
+  if (payload->backing != Payload::COMPRESSED) {
+    return NULL;
+  }
+  *framelenptr = payload->frame_length;
+  return payload->frame;
+}
 
-Clipboard store[CLIPBOARD_COUNT];
+int store_fetch_fd(uint16_t clipboard_id, uint16_t item_id, char *type, int *fdptr)
+{
+  int index = ring_index(clipboard_id, item_id);
+  if (index < 0) {
+    return -1;
+  }
 
-// Returns -1 if no such item exists
-int ring_index(uint16_t clipboard_id, uint16_t item_id){
-  
-  if (clipboard_id >= CLIPBOARD_COUNT) {
-    fprintf(stderr, "Asked for clipboard %u\n", clipboard_id);
+  ClipItem &item = find_board(clipboard_id)->ring[index];
+  int slot = item.slot_of(store_find_atom(type));
+  if (slot < 0 || item.payloads[slot].payload == NULL) {
     return -1;
   }
-  uint16_t front_index = store[clipboard_id].front_item_id;
-  if (front_index == 0) {
+  PayloadRef &ref = item.payloads[slot];
+  Payload *old_payload = ref.payload;
+  if (old_payload->backing == Payload::SEALED_MEMFD) {
+    *fdptr = dup(old_payload->fd);
+    return *fdptr < 0 ? -1 : 1;
+  }
+
+  const unsigned char *bytes = old_payload->open_bytes();
+  int fd = -1;
+  if (bytes != NULL || old_payload->length == 0) {
+    fd = clip_sealed_memfd(type, old_payload->length, bytes);
+  }
+  old_payload->close_bytes();
+  if (fd < 0) {
     return -1;
   }
+  // Spilled and compressed data stay as they are: the memfd is only
+  // lent out, and goes away once the reader is done with it
+  if (old_payload->backing != Payload::HEAP) {
+    *fdptr = fd;
+    return 1;
+  }
 
-  // Zero means "What ever was added last"
-  if (item_id == 0) {
-    // Return the first index
+  // Move heap data into the memfd once; later readers share it. Readers
+  // still holding the heap copy keep it alive until they release it.
+  Payload *payload = Payload::from_fd(fd);
+  if (payload == NULL) {
+    close(fd);
+    return -1;
+  }
+  if (old_payload->is_blob) {
+    remember_blob(payload, old_payload->hash);
+  }
+  ref = PayloadRef(payload, ref.derived);
+  *fdptr = fd;
+  return 1;
+}
+
+int store_visit_items(uint16_t clipboard_id, uint16_t first_item_id, uint16_t last_item_id,
+		      size_t max_inline, size_t max_total, store_item_visitor visit, void *context)
+{
+  Clipboard *board = find_board(clipboard_id);
+  if (board == NULL) {
+    fprintf(stderr, "Asked for items on clipboard %u\n", clipboard_id);
+    return -1;
+  }
+  Ring &ring = board->ring;
+  if (ring.empty()) {
     return 0;
   }
 
-  int index = (int)front_index - (int)item_id;
-  // 1 is equivalent to INT16_MAX + 1
+  // Indexes count back from the newest item; ids no longer on the ring
+  // mean the whole of that end
+  int oldest = first_item_id ? ring_index(clipboard_id, first_item_id) : -1;
+  if (oldest < 0) {
+    oldest = ring.size() - 1;
+  }
+  int newest = last_item_id ? ring_index(clipboard_id, last_item_id) : -1;
+  if (newest < 0) {
+    newest = 0;
+  }
+
+  int count = 0;
+  size_t total_left = max_total;
+  vector<char *> typelist;
+  vector<const Payload *> payloads;
+  for (int index = oldest; index >= newest; index--) {
+    ClipItem &item = ring[index];
+    typelist.clear();
+    payloads.clear();
+    for (size_t i = 0; i < item.declared_count; i++) {
+      typelist.push_back((char *)store_type_for_atom(item.atoms[i]));
+      Payload *payload = item.payloads[i].payload;
+      if (payload && payload->length <= max_inline && payload->length <= total_left) {
+	payload->retain();
+	if (payload->open_bytes() == NULL && payload->length > 0) {
+	  payload->close_bytes();
+	  payload->release();
+	  payload = NULL;
+	} else {
+	  total_left -= payload->length;
+	}
+      } else {
+	payload = NULL;
+      }
+      payloads.push_back(payload);
+    }
+    typelist.push_back(NULL);
+    payloads.push_back(NULL);
+
+    visit(context, item_id_at_index(clipboard_id, index), item.label.c_str(), item.sender.c_str(),
+	  &typelist[0], &payloads[0]);
+    count++;
+
+    for (size_t i = 0; i < payloads.size(); i++) {
+      if (payloads[i]) {
+	store_payload_release(payloads[i]);
+      }
+    }
+  }
+  return count;
+}
+
+char **store_typelist(uint16_t clipboard_id, uint16_t item_id)
+{
+  int index = ring_index(clipboard_id, item_id);
   if (index < 0) {
-    index = index + INT16_MAX;
+    return NULL;
+  }
+
+  ClipItem &item = find_board(clipboard_id)->ring[index];
+  int type_count = item.declared_count;
+  char **result = (char **)malloc(sizeof(char *) * (type_count + 1));
+  for (int i = 0; i < type_count; i++) {
+    result[i] = strdup(store_type_for_atom(item.atoms[i]));
   }
-  if (index < 0 || index >= store[clipboard_id].ring.size()) {
+  result[type_count] = NULL;
+  return result;
+}
+
+int store_item_atoms(uint16_t clipboard_id, uint16_t item_id, const uint32_t **atomsptr)
+{
+  int index = ring_index(clipboard_id, item_id);
+  if (index < 0) {
     return -1;
   }
-  return index;
+  ClipItem &item = find_board(clipboard_id)->ring[index];
+  *atomsptr = item.atoms.data();
+  return item.declared_count;
 }
 
-int item_id_at_index(uint16_t clipboard_id, size_t idx) {
-  uint16_t front_id = store[clipboard_id].front_item_id;
-  int result = front_id - idx;
-  if (result < 1) {
-    result = result + INT16_MAX;
+char **store_types_without_data(uint16_t clipboard_id, uint16_t item_id)
+{
+  int index = ring_index(clipboard_id, item_id);
+  if (index < 0) {
+    return NULL;
+  }
+
+  ClipItem &item = find_board(clipboard_id)->ring[index];
+  int result_count = 0;
+  for (size_t i = 0; i < item.declared_count; i++) {
+    result_count += item.payloads[i].payload == NULL;
+  }
+
+  char **result = (char **)malloc(sizeof(char *) * (result_count + 1));
+  int j = 0;
+  for (size_t i = 0; i < item.declared_count; i++) {
+    if (item.payloads[i].payload == NULL) {
+      result[j++] = strdup(store_type_for_atom(item.atoms[i]));
+    }
   }
+  result[result_count] = NULL;
   return result;
-}
+}  
 
-void store_set_ring_size(uint16_t clipboard_id, uint16_t max_items)
+int store_is_promised(uint16_t clipboard_id, uint16_t item_id, const char *type)
 {
-  if (clipboard_id >= CLIPBOARD_COUNT) {
-    fprintf(stderr, "Asked set ring size for clipboard %u\n", clipboard_id);
-    return;
+  int index = ring_index(clipboard_id, item_id);
+  if (index < 0) {
+    return 0;
   }
 
-  store[clipboard_id].ring_size = max_items;
+  ClipItem &item = find_board(clipboard_id)->ring[index];
+  int slot = item.slot_of(store_find_atom(type));
+  return slot >= 0 && slot < (int)item.declared_count && item.payloads[slot].payload == NULL;
 }
-uint16_t store_last_item_id(uint16_t clipboard_id)
+
+#pragma mark Converted data
+
+// Converting runs on the store's thread, so bigger data isn't converted
+#define CONVERT_MAX (8 * 1024 * 1024)
+
+int store_convert_data(uint16_t clipboard_id, uint16_t item_id, const char *type)
 {
-  if (clipboard_id >= CLIPBOARD_COUNT) {
-    fprintf(stderr, "Asked for last item ID for clipboard %u\n", clipboard_id);
+  int index = ring_index(clipboard_id, item_id);
+  if (index < 0) {
+    return 0;
+  }
+  ClipItem &item = find_board(clipboard_id)->ring[index];
+  if (item.payload_for(store_find_atom(type))) {
+    return 1;
+  }
+  const char *const *sources = convert_sources(type);
+  if (sources == NULL) {
     return 0;
   }
-  return store[clipboard_id].front_item_id;
+
+  for (; *sources; sources++) {
+    Payload *source = item.payload_for(store_find_atom(*sources));
+    if (source == NULL || source->length > CONVERT_MAX) {
+      continue;
+    }
+    size_t converted_len = 0;
+    unsigned char *converted = NULL;
+    const unsigned char *bytes = source->open_bytes();
+    int r = -1;
+    if (bytes || source->length == 0) {
+      r = convert_data(*sources, type, source->length, bytes, &converted_len, &converted);
+    }
+    source->close_bytes();
+    if (r < 0) {
+      continue;
+    }
+
+    // Held like pushed data, and counted against the budget like it, but
+    // left out of the journal: it can be made again
+    uint32_t atom = store_atom_for_type(type);
+    Payload *payload = atom ? intern_copy_of(converted_len, converted) : NULL;
+    free(converted);
+    if (payload == NULL) {
+      return 0;
+    }
+    cache_payload(clipboard_id, index, atom, payload, CONVERTED);
+    // The budget may have pushed out the item itself
+    return ring_index(clipboard_id, item_id) == index ? 1 : 0;
+  }
+  return 0;
 }
-uint16_t store_item_count(uint16_t clipboard_id)
+
+#pragma mark Search
+
+int store_search(uint16_t clipboard_id, const char *query, size_t limit,
+		 store_match_visitor visit, void *context)
 {
-  return store[clipboard_id].ring.size();
+  Clipboard *board = find_board(clipboard_id);
+  if (board == NULL) {
+    fprintf(stderr, "Asked to search clipboard %u\n", clipboard_id);
+    return -1;
+  }
+  vector<uint64_t> candidates;
+  bool filtered = search_candidates(clipboard_id, query, candidates) == 0;
+  if (filtered && candidates.empty()) {
+    return 0;
+  }
+
+  // The index only says where the query may be, so read those texts to
+  // be sure, newest item first
+  Ring &ring = board->ring;
+  size_t query_length = strlen(query);
+  vector<unsigned char> text;
+  int count = 0;
+  for (size_t index = 0; index < ring.size() && (limit == 0 || (size_t)count < limit); index++) {
+    ClipItem &item = ring[index];
+    uint16_t item_id = item_id_at_index(clipboard_id, index);
+    for (size_t i = 0; i < item.atoms.size(); i++) {
+      Payload *payload = item.payloads[i].payload;
+      if (payload == NULL || !is_searchable(item.atoms[i])) {
+	continue;
+      }
+      if (filtered && !binary_search(candidates.begin(), candidates.end(),
+				     search_key(item_id, item.atoms[i]))) {
+	continue;
+      }
+      if (read_searchable(payload, text) < 0) {
+	continue;
+      }
+      long offset = search_find(text.data(), text.size(), query);
+      if (offset >= 0) {
+	string snippet = search_snippet(text.data(), text.size(), offset, query_length,
+					SEARCH_SNIPPET);
+	visit(context, item_id, store_type_for_atom(item.atoms[i]), snippet.c_str());
+	count++;
+	break;
+      }
+    }
+  }
+  return count;
 }
 
-uint16_t store_create_item(uint16_t clipboard_id, const char *label, const char *sender,
-			   char **typelist, uint16_t *pushed_out_ptr, char **pushed_sender_ptr)
+#pragma mark Named boards
+
+int store_open_board(const char *name, uint16_t max_items, size_t max_bytes)
 {
-  if (clipboard_id >= CLIPBOARD_COUNT) {
-    fprintf(stderr, "Asked to create item on clipboard %u\n", clipboard_id);
-    return 0;
+  for (int i = 0; i < CLIPBOARD_COUNT; i++) {
+    if (strcmp(name, builtin_board_names[i]) == 0) {
+      return i;
+    }
   }
-  uint16_t new_item_id = store[clipboard_id].front_item_id + 1;
-  if (new_item_id == INT16_MAX + 1) {
-    new_item_id = 1;
+  unordered_map<string, uint16_t>::iterator it = board_ids.find(name);
+  if (it != board_ids.end()) {
+    find_board(it->second);
+    return it->second;
   }
-  ClipItem new_item;
-  new_item.label = label;
-  new_item.sender = sender;
-  for (int i = 0; typelist[i] != NULL; i++) {
-    new_item.declared_types.push_back(typelist[i]);
+
+  if (name[0] == '\0' || strlen(name) > MAX_BOARD_NAME) {
+    fprintf(stderr, "Refusing board name \"%s\"\n", name);
+    return -1;
   }
-  
-  store[clipboard_id].ring.push_front(new_item);
-  store[clipboard_id].front_item_id = new_item_id;
-  
-  uint16_t ring_size = store[clipboard_id].ring_size;
-  uint16_t pushed_out_item_id = 0;
-  char *pushed_sender = NULL;
-  if (store[clipboard_id].ring.size() > ring_size) {
-    pushed_out_item_id = item_id_at_index(clipboard_id, ring_size);
-    pushed_sender = strdup(store[clipboard_id].ring.back().sender.c_str());
-    store[clipboard_id].ring.pop_back();
+  if (named_boards.size() >= MAX_NAMED_BOARDS) {
+    fprintf(stderr, "Too many boards to make %s\n", name);
+    return -1;
   }
 
-  // Tell the caller what got pushed out
-  if (pushed_out_ptr) {
-    *pushed_out_ptr = pushed_out_item_id;
+  // Ids aren't reused until they wrap, so someone still holding the id
+  // of a dropped board doesn't land on a new one
+  do {
+    last_board_id++;
+    if (last_board_id < CLIPBOARD_COUNT) {
+      last_board_id = CLIPBOARD_COUNT;
+    }
+  } while (named_boards.count(last_board_id) > 0);
+
+  Clipboard &board = named_boards[last_board_id];
+  board.name = name;
+  board.ring.set_capacity(max<size_t>(1, min<size_t>(max_items, MAX_RING_SIZE)));
+  board.byte_budget = max_bytes;
+  board.last_used = time(NULL);
+  board_ids[name] = last_board_id;
+  return last_board_id;
+}
+
+const char *store_board_name(uint16_t clipboard_id)
+{
+  if (clipboard_id < CLIPBOARD_COUNT) {
+    return builtin_board_names[clipboard_id];
   }
-  if (pushed_sender_ptr) {
-    *pushed_sender_ptr = pushed_sender;
-  } else {
-    free(pushed_sender);
+  unordered_map<uint16_t, Clipboard>::iterator it = named_boards.find(clipboard_id);
+  return it == named_boards.end() ? NULL : it->second.name.c_str();
+}
+
+size_t store_board_count()
+{
+  return CLIPBOARD_COUNT + named_boards.size();
+}
+
+void store_visit_boards(store_board_visitor visit, void *context)
+{
+  for (uint16_t i = 0; i < CLIPBOARD_COUNT; i++) {
+    Clipboard &board = builtin_boards[i];
+    visit(context, i, builtin_board_names[i], board.ring.size(), board.bytes);
+  }
+  unordered_map<uint16_t, Clipboard>::iterator it;
+  for (it = named_boards.begin(); it != named_boards.end(); it++) {
+    Clipboard &board = it->second;
+    visit(context, it->first, board.name.c_str(), board.ring.size(), board.bytes);
   }
-  return new_item_id;
 }
-const char *store_sender_for_item(uint16_t clipboard_id, uint16_t item_id){
-  int index = ring_index(clipboard_id, item_id);
-  if (index < 0) {
-    fprintf(stderr, "No such item: %u, %u\n", clipboard_id, item_id);
-    return NULL;
+
+int store_drop_idle_boards(time_t idle_seconds, store_board_handler dropped, void *context)
+{
+  time_t now = time(NULL);
+  int count = 0;
+  unordered_map<uint16_t, Clipboard>::iterator it = named_boards.begin();
+  while (it != named_boards.end()) {
+    if (now - it->second.last_used < idle_seconds) {
+      it++;
+      continue;
+    }
+    uint16_t clipboard_id = it->first;
+    while (!it->second.ring.empty()) {
+      evict_oldest(clipboard_id);
+    }
+    board_ids.erase(it->second.name);
+    it = named_boards.erase(it);
+    if (dropped) {
+      dropped(context, clipboard_id);
+    }
+    count++;
   }
-  return store[clipboard_id].ring[index].sender.c_str();
+  return count;
 }
 
-const char *store_label_for_item(uint16_t clipboard_id, uint16_t item_id){
-    int index = ring_index(clipboard_id, item_id);
-  if (index < 0) {
-    fprintf(stderr, "No such item: %u, %u\n", clipboard_id, item_id);
-    return NULL;
+#pragma mark Journal
+
+// Restored items have no sender: whoever created them is gone
+static void restore_item(void *context, uint16_t clipboard_id, uint16_t item_id, const char *label,
+			 char **typelist)
+{
+  if (clipboard_id >= CLIPBOARD_COUNT || item_id == 0 || item_id > INT16_MAX) {
+    return;
   }
-  return store[clipboard_id].ring[index].label.c_str();
+  push_item(clipboard_id, item_id, label, "", typelist, NULL, NULL);
 }
 
-int store_store_data(uint16_t clipboard_id, uint16_t item_id, const char *type, size_t datalen, const unsigned char *data)
+// The data stays in the journal; it is mapped, and checked, when someone
+// reads it
+static void restore_data(void *context, uint16_t clipboard_id, uint16_t item_id, const char *type,
+			 uint64_t offset, uint64_t datalen, const uint32_t *checksum)
 {
-  string key = type;
+  if (clipboard_id >= CLIPBOARD_COUNT || item_id == 0) {
+    return;
+  }
   int index = ring_index(clipboard_id, item_id);
   if (index < 0) {
-    return 0;
+    return;
+  }
+  shared_ptr<SharedFile> *file = (shared_ptr<SharedFile> *)context;
+  uint32_t atom = store_atom_for_type(type);
+  if (atom == 0) {
+    return;
+  }
+  Payload *payload = Payload::on_disk(*file, offset, datalen);
+  if (checksum) {
+    payload->expect_checksum(*checksum);
   }
+  cache_payload(clipboard_id, index, atom, payload, RESTORED);
+}
 
-  Buffer buf(datalen, data, false);
-  store[clipboard_id].ring[index].data_cache.insert(std::make_pair(key, buf));
-  return 1;
+// Data living in the old journal, and where it is going in the new one
+class Relocation {
+public:
+  uint16_t clipboard_id;
+  uint16_t item_id;
+  uint32_t atom;
+  // Holds a reference, so it can't be mistaken for a later payload
+  Payload *payload;
+  uint64_t offset;
+};
+
+static vector<Relocation> relocations;
+static uint64_t size_before_rewrite = 0;
+
+// Waits for what the rewrite has queued, then throws it away
+static void drop_rewrite()
+{
+  journal_flush(rewriting);
+  journal_reap(rewriting, release_journaled, NULL);
+  journal_abort_rewrite(rewriting);
+  rewriting = NULL;
+  for (size_t i = 0; i < relocations.size(); i++) {
+    relocations[i].payload->release();
+  }
+  relocations.clear();
 }
 
-int store_fetch_data(uint16_t clipboard_id, uint16_t item_id, char *type, size_t *datalenptr, unsigned char **dataptr)
+int store_open_journal(const char *path)
 {
-  string key = type;
-  int index = ring_index(clipboard_id, item_id);
-  if (index < 0) {
+  Journal *opened = journal_open(path, open_journaled, close_journaled);
+  if (opened == NULL) {
     return -1;
   }
 
-  // Is it missing?
-  if(store[clipboard_id].ring[index].data_cache.count(key) < 1) {
+  // Restored payloads share one descriptor of their own, so they stay
+  // readable until compaction moves them into the new file
+  int fd = dup(journal_fd(opened));
+  if (fd < 0) {
+    journal_close(opened);
     return -1;
   }
-  
-  Buffer b = store[clipboard_id].ring[index].data_cache[key];
-  if (dataptr) {
-    *dataptr = (unsigned char *)malloc(b.length);
-    memcpy(*dataptr, b.data, b.length);
+  shared_ptr<SharedFile> file = make_shared<SharedFile>(fd);
+  int count = journal_replay(opened, restore_item, restore_data, &file);
+  if (count < 0) {
+    journal_close(opened);
+    return -1;
   }
 
-  if (datalenptr) {
-    *datalenptr = b.length;
+  if (rewriting) {
+    drop_rewrite();
   }
-  return 1;  
+  if (journal) {
+    journal_flush(journal);
+    reap_journals();
+    journal_close(journal);
+  }
+  journal = opened;
+  journal_file = file;
+  return count;
 }
-char **store_typelist(uint16_t clipboard_id, uint16_t item_id)
+
+static uint64_t live_bytes()
 {
-  int index = ring_index(clipboard_id, item_id);
-  if (index < 0) {
-    return NULL;
+  uint64_t total = 0;
+  for (int i = 0; i < CLIPBOARD_COUNT; i++) {
+    total += builtin_boards[i].bytes;
   }
+  return total;
+}
 
-  vector<string>types = store[clipboard_id].ring[index].declared_types;
-  int type_count = types.size();
-  char **result = (char **)malloc(sizeof(char *) * (type_count + 1));
-  for (int i = 0; i < types.size(); i++) {
-    result[i] = strdup(types[i].c_str());
+// Items oldest first, each followed by its data. Converted data is left
+// out, as it is from the journal itself.
+static int rewrite_board(Journal *rewritten, uint16_t clipboard_id)
+{
+  Clipboard &board = builtin_boards[clipboard_id];
+  for (int index = (int)board.ring.size() - 1; index >= 0; index--) {
+    ClipItem &item = board.ring[index];
+    uint16_t item_id = item_id_at_index(clipboard_id, index);
+
+    vector<char *> typelist;
+    for (size_t i = 0; i < item.declared_count; i++) {
+      typelist.push_back((char *)store_type_for_atom(item.atoms[i]));
+    }
+    typelist.push_back(NULL);
+    if (journal_append_item(rewritten, clipboard_id, item_id, item.label.c_str(), &typelist[0]) < 0) {
+      return -1;
+    }
+
+    for (size_t slot = 0; slot < item.payloads.size(); slot++) {
+      Payload *payload = item.payloads[slot].payload;
+      if (payload == NULL || item.payloads[slot].derived) {
+	continue;
+      }
+      uint64_t offset;
+      if (journal_append_data(rewritten, clipboard_id, item_id, store_type_for_atom(item.atoms[slot]),
+			      payload->length, payload->retain(), &offset) < 0) {
+	payload->release();
+	return -1;
+      }
+      if (payload->backing == Payload::ON_DISK && payload->file == journal_file) {
+	Relocation relocation = {clipboard_id, item_id, item.atoms[slot], payload->retain(), offset};
+	relocations.push_back(relocation);
+      }
+    }
   }
-  result[type_count] = NULL;
-  return result;
+  return 1;
 }
 
-char **store_types_without_data(uint16_t clipboard_id, uint16_t item_id)
+// Once the new journal is written out, it replaces the old one
+static void finish_rewrite()
 {
-  int index = ring_index(clipboard_id, item_id);
-  if (index < 0) {
-    return NULL;
+  if (journal_pending(rewriting) > 0 || journal_pending(journal) > 0) {
+    return;
+  }
+  reap_journals();
+  int fd = dup(journal_fd(rewriting));
+  if (fd < 0) {
+    drop_rewrite();
+    return;
   }
+  shared_ptr<SharedFile> file = make_shared<SharedFile>(fd);
+  Journal *rewritten = rewriting;
+  rewriting = NULL;
+  if (journal_commit_rewrite(journal, rewritten) < 0) {
+    for (size_t i = 0; i < relocations.size(); i++) {
+      relocations[i].payload->release();
+    }
+    relocations.clear();
+    return;
+  }
+  journal = rewritten;
 
-  vector<string> types = store[clipboard_id].ring[index].declared_types;
-  
-  int type_count = types.size();
-  vector<string> dataless_types;
+  // Point restored data that is still on its item at the new file, so
+  // the old one can go once its readers are done
+  for (size_t i = 0; i < relocations.size(); i++) {
+    Relocation &relocation = relocations[i];
+    int index = ring_index(relocation.clipboard_id, relocation.item_id);
+    ClipItem *item = index < 0 ? NULL : &builtin_boards[relocation.clipboard_id].ring[index];
+    int slot = item ? item->slot_of(relocation.atom) : -1;
+    if (slot >= 0 && item->payloads[slot].payload == relocation.payload) {
+      Payload *moved = Payload::on_disk(file, relocation.offset, relocation.payload->length);
+      if (relocation.payload->checksummed) {
+	moved->expect_checksum(relocation.payload->checksum);
+      }
+      item->payloads[slot] = PayloadRef(moved);
+    }
+    relocation.payload->release();
+  }
+  relocations.clear();
+  journal_file = file;
+  fprintf(stderr, "Compacted journal from %llu to %llu bytes\n",
+	  (unsigned long long)size_before_rewrite, (unsigned long long)journal_size(journal));
+}
 
-  for (int i = 0; i < type_count; i++) {
-    string key = types[i];
-    if (store[clipboard_id].ring[index].data_cache.count(key) == 0) {
-      dataless_types.push_back(key);
+void store_compact_journal()
+{
+  if (journal == NULL) {
+    return;
+  }
+  reap_journals();
+  if (rewriting) {
+    finish_rewrite();
+    return;
+  }
+  uint64_t size = journal_size(journal);
+  if (size < JOURNAL_COMPACT_MIN || size < 2 * live_bytes()) {
+    return;
+  }
+
+  // Only queued here: the journal's thread writes it while we carry on,
+  // and a later call finishes it
+  rewriting = journal_begin_rewrite(journal);
+  if (rewriting == NULL) {
+    return;
+  }
+  size_before_rewrite = size;
+  for (uint16_t clipboard_id = 0; clipboard_id < CLIPBOARD_COUNT; clipboard_id++) {
+    if (rewrite_board(rewriting, clipboard_id) < 0) {
+      drop_rewrite();
+      return;
     }
   }
+}
 
-  int result_count = dataless_types.size(); 
-  char **result = (char **)malloc(sizeof(char *) * (result_count + 1));
-  for (int i = 0; i < result_count; i++) {
-    const char *current_type = dataless_types[i].c_str(); 
-    result[i] = strdup(current_type);
+void store_get_memory_stats(struct store_memory_stats *stats)
+{
+  uint64_t logical = 0;
+  for (int i = 0; i < CLIPBOARD_COUNT; i++) {
+    logical += builtin_boards[i].bytes;
   }
-  result[result_count] = NULL;
-  return result;
-}  
+  unordered_map<uint16_t, Clipboard>::iterator it;
+  for (it = named_boards.begin(); it != named_boards.end(); it++) {
+    logical += it->second.bytes;
+  }
+  stats->logical_bytes = logical;
+  stats->stored_bytes = stored_bytes;
+  stats->payload_count = payload_count;
+  stats->dedup_hits = dedup_hits;
+  stats->idle_page_bytes = pages_idle_bytes();
+  stats->evictions = evictions;
+  stats->search_entries = search_index_entries();
+  for (int i = 0; i < STORE_SIZE_BUCKETS; i++) {
+    stats->payload_sizes[i] = payload_sizes[i];
+  }
+}
+
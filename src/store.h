@@ -2,11 +2,103 @@
 #define STORE_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <time.h>
 // item_ids are never 0.
 
+// Besides the built-in boards (which are also called "general", "find",
+// "style" and "drag"), boards are made on demand by name. A new board
+// gets these ring settings; one that exists keeps its own. Named boards
+// only last a session: they aren't journaled.
+// Returns the board's id, -1 if unsuccessful
+int store_open_board(const char *name, uint16_t max_items, size_t max_bytes);
+
+// You don't own the returned string -- don't free it
+// Returns NULL if there is no such board
+const char *store_board_name(uint16_t clipboard_id);
+
+// How many boards are there, built-in ones included?
+size_t store_board_count();
+
+// Visit every board, the built-in ones first
+// void visit_board(void *context, uint16_t clipboard_id, const char *name,
+//                  uint16_t item_count, size_t bytes)
+typedef void (*store_board_visitor)(void *, uint16_t, const char *, uint16_t, size_t);
+void store_visit_boards(store_board_visitor visit, void *context);
+
+// Drop the named boards nobody has used for idle_seconds, with their
+// items (the eviction handler hears of each). Built-in boards stay.
+// void handle_dropped_board(void *context, uint16_t clipboard_id)
+typedef void (*store_board_handler)(void *, uint16_t);
+// Returns how many boards were dropped
+int store_drop_idle_boards(time_t idle_seconds, store_board_handler dropped, void *context);
+
 // Done at start up to set the number of items that can live on a clipboard
 void store_set_ring_size(uint16_t clipboard_id, uint16_t max_items);
 
+// Done at start up to limit the bytes of data a clipboard holds.
+// Once it holds more, the oldest items are pushed out, but the newest item
+// always stays. 0 means no limit.
+void store_set_ring_budget(uint16_t clipboard_id, size_t max_bytes);
+
+// How many bytes of data are held for the items on the clipboard?
+size_t store_byte_count(uint16_t clipboard_id);
+
+// Done at start up: data of at least threshold bytes is kept in unlinked
+// files in dir (created if needed) and only mapped while being read.
+// A NULL dir keeps everything in memory.
+void store_set_spill(const char *dir, size_t threshold);
+
+// Done at start up: data of at least threshold bytes is held as LZ4
+// blocks when that saves memory, and decompressed only while being read.
+// Data that doesn't compress, or would still be big enough to spill, is
+// held as usual. 0 turns compression off.
+void store_set_compression(size_t threshold);
+
+// Called for every item that falls off a ring, whether it was pushed out
+// by a new item or by the byte budget.
+// You don't own the sender -- don't free it
+// void handle_eviction(uint16_t clipboard_id, uint16_t item_id, const char *sender)
+typedef void (*store_eviction_handler)(uint16_t, uint16_t, const char *);
+void store_set_eviction_handler(store_eviction_handler handler);
+
+// Done at start up: restore the rings from the journal at path (creating
+// it if needed), then record every new item and all new data in it.
+// Restored data stays in the journal until someone reads it.
+// Returns how many records were restored, -1 if the journal can't be used
+int store_open_journal(const char *path);
+
+// Rewrite the journal without the items that have been pushed out, if it
+// has grown to more than twice the data the rings hold. Call it when idle:
+// the rewrite is written in the background, and a later call swaps it in.
+void store_compact_journal();
+
+// Live payloads are counted by size: bucket i holds those of i bits, that
+// is under 2^i bytes and at least half that. The last bucket also holds
+// any bigger.
+#define STORE_SIZE_BUCKETS (32)
+
+// Identical data is held once, however many items, types or clipboards
+// it was copied to
+struct store_memory_stats {
+  // What the rings would hold if nothing were shared
+  uint64_t logical_bytes;
+  // What is actually held, counting shared data once (this includes data
+  // still being read after its item was pushed out)
+  uint64_t stored_bytes;
+  uint64_t payload_count;
+  // How many times new data turned out to be already held
+  uint64_t dedup_hits;
+  // Address space kept from freed payloads for new ones (not resident)
+  uint64_t idle_page_bytes;
+  // Items pushed out since start up
+  uint64_t evictions;
+  // Text-trigram pairs in the search index
+  uint64_t search_entries;
+  uint64_t payload_sizes[STORE_SIZE_BUCKETS];
+};
+void store_get_memory_stats(struct store_memory_stats *stats);
+
 // What is the id of the last item added? 0 if there are no items
 uint16_t store_last_item_id(uint16_t clipboard_id);
 
@@ -27,21 +119,173 @@ int
 store_store_data(uint16_t clipboard_id, uint16_t item_id, const char *type, size_t datalen,
 		 const unsigned char *data);
 
-// Get data for this clipboard/item/type
+// Hold the contents of a sealed memfd for this clipboard/item/type
+// The store maps its own duplicate of fd -- the caller still owns fd
+// Returns -1 if unsuccessful
+int
+store_store_fd(uint16_t clipboard_id, uint16_t item_id, const char *type, int fd);
+
+// store_store_data in two steps, so the slow part can run on another
+// thread. store_prepare_data copies (and maybe compresses or spills) the
+// bytes and is safe to call from any thread; store_store_prepared puts
+// them on the item, from the thread that uses the rest of the store.
+class PreparedData;
+// Returns NULL if unsuccessful
+PreparedData *store_prepare_data(size_t datalen, const unsigned char *data);
+// Takes prepared, whatever happens
+// Returns -1 if unsuccessful, 0 if the item is gone
+int store_store_prepared(uint16_t clipboard_id, uint16_t item_id, const char *type,
+			 PreparedData *prepared);
+// For prepared data that won't be stored after all. NULL is fine.
+void store_discard_prepared(PreparedData *prepared);
+
+// Data too big for one message arrives in chunks. Begin an upload, append
+// to it as often as needed, then commit it to put the data on the item.
+// Only the sender that began an upload may append to, commit or abort it.
+
+// Returns the id of the new upload, 0 if unsuccessful
+uint32_t
+store_begin_upload(uint16_t clipboard_id, uint16_t item_id, const char *type, const char *sender);
+
+// Returns -1 if unsuccessful, e.g. if the upload would grow past its
+// board's byte budget
+int
+store_append_upload(uint32_t upload_id, const char *sender, size_t datalen, const unsigned char *data);
+
+// The upload is finished either way
+// Returns -1 if unsuccessful (e.g. the item was pushed out meanwhile)
+int store_commit_upload(uint32_t upload_id, const char *sender);
+void store_abort_upload(uint32_t upload_id, const char *sender);
+// The sender is gone, so nobody can finish its uploads. Uploads are
+// also dropped when their item is pushed out.
+void store_abort_uploads_of(const char *sender);
+
+// Data held by the store is immutable and reference counted
+class Payload;
+
+// Borrow the data for this clipboard/item/type without copying it.
+// The bytes stay valid until you call store_payload_release, even if
+// the item is pushed out of the ring in the meantime.
+// Returns NULL if there is no such data
+const Payload *store_retain_data(uint16_t clipboard_id, uint16_t item_id, const char *type);
+const unsigned char *store_payload_bytes(const Payload *payload);
+size_t store_payload_length(const Payload *payload);
+void store_payload_release(const Payload *payload);
+
+// Like store_retain_data, but without reading the bytes in yet: call
+// store_payload_open exactly once, from any thread, before using the
+// bytes or releasing the payload. Releasing stays on the store's thread.
+const Payload *store_retain_payload(uint16_t clipboard_id, uint16_t item_id, const char *type);
+// Returns NULL if the data can't be read
+const unsigned char *store_payload_open(const Payload *payload);
+// Instead of opening it, copy length bytes from offset into out, from
+// any thread. Only the part of compressed or on-disk data that covers the
+// range is decompressed or read, so a preview of big data stays cheap.
+// Release the payload with store_payload_discard after.
+// Returns -1 if the range is out of bounds or the data can't be read
+int store_payload_read(const Payload *payload, uint64_t offset, size_t length, unsigned char *out);
+// Release a payload that was never opened
+void store_payload_discard(const Payload *payload);
+// Like store_retain_payload, for the type with this atom
+const Payload *store_retain_payload_for_atom(uint16_t clipboard_id, uint16_t item_id, uint32_t atom);
+
+// Get a copy of the data for this clipboard/item/type
+// Receiver should free *dataptr; pass NULL for just the length
 int store_fetch_data(uint16_t clipboard_id, uint16_t item_id, char *type, size_t *datalenptr, unsigned char **dataptr);
 
+// Get a copy of the data for this clipboard/item/type in the compressed
+// form the store holds it in: a frame of LZ4 blocks (see clip_lz4.h)
+// that decompresses to *rawlenptr bytes
+// Receiver should free *frameptr
+// Returns 0 if the data isn't held compressed, -1 if there is no such data
+int store_fetch_compressed(uint16_t clipboard_id, uint16_t item_id, const char *type,
+			   size_t *rawlenptr, size_t *framelenptr, unsigned char **frameptr);
+
+// The compressed frame of a payload held compressed, NULL otherwise. It
+// never changes, so it can be read from any thread while the payload is
+// retained.
+const unsigned char *store_payload_frame(const Payload *payload, size_t *framelenptr);
+
+// Get a sealed memfd holding the data for this clipboard/item/type
+// Data that arrived as bytes is moved into a memfd on first request;
+// spilled or compressed data gets a memfd of its own each time
+// You own the returned fd -- close it when you are done
+// Returns -1 if unsuccessful
+int store_fetch_fd(uint16_t clipboard_id, uint16_t item_id, char *type, int *fdptr);
+
 // Look up who created the item (You don't own the returned string -- don't free it)
 const char *store_sender_for_item(uint16_t clipboard_id, uint16_t item_id);
 
 // Get a label for the item (You don't own the returned string -- don't free it)
 const char *store_label_for_item(uint16_t clipboard_id, uint16_t item_id);
 
+// Walk the items from first_item_id to last_item_id in one pass, oldest
+// first. 0 means from the oldest item, or up to the newest item. The
+// visitor gets each item's types, and for each type the data held for
+// it, if there is any, it is no bigger than max_inline, and it fits in
+// what is left of max_total for the whole walk (NULL otherwise). Data
+// that doesn't fit is never opened. Everything passed is only valid
+// during the call.
+// void visit_item(void *context, uint16_t item_id, const char *label, const char *sender,
+//                 char **typelist, const Payload **payloads)
+typedef void (*store_item_visitor)(void *, uint16_t, const char *, const char *, char **,
+				   const Payload **);
+// Returns the number of items visited, -1 if there is no such clipboard
+int store_visit_items(uint16_t clipboard_id, uint16_t first_item_id, uint16_t last_item_id,
+		      size_t max_inline, size_t max_total, store_item_visitor visit, void *context);
+
 // What is the typelist for this clipboard/item?
 // Returns NULL if nonexistent
 // Receiver should free result
 char **store_typelist(uint16_t clipboard_id, uint16_t item_id);
 
+// The item's declared types as atoms, in order, without copying anything
+// *atomsptr is only valid until the item changes
+// Returns the number of types, -1 if nonexistent
+int store_item_atoms(uint16_t clipboard_id, uint16_t item_id, const uint32_t **atomsptr);
+
 // What types were promised, but not yet fulfilled?
 char **store_types_without_data(uint16_t clipboard_id, uint16_t item_id);
 
+// Was this type promised for this clipboard/item, but not yet fulfilled?
+// Returns 1 if so, 0 otherwise (including when there is no such item)
+int store_is_promised(uint16_t clipboard_id, uint16_t item_id, const char *type);
+
+// If the item has no data for type, but has data that converts to it
+// (see convert.h), convert that and hold the result on the item. It
+// counts against the board's budget like pushed data, and stands in for
+// data that was promised but never pushed.
+// Returns 1 if the item has data for type now, 0 otherwise
+int store_convert_data(uint16_t clipboard_id, uint16_t item_id, const char *type);
+
+// Find the items whose text holds query, ignoring ASCII case, newest
+// first, and stop after limit of them (0 means no limit). Text is data of
+// public.utf8-plain-text, public.url or public.file-url; only the first
+// 256 KB of each is searched. An index of the text's trigrams, kept up
+// as data arrives and items are pushed out, rules out most items without
+// reading them. The visitor gets each item once, with the type that
+// matched and about SEARCH_SNIPPET bytes of text around the match as one
+// line. Everything passed is only valid during the call.
+// void visit_match(void *context, uint16_t item_id, const char *type, const char *snippet)
+typedef void (*store_match_visitor)(void *, uint16_t, const char *, const char *);
+#define SEARCH_SNIPPET (80)
+// Returns the number of items visited, -1 if there is no such clipboard
+int store_search(uint16_t clipboard_id, const char *query, size_t limit,
+		 store_match_visitor visit, void *context);
+
+// Every type is interned as an atom: a small number that stands for it
+// for the life of the process. 0 stands for no type.
+// Returns 0 if there are too many types already
+uint32_t store_atom_for_type(const char *type);
+
+// Like store_atom_for_type, but returns 0 for a type never interned
+uint32_t store_find_atom(const char *type);
+
+// Returns NULL for an atom that wasn't handed out
+// (You don't own the returned string -- don't free it)
+const char *store_type_for_atom(uint32_t atom);
+
+// How many types have been interned
+size_t store_atom_count();
+
 #endif
@@ -0,0 +1,119 @@
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "workers.h"
+
+using namespace std;
+
+class Job {
+public:
+  worker_fn work;
+  worker_fn finish;
+  void *job;
+};
+
+class Pool {
+public:
+  mutex lock;
+  condition_variable ready;
+  // Waiting for a worker
+  deque<Job> queued;
+  // Worked on, waiting for workers_dispatch
+  deque<Job> finished;
+  // Counts finished jobs, so the bus thread can poll it
+  int finished_fd;
+};
+
+// Workers run until the process exits, so the pool is never freed:
+// destroying a condition variable with threads waiting on it would hang
+// the exit
+static Pool *pool = NULL;
+
+static void work_loop()
+{
+  for (;;) {
+    Job job;
+    {
+      unique_lock<mutex> guard(pool->lock);
+      pool->ready.wait(guard, [] { return !pool->queued.empty(); });
+      job = pool->queued.front();
+      pool->queued.pop_front();
+    }
+
+    job.work(job.job);
+
+    {
+      lock_guard<mutex> guard(pool->lock);
+      pool->finished.push_back(job);
+    }
+    uint64_t one = 1;
+    if (write(pool->finished_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      fprintf(stderr, "Unable to signal a finished job: %s\n", strerror(errno));
+    }
+  }
+}
+
+int workers_start(unsigned count)
+{
+  int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (fd < 0) {
+    fprintf(stderr, "Unable to create eventfd: %s\n", strerror(errno));
+    return -1;
+  }
+  pool = new Pool;
+  pool->finished_fd = fd;
+  for (unsigned i = 0; i < count; i++) {
+    thread(work_loop).detach();
+  }
+  return 0;
+}
+
+int workers_submit(worker_fn work, worker_fn finish, void *job)
+{
+  if (pool == NULL) {
+    return -1;
+  }
+  Job queued_job;
+  queued_job.work = work;
+  queued_job.finish = finish;
+  queued_job.job = job;
+  {
+    lock_guard<mutex> guard(pool->lock);
+    pool->queued.push_back(queued_job);
+  }
+  pool->ready.notify_one();
+  return 0;
+}
+
+int workers_fd()
+{
+  return pool ? pool->finished_fd : -1;
+}
+
+void workers_dispatch()
+{
+  if (pool == NULL) {
+    return;
+  }
+  uint64_t count;
+  if (read(pool->finished_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+    fprintf(stderr, "Unable to read finished jobs: %s\n", strerror(errno));
+  }
+
+  deque<Job> ready;
+  {
+    lock_guard<mutex> guard(pool->lock);
+    ready.swap(pool->finished);
+  }
+  for (deque<Job>::iterator it = ready.begin(); it != ready.end(); it++) {
+    it->finish(it->job);
+  }
+}
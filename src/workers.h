@@ -0,0 +1,26 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+// A few threads for work too slow to do between two bus messages, like
+// copying or decompressing a big payload. Each job's work runs on a worker
+// and its finish runs afterwards on the bus thread, from workers_dispatch,
+// so sd-bus and the rings are only ever touched by the bus thread.
+
+// void work(void *job)
+typedef void (*worker_fn)(void *);
+
+// Done at start up
+// Returns -1 if unsuccessful
+int workers_start(unsigned count);
+
+// Returns -1 if the job can't be queued (e.g. there are no workers): then
+// neither work nor finish will be called
+int workers_submit(worker_fn work, worker_fn finish, void *job);
+
+// Readable while finished jobs wait for workers_dispatch
+int workers_fd();
+
+// Run finish for every job whose work is done
+void workers_dispatch();
+
+#endif
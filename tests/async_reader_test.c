@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <systemd/sd-bus.h>
+#include "clipboard.h"
+
+// Does what reader_test does, but from a poll loop like a GUI's main loop
+
+static int done = 0;
+
+void on_data(int status, const unsigned char *bytes, size_t datalen, void *userdata)
+{
+  uint16_t item_id = *(uint16_t *)userdata;
+  if (status < 0) {
+    fprintf(stderr, "Failed to fetch data for %u:%s\n", item_id, CLIPBOARD_TYPE_TEXT);
+  } else {
+    char *str = clip_string_from_data((unsigned char *)bytes, datalen);
+    fprintf(stderr, "Fetched %lu bytes:\"%s\"\n", datalen, str);
+    free(str);
+  }
+  done = 1;
+}
+
+void on_typelist(int status, char **typelist, void *userdata)
+{
+  uint16_t item_id = *(uint16_t *)userdata;
+  if (status < 0) {
+    fprintf(stderr, "clip_item_typelist_async failed\n");
+    done = 1;
+    return;
+  }
+
+  fprintf(stderr, "Available types for %u:\n", item_id);
+  for (char **current_type = typelist; *current_type; current_type++) {
+    fprintf(stderr, "\t%s\n", *current_type);
+  }
+  clip_free_typelist(typelist);
+
+  clip_item_data_for_type_async(CLIPBOARD_GENERAL, item_id, CLIPBOARD_TYPE_TEXT, on_data, userdata);
+}
+
+void on_count(int status, uint16_t last_item_id, uint16_t item_count, void *userdata)
+{
+  if (status < 0 || last_item_id == 0) {
+    fprintf(stderr, "No data on the clipboard\n");
+    done = 1;
+    return;
+  }
+  fprintf(stderr, "clip_item_count_async: last item id = %u, count = %u\n", last_item_id, item_count);
+
+  uint16_t *item_id = (uint16_t *)userdata;
+  *item_id = last_item_id;
+  clip_item_typelist_async(CLIPBOARD_GENERAL, last_item_id, on_typelist, item_id);
+}
+
+int main(int argc, char *argv[]) {
+  static uint16_t item_id;
+  if (clip_item_count_async(CLIPBOARD_GENERAL, on_count, &item_id) < 0) {
+    fprintf(stderr, "clip_item_count_async failed\n");
+    return 1;
+  }
+
+  while (!done) {
+    struct pollfd pfd;
+    pfd.fd = clip_get_fd();
+    pfd.events = clip_get_events();
+    if (poll(&pfd, 1, clip_get_timeout()) < 0) {
+      return 1;
+    }
+    // A real main loop would draw a frame here
+    if (clip_process() < 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
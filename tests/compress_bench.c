@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+
+#include "clip_lz4.h"
+
+// Compression ratio and speed of the codec clipd uses, on data like what
+// gets copied: text, markup, raw pixels and already-compressed bytes
+
+#define CORPUS_SIZE (16 * 1024 * 1024)
+#define ROUNDS (5)
+
+static uint32_t seed = 12345;
+
+static uint32_t next_random()
+{
+  seed = seed * 1103515245u + 12345u;
+  return seed >> 8;
+}
+
+// Prose-like text from a small vocabulary
+static void make_text(unsigned char *buf, size_t len)
+{
+  static const char *words[] = {
+    "the", "clipboard", "daemon", "holds", "data", "for", "each", "item", "and",
+    "type", "until", "it", "is", "pushed", "out", "of", "ring", "a", "reader",
+    "fetches", "bytes", "over", "bus", "when", "user", "pastes", "into", "window"
+  };
+  size_t nwords = sizeof(words) / sizeof(words[0]);
+  size_t i = 0;
+  while (i < len) {
+    const char *word = words[next_random() % nwords];
+    for (size_t j = 0; word[j] && i < len; j++) {
+      buf[i++] = word[j];
+    }
+    if (i < len) {
+      buf[i++] = next_random() % 12 == 0 ? '\n' : ' ';
+    }
+  }
+}
+
+// Rows of HTML with varying numbers, like a copied table
+static void make_markup(unsigned char *buf, size_t len)
+{
+  size_t i = 0;
+  char row[128];
+  while (i < len) {
+    int n = snprintf(row, sizeof(row), "<tr><td class=\"cell\">%u</td><td>%u.%02u</td></tr>\n",
+		     next_random() % 100000, next_random() % 1000, next_random() % 100);
+    for (int j = 0; j < n && i < len; j++) {
+      buf[i++] = row[j];
+    }
+  }
+}
+
+// RGBA pixels of a screenshot: flat areas and gradients
+static void make_pixels(unsigned char *buf, size_t len)
+{
+  for (size_t i = 0; i + 4 <= len; i += 4) {
+    size_t pixel = i / 4;
+    size_t x = pixel % 1920;
+    size_t y = pixel / 1920;
+    buf[i] = (y / 64) % 2 ? 0xff : (unsigned char)(x / 8);
+    buf[i + 1] = (unsigned char)(y / 4);
+    buf[i + 2] = 0xf0;
+    buf[i + 3] = 0xff;
+  }
+}
+
+// Stands in for PNG, JPEG or zip data
+static void make_random(unsigned char *buf, size_t len)
+{
+  for (size_t i = 0; i < len; i++) {
+    buf[i] = (unsigned char)next_random();
+  }
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const char *name, void (*make)(unsigned char *, size_t))
+{
+  unsigned char *raw = (unsigned char *)malloc(CORPUS_SIZE);
+  unsigned char *frame = (unsigned char *)malloc(clip_lz4_frame_bound(CORPUS_SIZE));
+  unsigned char *decoded = (unsigned char *)malloc(CORPUS_SIZE);
+  assert(raw && frame && decoded);
+  make(raw, CORPUS_SIZE);
+
+  size_t framelen = 0;
+  double start = now();
+  for (int i = 0; i < ROUNDS; i++) {
+    framelen = clip_lz4_frame_encode(raw, CORPUS_SIZE, frame);
+  }
+  double compress_time = (now() - start) / ROUNDS;
+
+  start = now();
+  for (int i = 0; i < ROUNDS; i++) {
+    assert(clip_lz4_frame_decode(frame, framelen, decoded, CORPUS_SIZE) == 1);
+  }
+  double decompress_time = (now() - start) / ROUNDS;
+  assert(memcmp(raw, decoded, CORPUS_SIZE) == 0);
+
+  double megabytes = CORPUS_SIZE / (1024.0 * 1024.0);
+  printf("%-8s ratio %5.2f  compress %7.1f MB/s  decompress %7.1f MB/s\n", name,
+	 (double)CORPUS_SIZE / framelen, megabytes / compress_time, megabytes / decompress_time);
+
+  free(raw);
+  free(frame);
+  free(decoded);
+}
+
+int main(int argc, char *argv[])
+{
+  bench("text", make_text);
+  bench("markup", make_markup);
+  bench("pixels", make_pixels);
+  bench("random", make_random);
+  return 0;
+}
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <string>
+
+#include "convert.h"
+
+#define PLAIN_TEXT "public.utf8-plain-text"
+
+// Convert and hand back the text
+static std::string convert(const char *from, const char *data, size_t datalen)
+{
+  size_t outlen;
+  unsigned char *out;
+  assert(convert_data(from, PLAIN_TEXT, datalen, (const unsigned char *)data, &outlen, &out) == 0);
+  std::string text((const char *)out, outlen);
+  free(out);
+  return text;
+}
+
+static std::string convert(const char *from, const char *data)
+{
+  return convert(from, data, strlen(data));
+}
+
+int main(int argc, char *argv[]) {
+  const char *const *sources = convert_sources(PLAIN_TEXT);
+  assert(sources != NULL);
+  assert(strcmp(sources[0], "public.utf16-plain-text") == 0);
+  assert(convert_sources("public.png") == NULL);
+  size_t outlen;
+  unsigned char *out;
+  assert(convert_data("public.png", PLAIN_TEXT, 3, (const unsigned char *)"png", &outlen, &out) < 0);
+
+  // The RTF from the README
+  const char *rtf = "{\\rtf1\\ansi{\\fonttbl\\f0\\fswiss Helvetica;}\\f0\\pard\n"
+    "This is some {\\b bold} text that you might want to copy\\par\n}";
+  assert(convert("public.rtf", rtf) == "This is some bold text that you might want to copy\n");
+  // Escapes, Unicode with fallbacks, and groups that aren't text
+  assert(convert("public.rtf", "{\\rtf1{\\*\\generator Writer;}caf\\'e9 \\u8364?\\uc2\\u946 xx"
+		 "\\line{\\info{\\title T}}\\{x\\}\\tab\\u-10179\\u-8704 ??}")
+	 == "caf\xC3\xA9 \xE2\x82\xAC\xCE\xB2\n{x}\t\xF0\x9F\x98\x80");
+  assert(convert("public.rtf", "{\\rtf1 a\\'93b\\'94}") == "a\xE2\x80\x9C" "b\xE2\x80\x9D");
+
+  // Tags, white space, entities and cells
+  const char *html = "<!DOCTYPE html><html><head><title>Not this</title></head>\n"
+    "<body><!--StartFragment--><p>One   <b>two</b>\nthree</p>"
+    "<script>var x = '<p>';</script><p>4 &lt; 5 &amp;&nbsp;&#233;&#x1F600; &bogus;</p>"
+    "<table><tr><td>a</td><td>b</td></tr></table>line<br>break"
+    "<pre>  keep\n  this</pre></body></html>";
+  assert(convert("public.html", html)
+	 == "One two three\n4 < 5 &\xC2\xA0\xC3\xA9\xF0\x9F\x98\x80 &bogus;\na\tb\nline\nbreak\n"
+	 "  keep\n  this");
+
+  // Byte order marks, surrogate pairs, and line endings
+  const char utf16le[] = "\xFF\xFE" "a\0\r\0\n\0" "\x3D\xD8\x00\xDE" "b\0\r\0";
+  assert(convert("public.utf16-plain-text", utf16le, sizeof(utf16le) - 1)
+	 == "a\n\xF0\x9F\x98\x80" "b\n");
+  const char utf16be[] = "\0a\xD8\x3D\0b";
+  assert(convert("public.utf16-external-plain-text", utf16be, sizeof(utf16be) - 1)
+	 == "a\xEF\xBF\xBD" "b");
+
+  // Bytes that aren't UTF-8 don't get through
+  assert(convert("public.html", "ok\xC0\xAF\xFF!") == "ok\xEF\xBF\xBD\xEF\xBF\xBD\xEF\xBF\xBD!");
+  assert(convert("public.html", "") == "");
+
+  printf("convert_test passed\n");
+  return 0;
+}
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string>
+
+#include "journal.h"
+
+static int items_seen = 0;
+static int data_seen = 0;
+static uint64_t last_offset = 0;
+static uint64_t last_datalen = 0;
+static bool last_checked = false;
+static uint32_t last_checksum = 0;
+static int opened = 0;
+static int closed = 0;
+static int reaped = 0;
+
+// Tokens are the data itself, except this one, which can't be read
+static const char unreadable[] = "";
+
+const unsigned char *open_data(void *token)
+{
+  opened++;
+  return token == unreadable ? NULL : (const unsigned char *)token;
+}
+
+void close_data(void *token)
+{
+  closed++;
+}
+
+void reap(void *context, void *token)
+{
+  reaped++;
+}
+
+void visit_item(void *context, uint16_t clipboard_id, uint16_t item_id, const char *label, char **typelist)
+{
+  assert(clipboard_id == 1);
+  assert(item_id == 7);
+  assert(strcmp(label, "Test label") == 0);
+  assert(strcmp(typelist[0], "public.utf8-plain-text") == 0);
+  assert(strcmp(typelist[1], "public.rtf") == 0);
+  assert(typelist[2] == NULL);
+  items_seen++;
+}
+
+void visit_data(void *context, uint16_t clipboard_id, uint16_t item_id, const char *type,
+		uint64_t offset, uint64_t datalen, const uint32_t *checksum)
+{
+  assert(clipboard_id == 1);
+  assert(item_id == 7);
+  assert(strcmp(type, "public.utf8-plain-text") == 0);
+  last_offset = offset;
+  last_datalen = datalen;
+  last_checked = checksum != NULL;
+  last_checksum = checksum ? *checksum : 0;
+  data_seen++;
+}
+
+int main(int argc, char *argv[]) {
+  char dir[] = "/tmp/journal_test.XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  std::string path = std::string(dir) + "/history";
+
+  const char *plain_text = "This is some text that you might want to copy";
+  const char *types[] = {"public.utf8-plain-text", "public.rtf", NULL};
+
+  Journal *journal = journal_open(path.c_str(), open_data, close_data);
+  assert(journal != NULL);
+  assert(journal_append_item(journal, 1, 7, "Test label", (char **)types) == 1);
+  uint64_t offset;
+  assert(journal_append_data(journal, 1, 7, types[0], strlen(plain_text),
+			     (void *)plain_text, &offset) == 1);
+  // Data that can't be read when its turn comes is left out of replay
+  assert(journal_append_data(journal, 1, 7, types[1], 5, (void *)unreadable, NULL) == 1);
+  uint64_t good_size = journal_size(journal);
+
+  // Appends only queue; the tokens come back once written
+  journal_flush(journal);
+  assert(journal_pending(journal) == 0);
+  journal_reap(journal, reap, NULL);
+  assert(reaped == 2);
+  // Every open is closed, even one that failed
+  assert(opened == 2 && closed == 2);
+  journal_close(journal);
+
+  // A crash in the middle of a record leaves a torn tail
+  int fd = open(path.c_str(), O_WRONLY | O_APPEND);
+  assert(fd >= 0);
+  assert(write(fd, "\x4c\x49\x50\x4a torn", 9) == 9);
+  close(fd);
+
+  journal = journal_open(path.c_str(), open_data, close_data);
+  assert(journal != NULL);
+  assert(journal_replay(journal, visit_item, visit_data, NULL) == 3);
+  assert(items_seen == 1);
+  assert(data_seen == 1);
+  assert(last_offset == offset);
+  assert(last_datalen == strlen(plain_text));
+  assert(journal_size(journal) == good_size);
+
+  // The data comes with its checksum
+  assert(last_checked);
+  assert(last_checksum == journal_data_checksum((const unsigned char *)plain_text,
+						strlen(plain_text)));
+
+  // The data can be read where replay said it is
+  char buf[64];
+  assert(pread(journal_fd(journal), buf, last_datalen, last_offset) == (ssize_t)last_datalen);
+  assert(memcmp(buf, plain_text, last_datalen) == 0);
+
+  // A rewrite replaces the journal only when committed
+  Journal *rewritten = journal_begin_rewrite(journal);
+  assert(rewritten != NULL);
+  assert(journal_append_item(rewritten, 1, 7, "Test label", (char **)types) == 1);
+  journal_flush(rewritten);
+  assert(journal_commit_rewrite(journal, rewritten) == 1);
+  journal = rewritten;
+  items_seen = 0;
+  data_seen = 0;
+  assert(journal_replay(journal, visit_item, visit_data, NULL) == 1);
+  assert(items_seen == 1);
+  assert(data_seen == 0);
+  journal_close(journal);
+
+  unlink(path.c_str());
+  rmdir(dir);
+  return 0;
+}
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <systemd/sd-bus.h>
+#include "clipboard.h"
+#include "clip_common.h"
+
+// Small requests have to stay fast while clipd serves a big fetch: this
+// times ItemCount round trips on one connection while another fetches
+// 200 MB. It talks to clipd directly, since the client library would
+// answer ItemCount from its cache.
+
+#define BIG_SIZE (200 * 1024 * 1024)
+#define MAX_SAMPLES (100000)
+#define MIN_SAMPLES (100)
+#define P99_LIMIT_USEC (1000)
+
+static atomic_int fetching = 1;
+static uint64_t fetched = 0;
+
+static uint64_t now_usec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Fetch the whole item in the biggest ranges clipd hands out: one message
+// can't hold 200 MB
+static void *fetch_big(void *arg)
+{
+  uint16_t item_id = *(uint16_t *)arg;
+  sd_bus *bus = NULL;
+  int r = sd_bus_open_user(&bus);
+  if (r < 0) {
+    fprintf(stderr, "Failed to connect to user bus: %s\n", strerror(-r));
+    atomic_store(&fetching, 0);
+    return NULL;
+  }
+
+  uint64_t total = 1;
+  while (fetched < total) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *reply = NULL;
+    r = sd_bus_call_method(bus, CLIP_DESTIN, CLIP_PATH, CLIP_INTERFACE, "FetchRange", &error,
+			   &reply, "qqstu", CLIPBOARD_GENERAL, item_id, CLIPBOARD_TYPE_PNG,
+			   fetched, (uint32_t)CLIP_MAX_CHUNK);
+    const void *chunk;
+    size_t chunklen = 0;
+    if (r >= 0) {
+      r = sd_bus_message_read(reply, "t", &total);
+    }
+    if (r >= 0) {
+      r = sd_bus_message_read_array(reply, 'y', &chunk, &chunklen);
+    }
+    sd_bus_error_free(&error);
+    sd_bus_message_unref(reply);
+    if (r < 0 || chunklen == 0) {
+      fprintf(stderr, "FetchRange failed at %lu\n", fetched);
+      break;
+    }
+    fetched += chunklen;
+  }
+
+  sd_bus_unref(bus);
+  atomic_store(&fetching, 0);
+  return NULL;
+}
+
+static int by_value(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+  // Noise, so that clipd can't compress it
+  unsigned char *big = malloc(BIG_SIZE);
+  if (big == NULL) {
+    fprintf(stderr, "Unable to allocate %d bytes\n", BIG_SIZE);
+    return 1;
+  }
+  uint32_t noise = 2463534242u;
+  for (size_t i = 0; i < BIG_SIZE; i++) {
+    noise ^= noise << 13;
+    noise ^= noise >> 17;
+    noise ^= noise << 5;
+    big[i] = (unsigned char)noise;
+  }
+
+  char **typelist = clip_create_typelist(1, CLIPBOARD_TYPE_PNG);
+  static uint16_t item_id;
+  item_id = clip_create_item(CLIPBOARD_GENERAL, "Latency test", typelist);
+  clip_free_typelist(typelist);
+  if (item_id == 0 || clip_push_data_chunked(CLIPBOARD_GENERAL, item_id, CLIPBOARD_TYPE_PNG,
+					     BIG_SIZE, (const char *)big) < 0) {
+    fprintf(stderr, "Unable to put %d bytes on the clipboard\n", BIG_SIZE);
+    return 1;
+  }
+  free(big);
+
+  sd_bus *bus = NULL;
+  int r = sd_bus_open_user(&bus);
+  if (r < 0) {
+    fprintf(stderr, "Failed to connect to user bus: %s\n", strerror(-r));
+    return 1;
+  }
+
+  pthread_t fetcher;
+  if (pthread_create(&fetcher, NULL, fetch_big, &item_id) != 0) {
+    fprintf(stderr, "Unable to start fetching\n");
+    return 1;
+  }
+
+  uint64_t *samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+  int count = 0;
+  while (atomic_load(&fetching) && count < MAX_SAMPLES) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *reply = NULL;
+    uint64_t start = now_usec();
+    r = sd_bus_call_method(bus, CLIP_DESTIN, CLIP_PATH, CLIP_INTERFACE, "ItemCount", &error,
+			   &reply, "q", CLIPBOARD_GENERAL);
+    samples[count++] = now_usec() - start;
+    sd_bus_error_free(&error);
+    sd_bus_message_unref(reply);
+    if (r < 0) {
+      fprintf(stderr, "ItemCount failed: %s\n", strerror(-r));
+      return 1;
+    }
+  }
+  pthread_join(fetcher, NULL);
+  sd_bus_unref(bus);
+
+  if (fetched != BIG_SIZE) {
+    fprintf(stderr, "Fetched %lu of %d bytes\n", fetched, BIG_SIZE);
+    return 1;
+  }
+  if (count < MIN_SAMPLES) {
+    fprintf(stderr, "The fetch finished after only %d requests\n", count);
+    return 1;
+  }
+
+  qsort(samples, count, sizeof(uint64_t), by_value);
+  uint64_t p50 = samples[count / 2];
+  uint64_t p99 = samples[count * 99 / 100];
+  fprintf(stderr, "%d ItemCount calls during the fetch: p50 %lu us, p99 %lu us, max %lu us\n",
+	  count, p50, p99, samples[count - 1]);
+  free(samples);
+
+  if (p99 >= P99_LIMIT_USEC) {
+    fprintf(stderr, "p99 is over %d us\n", P99_LIMIT_USEC);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+
+extern "C" {
+#include "clip_common.h"
+}
+
+#include "store.h"
+
+// Creating items on, and finding items by id in, rings deep enough that
+// ids start over several times
+
+#define CREATES (1000000)
+#define LOOKUPS (10000000)
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(const char *name, uint16_t depth)
+{
+  int board = store_open_board(name, depth, 0);
+  assert(board >= 0);
+  char **typelist = clip_create_typelist(2, "public.utf8-plain-text", "public.rtf");
+
+  double start = now();
+  for (int i = 0; i < CREATES; i++) {
+    store_create_item(board, "Copied text", ":1.132", typelist, NULL, NULL);
+  }
+  double create_time = now() - start;
+  assert(store_item_count(board) == depth);
+
+  // Ids spread over the whole ring, most of them across a wrap
+  uint16_t newest = store_last_item_id(board);
+  uint32_t seed = 12345;
+  size_t found = 0;
+  start = now();
+  for (int i = 0; i < LOOKUPS; i++) {
+    seed = seed * 1103515245u + 12345u;
+    uint16_t back = (seed >> 8) % depth;
+    uint16_t item_id = (newest - 1 - back + INT16_MAX) % INT16_MAX + 1;
+    found += store_label_for_item(board, item_id) != NULL;
+  }
+  double lookup_time = now() - start;
+  assert(found == LOOKUPS);
+
+  printf("%-6s %5u items  create %6.2f M/s  lookup %7.2f M/s\n", name, depth,
+	 CREATES / create_time / 1e6, LOOKUPS / lookup_time / 1e6);
+  clip_free_typelist(typelist);
+}
+
+int main(int argc, char *argv[])
+{
+  bench("small", 5);
+  bench("deep", 10000);
+  bench("deeper", 30000);
+  return 0;
+}
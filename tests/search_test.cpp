@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "search.h"
+
+static void add(uint16_t board, uint64_t key, const char *text)
+{
+  search_add(board, key, (const unsigned char *)text, strlen(text));
+}
+
+static long find(const char *text, const char *query)
+{
+  return search_find((const unsigned char *)text, strlen(text), query);
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<uint64_t> keys;
+
+  // Only documents with every trigram of the query are candidates
+  add(1, 10, "The quick brown fox");
+  add(1, 20, "jumps over the lazy dog");
+  add(1, 30, "QUICK thinking");
+  add(2, 10, "quick, on another board");
+  assert(search_candidates(1, "quick", keys) == 0);
+  assert(keys.size() == 2 && keys[0] == 10 && keys[1] == 30);
+  assert(search_candidates(1, "the", keys) == 0);
+  assert(keys.size() == 2 && keys[0] == 10 && keys[1] == 20);
+  assert(search_candidates(1, "zebra", keys) == 0 && keys.empty());
+  assert(search_candidates(3, "quick", keys) == 0 && keys.empty());
+  // Too short to rule anything out
+  assert(search_candidates(1, "qu", keys) < 0);
+
+  // Adding a key again replaces its text; removing it leaves nothing
+  size_t entries = search_index_entries();
+  add(1, 30, "slow thinking");
+  assert(search_candidates(1, "quick", keys) == 0 && keys.size() == 1 && keys[0] == 10);
+  search_remove(1, 30);
+  search_remove(1, 30);
+  assert(search_candidates(1, "thinking", keys) == 0 && keys.empty());
+  assert(search_index_entries() < entries);
+  search_remove(1, 10);
+  search_remove(1, 20);
+  search_remove(2, 10);
+  assert(search_index_entries() == 0);
+
+  // Finding ignores ASCII case only
+  assert(find("The quick brown fox", "QUICK") == 4);
+  assert(find("The quick brown fox", "fox") == 16);
+  assert(find("The quick brown fox", "foxes") == -1);
+  assert(find("aaab", "aab") == 1);
+  assert(find("Xx", "xx") == 0);
+  assert(find("\xC3\x89t\xC3\xA9", "\xC3\xA9") == 3);
+  assert(find("ab", "abc") == -1);
+  assert(find("", "") == 0);
+
+  // Snippets are one line of whole characters around the match
+  const char *text = "caf\xC3\xA9\nline two\tand the match is here, then \xE2\x82\xAC more";
+  long offset = find(text, "match");
+  std::string snippet = search_snippet((const unsigned char *)text, strlen(text), offset, 5, 20);
+  assert(snippet.find("match") != std::string::npos);
+  assert(snippet.find('\n') == std::string::npos && snippet.find('\t') == std::string::npos);
+  assert(snippet.size() <= 20);
+  snippet = search_snippet((const unsigned char *)text, strlen(text), 0, 3, 8);
+  assert(snippet == "caf\xC3\xA9");
+  snippet = search_snippet((const unsigned char *)text, strlen(text), 4, 1, 1);
+  assert(snippet == "");
+
+  printf("search_test passed\n");
+  return 0;
+}
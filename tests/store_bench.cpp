@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "clip_common.h"
+}
+
+#include "store.h"
+
+using namespace std;
+
+// The store's calls at a range of ring depths, type counts and payload
+// sizes. Prints one JSON object per run, e.g. for
+//   ./store_bench | jq -s 'group_by(.op)'
+// Rates and latencies only count time spent in the calls themselves.
+// Allocations are the malloc, calloc and realloc calls (including those
+// behind new and strdup) made during the calls; pooled pages aren't.
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *block, size_t size);
+
+static size_t allocations = 0;
+
+void *malloc(size_t size)
+{
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+  allocations++;
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *block, size_t size)
+{
+  allocations++;
+  return __libc_realloc(block, size);
+}
+}
+
+static const uint16_t depths[] = { 5, 100, 5000 };
+static const int type_counts[] = { 1, 4, 16 };
+static const size_t sizes[] = { 16, 4096, 256 * 1024 };
+
+#define BOARD (CLIPBOARD_GENERAL)
+#define BUDGET (256 * 1024 * 1024)
+#define ITEM_OPS (100000)
+// Stores and fetches move about this much data per run
+#define DATA_OPS_BYTES (256 * 1024 * 1024)
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t seed = 12345;
+
+// One of the newest count items, picked at random
+static uint16_t random_item(uint16_t count)
+{
+  seed = seed * 1103515245u + 12345u;
+  uint16_t back = (seed >> 8) % count;
+  return (store_last_item_id(BOARD) - 1 - back + INT16_MAX) % INT16_MAX + 1;
+}
+
+static int random_type(int type_count)
+{
+  seed = seed * 1103515245u + 12345u;
+  return (seed >> 8) % type_count;
+}
+
+// Time ops calls of op, each after an untimed call of prepare
+template <typename Prepare, typename Op>
+static void measure(const char *name, uint16_t depth, int type_count, size_t size, size_t ops,
+		    Prepare prepare, Op op)
+{
+  vector<uint64_t> samples(ops);
+  size_t allocated = 0;
+  uint64_t total = 0;
+  for (size_t i = 0; i < ops; i++) {
+    prepare(i);
+    size_t allocations_before = allocations;
+    uint64_t start = now_ns();
+    op(i);
+    samples[i] = now_ns() - start;
+    allocated += allocations - allocations_before;
+    total += samples[i];
+  }
+
+  sort(samples.begin(), samples.end());
+  double seconds = total / 1e9;
+  printf("{\"op\":\"%s\",\"depth\":%u,\"types\":%d,\"size\":%zu,\"ops\":%zu,"
+	 "\"ops_per_sec\":%.0f,\"bytes_per_sec\":%.0f,\"allocs_per_op\":%.2f,"
+	 "\"p50_ns\":%lu,\"p90_ns\":%lu,\"p99_ns\":%lu,\"max_ns\":%lu}\n",
+	 name, depth, type_count, size, ops, ops / seconds, ops * size / seconds,
+	 (double)allocated / ops, samples[ops / 2], samples[ops * 9 / 10], samples[ops * 99 / 100],
+	 samples[ops - 1]);
+  fflush(stdout);
+}
+
+static void nothing(size_t i)
+{
+}
+
+static void ignore_match(void *context, uint16_t item_id, const char *type, const char *snippet)
+{
+}
+
+static void bench(uint16_t depth, int type_count)
+{
+  store_set_ring_size(BOARD, depth);
+  store_set_ring_budget(BOARD, BUDGET);
+
+  char **typelist = (char **)calloc(type_count + 1, sizeof(char *));
+  for (int i = 0; i < type_count; i++) {
+    char type[64];
+    snprintf(type, sizeof(type), "public.bench-type-%d", i);
+    typelist[i] = strdup(type);
+  }
+
+  measure("create", depth, type_count, 0, ITEM_OPS, nothing, [&](size_t i) {
+    store_create_item(BOARD, "Benchmark item", ":1.132", typelist, NULL, NULL);
+  });
+  assert(store_item_count(BOARD) == depth);
+
+  measure("typelist", depth, type_count, 0, ITEM_OPS, nothing, [&](size_t i) {
+    clip_free_typelist(store_typelist(BOARD, random_item(depth)));
+  });
+
+  // Half the types on every item get data
+  for (uint16_t back = 0; back < depth; back++) {
+    uint16_t item_id = (store_last_item_id(BOARD) - 1 - back + INT16_MAX) % INT16_MAX + 1;
+    for (int i = 0; i < type_count; i += 2) {
+      store_store_data(BOARD, item_id, typelist[i], 1, (const unsigned char *)"x");
+    }
+  }
+  measure("types_without_data", depth, type_count, 0, ITEM_OPS, nothing, [&](size_t i) {
+    clip_free_typelist(store_types_without_data(BOARD, random_item(depth)));
+  });
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size_t size = sizes[s];
+    vector<unsigned char> data(size, 'x');
+
+    // Whole items, so that every item fetched from has all its data. Each
+    // store is of new bytes, or it would only find the ones held already.
+    size_t ops = min<size_t>(max<size_t>(DATA_OPS_BYTES / size, 1000), ITEM_OPS);
+    ops = (ops + type_count - 1) / type_count * type_count;
+    uint16_t item_id = 0;
+    uint64_t serial = 0;
+    measure("store", depth, type_count, size, ops, [&](size_t i) {
+      if (i % type_count == 0) {
+	item_id = store_create_item(BOARD, "Benchmark item", ":1.132", typelist, NULL, NULL);
+      }
+      serial++;
+      memcpy(&data[0], &serial, min(size, sizeof(serial)));
+    }, [&](size_t i) {
+      store_store_data(BOARD, item_id, typelist[i % type_count], size, &data[0]);
+    });
+
+    // Only from the items just stored, which the budget may have cut short
+    uint16_t stored = min<size_t>(store_item_count(BOARD), ops / type_count);
+    measure("fetch", depth, type_count, size, ops, nothing, [&](size_t i) {
+      unsigned char *bytes = NULL;
+      int r = store_fetch_data(BOARD, random_item(stored), typelist[random_type(type_count)], NULL,
+			       &bytes);
+      assert(r == 1);
+      free(bytes);
+    });
+  }
+
+  clip_free_typelist(typelist);
+}
+
+// A ring full of text, searched for a word only one item in fifty has
+static void bench_search(uint16_t depth)
+{
+  store_set_ring_size(BOARD, depth);
+  store_set_ring_budget(BOARD, BUDGET);
+  char **typelist = clip_create_typelist(1, "public.utf8-plain-text");
+  static const char *words[] = { "clip", "board", "copy", "paste", "text", "item", "ring", "data" };
+  for (uint16_t i = 0; i < depth; i++) {
+    string text;
+    while (text.size() < 200) {
+      text += words[random_type(8)];
+      text += ' ';
+    }
+    if (i % 50 == 0) {
+      text += "Needle";
+    }
+    uint16_t item_id = store_create_item(BOARD, "Benchmark item", ":1.132", typelist, NULL, NULL);
+    store_store_data(BOARD, item_id, typelist[0], text.size(), (const unsigned char *)text.data());
+  }
+
+  int matches = 0;
+  measure("search", depth, 1, 0, ITEM_OPS, nothing, [&](size_t i) {
+    matches = store_search(BOARD, "needle", 0, ignore_match, NULL);
+  });
+  assert(matches == (depth + 49) / 50);
+  clip_free_typelist(typelist);
+}
+
+int main(int argc, char *argv[])
+{
+  for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+    for (size_t t = 0; t < sizeof(type_counts) / sizeof(type_counts[0]); t++) {
+      bench(depths[d], type_counts[t]);
+    }
+    bench_search(depths[d]);
+  }
+  return 0;
+}
@@ -2,14 +2,69 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
 
 extern "C" {
 #include "clip_common.h"
 #include "clipboard.h"
+#include "clip_lz4.h"
 }
 
 #include "store.h"
 
+static int eviction_count = 0;
+static int visited_count = 0;
+static int visited_inline = 0;
+static uint16_t last_visited_id = 0;
+
+void on_eviction(uint16_t clipboard_id, uint16_t item_id, const char *sender)
+{
+  eviction_count++;
+}
+
+void on_dropped(void *context, uint16_t clipboard_id)
+{
+  *(uint16_t *)context = clipboard_id;
+}
+
+void on_board(void *context, uint16_t clipboard_id, const char *name, uint16_t item_count,
+	      size_t bytes)
+{
+  if (strcmp(name, "workspace-2") == 0) {
+    assert(item_count == 2);
+    assert(bytes == 4);
+    (*(int *)context)++;
+  }
+}
+
+void on_visit(void *context, uint16_t item_id, const char *label, const char *sender,
+	      char **typelist, const Payload **payloads)
+{
+  // Oldest first
+  assert(last_visited_id == 0 || item_id == last_visited_id + 1);
+  last_visited_id = item_id;
+  assert(strcmp(sender, ":1.132") == 0);
+  for (int i = 0; typelist[i] != NULL; i++) {
+    if (payloads[i]) {
+      assert(store_payload_length(payloads[i]) <= *(size_t *)context);
+      visited_inline++;
+    }
+  }
+  visited_count++;
+}
+
+static uint16_t matched_ids[8];
+static int matched_count = 0;
+
+void on_match(void *context, uint16_t item_id, const char *type, const char *snippet)
+{
+  assert(strcasestr(snippet, (const char *)context));
+  assert(strchr(snippet, '\n') == NULL);
+  matched_ids[matched_count++] = item_id;
+}
+
 int main(int argc, char *argv[]) {
 
   store_set_ring_size(CLIPBOARD_GENERAL, 5);
@@ -52,6 +107,10 @@ int main(int argc, char *argv[]) {
 
   assert(clip_typelists_equal(whole, typelist));
 
+  assert(store_is_promised(CLIPBOARD_GENERAL, item_id, CLIPBOARD_TYPE_RTF));
+  assert(!store_is_promised(CLIPBOARD_GENERAL, item_id, CLIPBOARD_TYPE_TEXT));
+  assert(!store_is_promised(CLIPBOARD_GENERAL, item_id, CLIPBOARD_TYPE_PNG));
+
   char **partial = store_types_without_data(CLIPBOARD_GENERAL, item_id);
   assert(clip_typelist_contains(partial, CLIPBOARD_TYPE_RTF));
   assert(clip_typelist_count(partial) == 1);
@@ -61,6 +120,421 @@ int main(int argc, char *argv[]) {
   char **empty = store_types_without_data(CLIPBOARD_GENERAL, item_id);
   assert(clip_typelist_count(empty) == 0);
 
+  // Each type is interned once, and items hold its atom
+  uint32_t text_atom = store_find_atom(CLIPBOARD_TYPE_TEXT);
+  assert(text_atom != 0);
+  assert(store_atom_for_type(CLIPBOARD_TYPE_TEXT) == text_atom);
+  assert(strcmp(store_type_for_atom(text_atom), CLIPBOARD_TYPE_TEXT) == 0);
+  assert(store_find_atom("com.example.never-used") == 0);
+  assert(store_type_for_atom(0) == NULL);
+  assert(store_type_for_atom(store_atom_count() + 1) == NULL);
+  const uint32_t *atoms;
+  assert(store_item_atoms(CLIPBOARD_GENERAL, item_id, &atoms) == 2);
+  assert(atoms[0] == text_atom);
+  assert(atoms[1] == store_find_atom(CLIPBOARD_TYPE_RTF));
+  assert(store_item_atoms(CLIPBOARD_GENERAL, item_id + 100, &atoms) == -1);
+  const Payload *by_atom = store_retain_payload_for_atom(CLIPBOARD_GENERAL, item_id, text_atom);
+  assert(by_atom != NULL && store_payload_length(by_atom) == strlen(plain_text));
+  store_payload_discard(by_atom);
+
+  // Data for a type that wasn't declared is kept, but not listed
+  r = store_store_data(CLIPBOARD_GENERAL, item_id, "com.example.extra", 3, (const unsigned char *)"abc");
+  assert(r == 1);
+  assert(store_item_atoms(CLIPBOARD_GENERAL, item_id, &atoms) == 2);
+  size_t extra_len = 0;
+  assert(store_fetch_data(CLIPBOARD_GENERAL, item_id, (char *)"com.example.extra", &extra_len, NULL) == 1);
+  assert(extra_len == 3);
+  assert(!store_is_promised(CLIPBOARD_GENERAL, item_id, "com.example.extra"));
+
+  // Data can come in through a sealed memfd and go out through one
+  int fd = clip_sealed_memfd("test", strlen(plain_text), plain_text);
+  assert(fd >= 0);
+  assert(clip_fd_is_sealed(fd));
+  uint16_t fd_item_id = store_create_item(CLIPBOARD_FIND, label, ":1.132", typelist, NULL, NULL);
+  r = store_store_fd(CLIPBOARD_FIND, fd_item_id, CLIPBOARD_TYPE_TEXT, fd);
+  assert(r == 1);
+  close(fd);
+
+  size_t fetched_len;
+  unsigned char *fetched;
+  r = store_fetch_data(CLIPBOARD_FIND, fd_item_id, (char *)CLIPBOARD_TYPE_TEXT, &fetched_len, &fetched);
+  assert(r == 1);
+  assert(fetched_len == strlen(plain_text));
+  assert(memcmp(fetched, plain_text, fetched_len) == 0);
+  free(fetched);
+
+  int fetched_fd;
+  r = store_fetch_fd(CLIPBOARD_GENERAL, item_id, (char *)CLIPBOARD_TYPE_RTF, &fetched_fd);
+  assert(r == 1);
+  assert(clip_fd_is_sealed(fetched_fd));
+  close(fetched_fd);
+  r = store_fetch_data(CLIPBOARD_GENERAL, item_id, (char *)CLIPBOARD_TYPE_RTF, &fetched_len, &fetched);
+  assert(fetched_len == strlen(rtf_text));
+  assert(memcmp(fetched, rtf_text, fetched_len) == 0);
+  free(fetched);
+
+  // Borrowed data outlives the item it came from
+  uint16_t style_item_id = store_create_item(CLIPBOARD_STYLE, label, ":1.132", typelist, NULL, NULL);
+  store_store_data(CLIPBOARD_STYLE, style_item_id, CLIPBOARD_TYPE_TEXT, strlen(plain_text), (const unsigned char *)plain_text);
+  const Payload *payload = store_retain_data(CLIPBOARD_STYLE, style_item_id, CLIPBOARD_TYPE_TEXT);
+  assert(payload != NULL);
+  assert(store_retain_data(CLIPBOARD_STYLE, style_item_id, CLIPBOARD_TYPE_RTF) == NULL);
+  store_create_item(CLIPBOARD_STYLE, label, ":1.132", typelist, &pushed_out_id, NULL);
+  assert(pushed_out_id == style_item_id);
+  assert(store_payload_length(payload) == strlen(plain_text));
+  assert(memcmp(store_payload_bytes(payload), plain_text, strlen(plain_text)) == 0);
+  store_payload_release(payload);
+
+  // Data can arrive in chunks
+  uint16_t drag_item_id = store_create_item(CLIPBOARD_DRAG, label, ":1.132", typelist, NULL, NULL);
+  uint32_t upload_id = store_begin_upload(CLIPBOARD_DRAG, drag_item_id, CLIPBOARD_TYPE_TEXT, ":1.132");
+  assert(upload_id != 0);
+  assert(store_append_upload(upload_id, ":1.999", 4, (const unsigned char *)plain_text) < 0);
+  size_t plain_len = strlen(plain_text);
+  for (size_t offset = 0; offset < plain_len; offset += 10) {
+    size_t chunklen = plain_len - offset < 10 ? plain_len - offset : 10;
+    r = store_append_upload(upload_id, ":1.132", chunklen, (const unsigned char *)plain_text + offset);
+    assert(r == 1);
+  }
+  assert(store_retain_data(CLIPBOARD_DRAG, drag_item_id, CLIPBOARD_TYPE_TEXT) == NULL);
+  r = store_commit_upload(upload_id, ":1.132");
+  assert(r == 1);
+  assert(store_commit_upload(upload_id, ":1.132") < 0);
+  r = store_fetch_data(CLIPBOARD_DRAG, drag_item_id, (char *)CLIPBOARD_TYPE_TEXT, &fetched_len, &fetched);
+  assert(fetched_len == plain_len);
+  assert(memcmp(fetched, plain_text, plain_len) == 0);
+  free(fetched);
+
+  // Uploads don't outlive their sender or their item, or grow past the budget
+  upload_id = store_begin_upload(CLIPBOARD_DRAG, drag_item_id, CLIPBOARD_TYPE_TEXT, ":1.140");
+  store_abort_uploads_of(":1.140");
+  assert(store_append_upload(upload_id, ":1.140", 4, (const unsigned char *)plain_text) < 0);
+  upload_id = store_begin_upload(CLIPBOARD_DRAG, drag_item_id, CLIPBOARD_TYPE_TEXT, ":1.132");
+  for (int i = 0; i < 3; i++) {
+    store_create_item(CLIPBOARD_DRAG, label, ":1.132", typelist, NULL, NULL);
+  }
+  assert(store_begin_upload(CLIPBOARD_DRAG, drag_item_id, CLIPBOARD_TYPE_TEXT, ":1.132") == 0);
+  assert(store_append_upload(upload_id, ":1.132", 4, (const unsigned char *)plain_text) < 0);
+  store_set_ring_budget(CLIPBOARD_DRAG, 16);
+  upload_id = store_begin_upload(CLIPBOARD_DRAG, 0, CLIPBOARD_TYPE_TEXT, ":1.132");
+  assert(store_append_upload(upload_id, ":1.132", 10, (const unsigned char *)plain_text) == 1);
+  assert(store_append_upload(upload_id, ":1.132", 10, (const unsigned char *)plain_text) < 0);
+  store_abort_upload(upload_id, ":1.132");
+  store_set_ring_budget(CLIPBOARD_DRAG, 0);
+
+  // Big data pushes out old items and waits in spill files
+  char spill_dir[] = "/tmp/store_test.XXXXXX";
+  assert(mkdtemp(spill_dir) != NULL);
+  store_set_spill(spill_dir, 1024);
+  store_set_eviction_handler(on_eviction);
+  store_set_ring_budget(CLIPBOARD_FIND, 3000);
+  size_t big_len = 2000;
+  unsigned char *big = (unsigned char *)malloc(big_len);
+  for (size_t i = 0; i < big_len; i++) {
+    big[i] = 'a' + i % 26;
+  }
+  uint16_t first_big_id = store_create_item(CLIPBOARD_FIND, label, ":1.132", typelist, NULL, NULL);
+  store_store_data(CLIPBOARD_FIND, first_big_id, CLIPBOARD_TYPE_TEXT, big_len, big);
+  uint16_t find_count = store_item_count(CLIPBOARD_FIND);
+  uint16_t second_big_id = store_create_item(CLIPBOARD_FIND, label, ":1.132", typelist, NULL, NULL);
+  store_store_data(CLIPBOARD_FIND, second_big_id, CLIPBOARD_TYPE_TEXT, big_len, big);
+  assert(store_byte_count(CLIPBOARD_FIND) <= 3000);
+  assert(store_item_count(CLIPBOARD_FIND) < find_count);
+  assert(eviction_count > 0);
+  assert(store_retain_data(CLIPBOARD_FIND, first_big_id, CLIPBOARD_TYPE_TEXT) == NULL);
+  const Payload *spilled = store_retain_data(CLIPBOARD_FIND, second_big_id, CLIPBOARD_TYPE_TEXT);
+  assert(spilled != NULL);
+  assert(memcmp(store_payload_bytes(spilled), big, big_len) == 0);
+  store_payload_release(spilled);
+  // A range of spilled data is read without mapping the rest
+  spilled = store_retain_payload(CLIPBOARD_FIND, second_big_id, CLIPBOARD_TYPE_TEXT);
+  unsigned char spilled_part[100];
+  assert(store_payload_read(spilled, big_len - 100, 100, spilled_part) == 0);
+  assert(memcmp(spilled_part, big + big_len - 100, 100) == 0);
+  assert(store_payload_read(spilled, big_len - 99, 100, spilled_part) < 0);
+  store_payload_discard(spilled);
+  free(big);
+  store_set_spill(NULL, 0);
+  rmdir(spill_dir);
+
+  // The same bytes copied again are held once
+  struct store_memory_stats before, after;
+  store_get_memory_stats(&before);
+  uint16_t copy_id = store_create_item(CLIPBOARD_GENERAL, label, ":1.132", typelist, NULL, NULL);
+  store_store_data(CLIPBOARD_GENERAL, copy_id, CLIPBOARD_TYPE_TEXT, strlen(rtf_text), (const unsigned char *)rtf_text);
+  store_store_data(CLIPBOARD_GENERAL, copy_id, CLIPBOARD_TYPE_RTF, strlen(rtf_text), (const unsigned char *)rtf_text);
+  store_get_memory_stats(&after);
+  assert(after.dedup_hits == before.dedup_hits + 2);
+  assert(after.logical_bytes == before.logical_bytes + 2 * strlen(rtf_text));
+  assert(after.stored_bytes == before.stored_bytes);
+  const Payload *text_payload = store_retain_data(CLIPBOARD_GENERAL, copy_id, CLIPBOARD_TYPE_TEXT);
+  const Payload *rtf_payload = store_retain_data(CLIPBOARD_GENERAL, copy_id, CLIPBOARD_TYPE_RTF);
+  assert(text_payload == rtf_payload);
+  store_payload_release(text_payload);
+  store_payload_release(rtf_payload);
+
+  // The whole ring can be walked at once, with small data inline
+  size_t max_inline = 64;
+  assert(store_visit_items(CLIPBOARD_GENERAL, 0, 0, max_inline, SIZE_MAX, on_visit, &max_inline) == store_item_count(CLIPBOARD_GENERAL));
+  assert(last_visited_id == copy_id);
+  visited_inline = 0;
+  last_visited_id = 0;
+  max_inline = 1024;
+  assert(store_visit_items(CLIPBOARD_GENERAL, copy_id, copy_id, max_inline, SIZE_MAX, on_visit, &max_inline) == 1);
+  assert(visited_inline == 2);
+  // Data past the total is left out, even if each piece is small enough
+  visited_inline = 0;
+  last_visited_id = 0;
+  assert(store_visit_items(CLIPBOARD_GENERAL, copy_id, copy_id, max_inline, strlen(rtf_text),
+			   on_visit, &max_inline) == 1);
+  assert(visited_inline == 1);
+
+  // Text that compresses well is held compressed, and reads back whole
+  store_set_compression(4096);
+  size_t log_len = 200000;
+  unsigned char *log = (unsigned char *)malloc(log_len);
+  for (size_t i = 0; i < log_len; i++) {
+    log[i] = "clipboard log line "[i % 19] + (i / 1000) % 3;
+  }
+  store_get_memory_stats(&before);
+  uint16_t log_id = store_create_item(CLIPBOARD_GENERAL, label, ":1.132", typelist, NULL, NULL);
+  assert(store_store_data(CLIPBOARD_GENERAL, log_id, CLIPBOARD_TYPE_TEXT, log_len, log) == 1);
+  store_get_memory_stats(&after);
+  assert(after.stored_bytes - before.stored_bytes < log_len / 4);
+  const Payload *log_payload = store_retain_data(CLIPBOARD_GENERAL, log_id, CLIPBOARD_TYPE_TEXT);
+  assert(store_payload_length(log_payload) == log_len);
+  assert(memcmp(store_payload_bytes(log_payload), log, log_len) == 0);
+  store_payload_release(log_payload);
+
+  // Workers copy data off the store's thread. Data prepared there is
+  // still shared with identical data...
+  PreparedData *prepared = NULL;
+  std::thread preparer([&] { prepared = store_prepare_data(log_len, log); });
+  preparer.join();
+  assert(prepared != NULL);
+  store_get_memory_stats(&before);
+  uint16_t prepared_id = store_create_item(CLIPBOARD_GENERAL, label, ":1.132", typelist, NULL, NULL);
+  assert(store_store_prepared(CLIPBOARD_GENERAL, prepared_id, CLIPBOARD_TYPE_TEXT, prepared) == 1);
+  store_get_memory_stats(&after);
+  assert(after.dedup_hits == before.dedup_hits + 1);
+  prepared = store_prepare_data(log_len, log);
+  assert(store_store_prepared(CLIPBOARD_GENERAL, 9999, CLIPBOARD_TYPE_TEXT, prepared) == 0);
+
+  // ...and several of them can read a compressed payload at once
+  const Payload *views[4];
+  std::thread readers[4];
+  std::atomic<int> matches(0);
+  for (int i = 0; i < 4; i++) {
+    views[i] = store_retain_payload(CLIPBOARD_GENERAL, log_id, CLIPBOARD_TYPE_TEXT);
+    readers[i] = std::thread([&, i] {
+      const unsigned char *bytes = store_payload_open(views[i]);
+      if (bytes && memcmp(bytes, log, log_len) == 0) {
+	matches++;
+      }
+    });
+  }
+  for (int i = 0; i < 4; i++) {
+    readers[i].join();
+    store_payload_release(views[i]);
+  }
+  assert(matches == 4);
+
+  // The pages they decompressed into went back to the kernel, but the
+  // block is kept for the next reader
+  store_get_memory_stats(&after);
+  assert(after.idle_page_bytes >= log_len);
+  log_payload = store_retain_data(CLIPBOARD_GENERAL, log_id, CLIPBOARD_TYPE_TEXT);
+  store_get_memory_stats(&before);
+  assert(before.idle_page_bytes < after.idle_page_bytes);
+  store_payload_release(log_payload);
+
+  size_t rawlen, framelen;
+  unsigned char *frame;
+  assert(store_fetch_compressed(CLIPBOARD_GENERAL, log_id, CLIPBOARD_TYPE_TEXT, &rawlen, &framelen, &frame) == 1);
+  assert(rawlen == log_len);
+  unsigned char *decoded = (unsigned char *)malloc(rawlen);
+  assert(clip_lz4_frame_decode(frame, framelen, decoded, rawlen) == 1);
+  assert(memcmp(decoded, log, log_len) == 0);
+  free(decoded);
+
+  // The frame can be read in place, without a copy
+  log_payload = store_retain_payload(CLIPBOARD_GENERAL, log_id, CLIPBOARD_TYPE_TEXT);
+  size_t in_place_len;
+  const unsigned char *in_place = store_payload_frame(log_payload, &in_place_len);
+  assert(in_place != NULL && in_place_len == framelen);
+  assert(memcmp(in_place, frame, framelen) == 0);
+  store_payload_discard(log_payload);
+  free(frame);
+
+  // Handing compressed data out in a memfd keeps it compressed
+  int log_fd;
+  assert(store_fetch_fd(CLIPBOARD_GENERAL, log_id, (char *)CLIPBOARD_TYPE_TEXT, &log_fd) == 1);
+  assert(clip_fd_is_sealed(log_fd));
+  close(log_fd);
+  assert(store_fetch_compressed(CLIPBOARD_GENERAL, log_id, CLIPBOARD_TYPE_TEXT, &rawlen, &framelen, &frame) == 1);
+  free(frame);
+
+  // Ranges of compressed data decode only the blocks they cover, whole or
+  // in part
+  const Payload *log_part = store_retain_payload(CLIPBOARD_GENERAL, log_id, CLIPBOARD_TYPE_TEXT);
+  size_t part_len = CLIP_LZ4_BLOCK_SIZE + 2000;
+  unsigned char *part = (unsigned char *)malloc(part_len);
+  size_t part_offsets[] = { 0, 1000, CLIP_LZ4_BLOCK_SIZE - 1000, log_len - part_len };
+  for (int i = 0; i < 4; i++) {
+    assert(store_payload_read(log_part, part_offsets[i], part_len, part) == 0);
+    assert(memcmp(part, log + part_offsets[i], part_len) == 0);
+  }
+  assert(store_payload_read(log_part, log_len, 0, part) == 0);
+  assert(store_payload_read(log_part, log_len - 10, 11, part) < 0);
+  free(part);
+  store_payload_discard(log_part);
+
+  // Bytes that don't compress are held as they are
+  uint32_t noise = 2463534242u;
+  for (size_t i = 0; i < log_len; i++) {
+    noise ^= noise << 13;
+    noise ^= noise >> 17;
+    noise ^= noise << 5;
+    log[i] = (unsigned char)noise;
+  }
+  uint16_t noise_id = store_create_item(CLIPBOARD_GENERAL, label, ":1.132", typelist, NULL, NULL);
+  assert(store_store_data(CLIPBOARD_GENERAL, noise_id, CLIPBOARD_TYPE_TEXT, log_len, log) == 1);
+  assert(store_fetch_compressed(CLIPBOARD_GENERAL, noise_id, CLIPBOARD_TYPE_TEXT, &rawlen, &framelen, &frame) == 0);
+  const Payload *noise_payload = store_retain_payload(CLIPBOARD_GENERAL, noise_id, CLIPBOARD_TYPE_TEXT);
+  assert(store_payload_frame(noise_payload, &framelen) == NULL);
+  store_payload_discard(noise_payload);
+  store_set_compression(0);
+  free(log);
+
+  // Boards made by name: the same name finds the same board, with the
+  // settings it was made with, and the built-in boards have names too
+  assert(store_open_board("general", 1, 1) == CLIPBOARD_GENERAL);
+  assert(store_open_board("drag", 1, 1) == CLIPBOARD_DRAG);
+  int workspace = store_open_board("workspace-2", 2, 0);
+  assert(workspace >= CLIPBOARD_COUNT);
+  assert(store_open_board("workspace-2", 9, 0) == workspace);
+  assert(strcmp(store_board_name(workspace), "workspace-2") == 0);
+  int terminal = store_open_board("terminal", 3, 0);
+  assert(terminal >= CLIPBOARD_COUNT && terminal != workspace);
+  assert(store_board_count() == CLIPBOARD_COUNT + 2);
+  assert(store_open_board("", 1, 0) < 0);
+  for (int i = 0; i < 3; i++) {
+    store_create_item(workspace, label, ":1.132", typelist, NULL, NULL);
+  }
+  assert(store_item_count(workspace) == 2);
+  assert(store_item_count(terminal) == 0);
+  uint16_t workspace_item = store_last_item_id(workspace);
+  assert(store_store_data(workspace, workspace_item, CLIPBOARD_TYPE_TEXT, 4, (const unsigned char *)"ws 2") == 1);
+  int boards_seen = 0;
+  store_visit_boards(on_board, &boards_seen);
+  assert(boards_seen == 1);
+
+  // Evictions are counted, and live payloads by the bit length of their size
+  struct store_memory_stats counted;
+  store_get_memory_stats(&counted);
+  assert(counted.evictions > 0);
+  assert(counted.payload_sizes[3] >= 1);
+  uint64_t sized = 0;
+  for (int i = 0; i < STORE_SIZE_BUCKETS; i++) {
+    sized += counted.payload_sizes[i];
+  }
+  assert(sized == counted.payload_count);
+
+  // Idle named boards are dropped with their items; built-in ones stay
+  uint16_t dropped = 0;
+  assert(store_drop_idle_boards(3600, on_dropped, &dropped) == 0);
+  eviction_count = 0;
+  assert(store_drop_idle_boards(0, on_dropped, &dropped) == 2);
+  assert(eviction_count == 2);
+  assert(dropped == workspace || dropped == terminal);
+  assert(store_board_name(workspace) == NULL);
+  assert(store_board_count() == CLIPBOARD_COUNT);
+  assert(store_create_item(workspace, label, ":1.132", typelist, NULL, NULL) == 0);
+  assert(store_item_count(CLIPBOARD_GENERAL) > 0);
+  // A dropped board's id isn't handed out again straight away
+  int reopened = store_open_board("workspace-2", 2, 0);
+  assert(reopened >= CLIPBOARD_COUNT && reopened != workspace && reopened != terminal);
+  assert(store_item_count(reopened) == 0);
+
+  // Deep rings: ids start over after INT16_MAX, and each id on the ring
+  // still finds its own item
+  int deep = store_open_board("deep", 20000, 0);
+  char deep_label[16];
+  for (int i = 0; i < 40000; i++) {
+    snprintf(deep_label, sizeof(deep_label), "%d", i);
+    store_create_item(deep, deep_label, ":1.132", typelist, NULL, NULL);
+  }
+  assert(store_item_count(deep) == 20000);
+  uint16_t newest = store_last_item_id(deep);
+  assert(newest == 40000 - INT16_MAX);
+  for (int back = 0; back < 20000; back++) {
+    uint16_t id = (newest - 1 - back + INT16_MAX) % INT16_MAX + 1;
+    snprintf(deep_label, sizeof(deep_label), "%d", 39999 - back);
+    assert(strcmp(store_label_for_item(deep, id), deep_label) == 0);
+  }
+  assert(store_label_for_item(deep, newest + 1) == NULL);
+  assert(store_label_for_item(deep, INT16_MAX + 1) == NULL);
+
+  // Shrinking a ring keeps its newest items
+  eviction_count = 0;
+  store_set_ring_size(deep, 10);
+  assert(eviction_count == 19990);
+  assert(store_item_count(deep) == 10);
+  assert(strcmp(store_label_for_item(deep, newest), "39999") == 0);
+  uint16_t next_id = store_create_item(deep, label, ":1.132", typelist, &pushed_out_id, NULL);
+  assert(next_id == newest + 1);
+  assert(pushed_out_id == newest - 9);
+
+  // Plain text can be made from the RTF, and keeps a lazy provider's
+  // promise for it. It counts against the board like pushed data.
+  int converting = store_open_board("converting", 5, 0);
+  char **rtf_first = clip_create_typelist(2, CLIPBOARD_TYPE_RTF, CLIPBOARD_TYPE_TEXT);
+  uint16_t rtf_item = store_create_item(converting, label, ":1.132", rtf_first, NULL, NULL);
+  assert(store_convert_data(converting, rtf_item, CLIPBOARD_TYPE_TEXT) == 0);
+  store_store_data(converting, rtf_item, CLIPBOARD_TYPE_RTF, strlen(rtf_text), (const unsigned char *)rtf_text);
+  assert(store_is_promised(converting, rtf_item, CLIPBOARD_TYPE_TEXT));
+  assert(store_convert_data(converting, rtf_item, CLIPBOARD_TYPE_PNG) == 0);
+  assert(store_convert_data(converting, rtf_item, CLIPBOARD_TYPE_TEXT) == 1);
+  assert(!store_is_promised(converting, rtf_item, CLIPBOARD_TYPE_TEXT));
+  size_t converted_len;
+  unsigned char *converted;
+  assert(store_fetch_data(converting, rtf_item, (char *)CLIPBOARD_TYPE_TEXT, &converted_len, &converted) == 1);
+  const char *rtf_as_text = "This is some bold text that you might want to copy\n";
+  assert(converted_len == strlen(rtf_as_text) && memcmp(converted, rtf_as_text, converted_len) == 0);
+  free(converted);
+  assert(store_byte_count(converting) == strlen(rtf_text) + converted_len);
+  assert(store_convert_data(converting, rtf_item, CLIPBOARD_TYPE_TEXT) == 1);
+  assert(store_byte_count(converting) == strlen(rtf_text) + converted_len);
+  clip_free_typelist(rtf_first);
+
+  // Text, converted or pushed, can be searched, newest first, until its
+  // item is pushed out
+  char **text_only = clip_create_typelist(1, CLIPBOARD_TYPE_TEXT);
+  uint16_t text_item = store_create_item(converting, label, ":1.132", text_only, NULL, NULL);
+  const char *text = "Some more BOLD text\nto copy";
+  store_store_data(converting, text_item, CLIPBOARD_TYPE_TEXT, strlen(text), (const unsigned char *)text);
+  matched_count = 0;
+  assert(store_search(converting, "bold text", 0, on_match, (void *)"bold text") == 2);
+  assert(matched_ids[0] == text_item && matched_ids[1] == rtf_item);
+  matched_count = 0;
+  assert(store_search(converting, "bold text", 1, on_match, (void *)"bold text") == 1);
+  matched_count = 0;
+  assert(store_search(converting, "might", 0, on_match, (void *)"might") == 1);
+  assert(matched_ids[0] == rtf_item);
+  // Too short for the index, so every text is read
+  matched_count = 0;
+  assert(store_search(converting, "to", 0, on_match, (void *)"to") == 2);
+  assert(store_search(converting, "bold texts", 0, on_match, NULL) == 0);
+  assert(store_search(converting, "nowhere", 0, on_match, NULL) == 0);
+  assert(store_search(9999, "bold", 0, on_match, NULL) < 0);
+  for (int i = 0; i < 4; i++) {
+    store_create_item(converting, label, ":1.132", text_only, NULL, NULL);
+  }
+  matched_count = 0;
+  assert(store_search(converting, "bold text", 0, on_match, (void *)"bold text") == 1);
+  assert(matched_ids[0] == text_item);
+  clip_free_typelist(text_only);
+
   char **typelist2 = clip_create_typelist(1, CLIPBOARD_TYPE_PNG);
     
   const char *label2 = "Test label2";